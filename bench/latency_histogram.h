@@ -0,0 +1,76 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// HDR-style latency histogram: log-linear buckets covering 1us .. ~76h with a
+// relative error below 1/SUB_BUCKETS (under 1%), so percentiles stay accurate
+// at any scale in a few KB. Recording is a couple of shifts and an increment;
+// keep one per thread and merge() them when reporting.
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 7;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS; // 128
+    static const int HALF = SUB_BUCKETS / 2;
+    static const int MAGNITUDES = 32;
+    static const uint64_t MAX_TRACKABLE = (1ULL << (MAGNITUDES + SUB_BUCKET_BITS - 1)) - 1;
+
+    LatencyHistogram() : counts(MAGNITUDES * HALF + HALF, 0), total(0), max_value(0) {}
+
+    void record(uint64_t value_us) {
+        counts[index_of(value_us)]++;
+        total++;
+        max_value = std::max(max_value, value_us);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); ++i) counts[i] += other.counts[i];
+        total += other.total;
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return max_value; }
+
+    // Smallest recorded value such that p percent of the samples are at or below it
+    // (reported as the upper edge of its bucket)
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(upper_edge(i), max_value);
+        }
+        return max_value;
+    }
+
+private:
+    // Values below SUB_BUCKETS map linearly; above that, each power of two is split
+    // into HALF equal buckets. Values beyond MAX_TRACKABLE land in the last bucket.
+    static size_t index_of(uint64_t value) {
+        if (value < (uint64_t)SUB_BUCKETS) return value;
+        value = std::min(value, MAX_TRACKABLE);
+        int magnitude = 63 - __builtin_clzll(value) - (SUB_BUCKET_BITS - 1);
+        uint64_t sub = value >> magnitude; // in [HALF, SUB_BUCKETS)
+        return magnitude * HALF + sub;
+    }
+
+    static uint64_t upper_edge(size_t index) {
+        if (index < (size_t)SUB_BUCKETS) return index;
+        size_t magnitude = (index - HALF) / HALF;
+        uint64_t sub = index - magnitude * HALF;
+        return ((sub + 1) << magnitude) - 1;
+    }
+
+    vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max_value;
+};
+
+#endif // LATENCY_HISTOGRAM_H
@@ -0,0 +1,360 @@
+// Loopback swarm benchmark: starts trackers, seeders and leechers on 127.0.0.1,
+// has every leecher download the same files at once and reports aggregate
+// throughput, time-to-completion percentiles and CPU time per GB moved.
+//
+// Clients are driven through their console exactly like a user would, and a
+// download counts as finished when the client logs "Download completed for".
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+struct Options {
+    string bin_dir = "..";
+    int trackers = 2;
+    int seeders = 2;
+    int leechers = 4;
+    int files = 1;
+    long long size_mb = 64;
+    int delay_ms = 0;
+    long long rate_kbps = 0;
+    int base_port = 6500;
+    int timeout_s = 300;
+    bool keep = false; // keep the work directory with the generated and downloaded files
+};
+
+struct Process {
+    pid_t pid = -1;
+    int in_fd = -1;  // our end of its stdin
+    int out_fd = -1; // read side of its log file, which receives its stdout and stderr
+    string pending;  // output not yet split into lines
+    string name;
+};
+
+static void usage() {
+    cerr << "Usage: swarm_bench [--bin-dir DIR] [--trackers N] [--seeders N] [--leechers N]\n"
+            "                   [--files N] [--size-mb N] [--delay-ms N] [--rate-kbps N]\n"
+            "                   [--base-port N] [--timeout-s N] [--keep 0|1]\n"
+            "  --delay-ms and --rate-kbps emulate a slower link inside every client\n"
+            "  (each peer reply is delayed, piece uploads are paced to the rate)." << endl;
+}
+
+static bool parse_options(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        string value = argv[++i];
+        if (arg == "--bin-dir") opt.bin_dir = value;
+        else if (arg == "--trackers") opt.trackers = stoi(value);
+        else if (arg == "--seeders") opt.seeders = stoi(value);
+        else if (arg == "--leechers") opt.leechers = stoi(value);
+        else if (arg == "--files") opt.files = stoi(value);
+        else if (arg == "--size-mb") opt.size_mb = stoll(value);
+        else if (arg == "--delay-ms") opt.delay_ms = stoi(value);
+        else if (arg == "--rate-kbps") opt.rate_kbps = stoll(value);
+        else if (arg == "--base-port") opt.base_port = stoi(value);
+        else if (arg == "--timeout-s") opt.timeout_s = stoi(value);
+        else if (arg == "--keep") opt.keep = value != "0";
+        else return false;
+    }
+    return opt.trackers > 0 && opt.seeders > 0 && opt.leechers > 0 && opt.files > 0 && opt.size_mb > 0;
+}
+
+// Output goes to <work_dir>/<name>.log rather than a pipe, so that a process we are
+// not reading from at the moment can never block on a full pipe
+static Process spawn(const string& work_dir, const string& name, const vector<string>& argv,
+                     const vector<pair<string, string>>& env) {
+    int in_pipe[2];
+    if (pipe(in_pipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    string log_path = work_dir + "/" + name + ".log";
+    int log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Process proc;
+    proc.name = name;
+    proc.pid = fork();
+    if (proc.pid == 0) {
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        close(in_pipe[0]); close(in_pipe[1]); close(log_fd);
+        for (const auto& var : env) setenv(var.first.c_str(), var.second.c_str(), 1);
+        vector<char*> args;
+        for (const auto& arg : argv) args.push_back(const_cast<char*>(arg.c_str()));
+        args.push_back(nullptr);
+        execv(args[0], args.data());
+        perror("execv");
+        _exit(127);
+    }
+    close(in_pipe[0]);
+    close(log_fd);
+    proc.in_fd = in_pipe[1];
+    proc.out_fd = open(log_path.c_str(), O_RDONLY);
+    return proc;
+}
+
+static void send_line(Process& proc, const string& line) {
+    string data = line + "\n";
+    if (write(proc.in_fd, data.c_str(), data.size()) < 0) {
+        cerr << "write to " << proc.name << " failed" << endl;
+    }
+}
+
+// Hand the complete lines the processes printed since the last call to on_line,
+// sleeping poll_ms first if none of them printed anything
+static void pump_output(vector<Process*>& procs, int poll_ms,
+                        const function<void(Process&, const string&)>& on_line) {
+    char buf[65536];
+    bool any = false;
+    for (auto* proc : procs) {
+        ssize_t n;
+        while ((n = read(proc->out_fd, buf, sizeof(buf))) > 0) {
+            proc->pending.append(buf, n);
+            any = true;
+        }
+        size_t newline;
+        while ((newline = proc->pending.find('\n')) != string::npos) {
+            on_line(*proc, proc->pending.substr(0, newline));
+            proc->pending.erase(0, newline + 1);
+        }
+    }
+    if (!any) this_thread::sleep_for(chrono::milliseconds(poll_ms));
+}
+
+// Send a command and wait until the process prints a line containing `expect`
+static bool command(Process& proc, const string& line, const string& expect, int timeout_ms = 10000) {
+    send_line(proc, line);
+    bool seen = false;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    vector<Process*> only(1, &proc);
+    while (!seen && chrono::steady_clock::now() < deadline) {
+        pump_output(only, 5, [&](Process&, const string& out) {
+            if (out.find(expect) != string::npos) seen = true;
+        });
+    }
+    if (!seen) cerr << proc.name << ": no '" << expect << "' after: " << line << endl;
+    return seen;
+}
+
+// utime + stime of a live process, in seconds
+static double cpu_seconds(pid_t pid) {
+    ifstream stat_file("/proc/" + to_string(pid) + "/stat");
+    string content((istreambuf_iterator<char>(stat_file)), istreambuf_iterator<char>());
+    size_t close_paren = content.rfind(')');
+    if (close_paren == string::npos) return 0;
+    istringstream fields(content.substr(close_paren + 2));
+    string field;
+    double ticks = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14 || i == 15) ticks += stod(field);
+    }
+    return ticks / sysconf(_SC_CLK_TCK);
+}
+
+static bool same_contents(const string& a, const string& b) {
+    ifstream fa(a, ios::binary), fb(b, ios::binary);
+    if (!fa || !fb) return false;
+    vector<char> ba(1 << 20), bb(1 << 20);
+    while (fa && fb) {
+        fa.read(ba.data(), ba.size());
+        fb.read(bb.data(), bb.size());
+        if (fa.gcount() != fb.gcount() || memcmp(ba.data(), bb.data(), fa.gcount()) != 0) return false;
+    }
+    return fa.eof() && fb.eof();
+}
+
+static double percentile(vector<double> values, double p) {
+    if (values.empty()) return 0;
+    sort(values.begin(), values.end());
+    size_t rank = (size_t)(p / 100.0 * (values.size() - 1) + 0.5);
+    return values[min(rank, values.size() - 1)];
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    if (!parse_options(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char dir_template[] = "/tmp/p2p_bench.XXXXXX";
+    string work_dir = mkdtemp(dir_template);
+    string info_file = work_dir + "/tracker_info.txt";
+    {
+        ofstream info(info_file);
+        for (int t = 0; t < opt.trackers; ++t) info << "127.0.0.1:" << opt.base_port + t << "\n";
+    }
+
+    // Random content so that compression and dedup cannot shortcut the transfer
+    vector<string> file_names;
+    mt19937_64 rng(42);
+    for (int f = 0; f < opt.files; ++f) {
+        string name = "bench_" + to_string(f) + ".bin";
+        ofstream out(work_dir + "/" + name, ios::binary);
+        vector<uint64_t> block(1 << 17);
+        for (long long mb = 0; mb < opt.size_mb; ++mb) {
+            for (auto& word : block) word = rng();
+            out.write((const char*)block.data(), block.size() * sizeof(uint64_t));
+        }
+        file_names.push_back(name);
+    }
+
+    vector<pair<string, string>> client_env;
+    client_env.push_back(make_pair("P2P_EMULATE_DELAY_MS", to_string(opt.delay_ms)));
+    client_env.push_back(make_pair("P2P_EMULATE_RATE_KBPS", to_string(opt.rate_kbps)));
+
+    vector<Process> trackers;
+    for (int t = 0; t < opt.trackers; ++t) {
+        trackers.push_back(spawn(work_dir, "tracker" + to_string(t),
+                                 {opt.bin_dir + "/tracker/tracker", info_file, to_string(t + 1)}, {}));
+    }
+    // Trackers only replicate to peers they are connected to, so wait for the full sync
+    // mesh: every tracker logs one line per peer, whichever side dialed
+    vector<Process*> tracker_ptrs;
+    for (auto& proc : trackers) tracker_ptrs.push_back(&proc);
+    map<string, int> mesh_links;
+    auto mesh_deadline = chrono::steady_clock::now() + chrono::seconds(15);
+    auto mesh_complete = [&]() {
+        for (auto& proc : trackers) {
+            if (mesh_links[proc.name] < opt.trackers - 1) return false;
+        }
+        return true;
+    };
+    while (!mesh_complete() && chrono::steady_clock::now() < mesh_deadline) {
+        pump_output(tracker_ptrs, 20, [&](Process& proc, const string& line) {
+            if (line.find("Connected to tracker") != string::npos ||
+                line.find("connected for synchronization") != string::npos) {
+                mesh_links[proc.name]++;
+            }
+        });
+    }
+    if (!mesh_complete()) cerr << "warning: trackers did not all connect to each other" << endl;
+
+    vector<Process> seeders, leechers;
+    for (int s = 0; s < opt.seeders; ++s) {
+        seeders.push_back(spawn(work_dir, "seeder" + to_string(s), {opt.bin_dir + "/client/client", info_file}, client_env));
+    }
+    for (int l = 0; l < opt.leechers; ++l) {
+        leechers.push_back(spawn(work_dir, "leecher" + to_string(l), {opt.bin_dir + "/client/client", info_file}, client_env));
+    }
+    vector<Process*> clients;
+    for (auto& proc : seeders) clients.push_back(&proc);
+    for (auto& proc : leechers) clients.push_back(&proc);
+    this_thread::sleep_for(chrono::milliseconds(300));
+
+    // Setup: accounts, one group, seeder 0 uploads, the other seeders fetch a copy first
+    bool ok = true;
+    for (size_t c = 0; c < clients.size(); ++c) {
+        string user = "bench_user" + to_string(c);
+        ok = command(*clients[c], "create_user " + user + " pw", "User created") && ok;
+        ok = command(*clients[c], "login " + user + " pw", "Login successful") && ok;
+    }
+    ok = command(seeders[0], "create_group bench", "success") && ok;
+    for (size_t c = 1; c < clients.size(); ++c) {
+        ok = command(*clients[c], "join_group bench", "success") && ok;
+        ok = command(seeders[0], "accept_request bench bench_user" + to_string(c), "success") && ok;
+    }
+    for (const auto& name : file_names) {
+        ok = command(seeders[0], "upload_file bench " + work_dir + "/" + name, "uploaded", 120000) && ok;
+    }
+    for (int s = 1; s < opt.seeders; ++s) {
+        mkdir((work_dir + "/seeder" + to_string(s)).c_str(), 0777);
+        for (const auto& name : file_names) {
+            ok = command(seeders[s], "download_file bench " + name + " " + work_dir + "/seeder" +
+                         to_string(s) + "/" + name, "Download completed for " + name, opt.timeout_s * 1000) && ok;
+        }
+    }
+    if (!ok) cerr << "warning: setup did not complete cleanly, results may be off" << endl;
+
+    // Timed phase: every leecher downloads every file at once
+    map<pid_t, double> cpu_before;
+    for (auto& proc : trackers) cpu_before[proc.pid] = cpu_seconds(proc.pid);
+    for (auto* proc : clients) cpu_before[proc->pid] = cpu_seconds(proc->pid);
+
+    auto start = chrono::steady_clock::now();
+    for (int l = 0; l < opt.leechers; ++l) {
+        string dest_dir = work_dir + "/leecher" + to_string(l);
+        mkdir(dest_dir.c_str(), 0777);
+        for (const auto& name : file_names) {
+            send_line(leechers[l], "download_file bench " + name + " " + dest_dir + "/" + name);
+        }
+    }
+
+    vector<Process*> leecher_ptrs;
+    for (auto& proc : leechers) leecher_ptrs.push_back(&proc);
+    vector<double> completion_s;
+    int failed = 0;
+    size_t expected = (size_t)opt.leechers * opt.files;
+    auto deadline = start + chrono::seconds(opt.timeout_s);
+    while (completion_s.size() + failed < expected && chrono::steady_clock::now() < deadline) {
+        pump_output(leecher_ptrs, 5, [&](Process&, const string& line) {
+            if (line.find("Download completed for") != string::npos) {
+                completion_s.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+            } else if (line.find("Download failed for") != string::npos) {
+                failed++;
+            }
+        });
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    double cpu_used = 0;
+    for (auto& proc : trackers) cpu_used += cpu_seconds(proc.pid) - cpu_before[proc.pid];
+    for (auto* proc : clients) cpu_used += cpu_seconds(proc->pid) - cpu_before[proc->pid];
+
+    int corrupt = 0;
+    for (int l = 0; l < opt.leechers; ++l) {
+        for (const auto& name : file_names) {
+            string got = work_dir + "/leecher" + to_string(l) + "/" + name;
+            if (!same_contents(work_dir + "/" + name, got)) corrupt++;
+        }
+    }
+
+    for (auto* proc : clients) send_line(*proc, "quit");
+    this_thread::sleep_for(chrono::milliseconds(200));
+    for (auto* proc : clients) kill(proc->pid, SIGKILL);
+    for (auto& proc : trackers) kill(proc.pid, SIGKILL);
+    for (auto* proc : clients) waitpid(proc->pid, nullptr, 0);
+    for (auto& proc : trackers) waitpid(proc.pid, nullptr, 0);
+
+    double gb_moved = completion_s.size() * opt.size_mb / 1024.0;
+    double mb_moved = completion_s.size() * opt.size_mb;
+    double wall = completion_s.empty() ? elapsed : completion_s.back();
+
+    cout << fixed << setprecision(2);
+    cout << "swarm_bench: trackers=" << opt.trackers << " seeders=" << opt.seeders << " leechers=" << opt.leechers
+         << " files=" << opt.files << " size_mb=" << opt.size_mb << " delay_ms=" << opt.delay_ms
+         << " rate_kbps=" << opt.rate_kbps << "\n";
+    cout << "  downloads      " << completion_s.size() << "/" << expected << " completed, " << failed
+         << " failed, " << corrupt << " missing or corrupt\n";
+    cout << "  aggregate      " << (wall > 0 ? mb_moved / wall : 0) << " MB/s (" << mb_moved << " MB in " << wall << " s)\n";
+    cout << "  completion     p50 " << percentile(completion_s, 50) << " s  p90 " << percentile(completion_s, 90)
+         << " s  p99 " << percentile(completion_s, 99) << " s  max " << percentile(completion_s, 100) << " s\n";
+    cout << "  cpu            " << cpu_used << " s total, " << (gb_moved > 0 ? cpu_used / gb_moved : 0) << " s/GB\n";
+    if (opt.keep) {
+        cout << "  work dir       " << work_dir << endl;
+    } else if (system(("rm -rf '" + work_dir + "'").c_str()) != 0) {
+        cerr << "could not remove " << work_dir << endl;
+    }
+
+    return (completion_s.size() == expected && corrupt == 0) ? 0 : 2;
+}
@@ -0,0 +1,426 @@
+// Deterministic swarm simulator: runs the client's PieceScheduler (the same code
+// download_manager uses) for thousands of simulated peers in virtual time, so a
+// piece- or peer-selection change can be judged on swarm-wide completion times
+// in seconds instead of on real sockets.
+//
+// Model, per leecher: ask the tracker for seeders, race connects to the ones the
+// scheduler picks, then request pieces one at a time over the session, like
+// download_manager. Peer exchange is not modelled: where download_manager first tries
+// seeders gossiped by other peers on REFRESH, a simulated leecher goes straight back
+// to the tracker. A finished leecher tells the tracker it seeds the file and
+// serves others from then on. Links have a per-peer one-way latency; every peer has
+// an upload rate (and optionally a download cap), and an uploader serves the
+// requests it receives first-come first-served at that rate. Peers may leave at
+// random (churn), and a transfer may arrive corrupted and fail its hash.
+//
+// Everything random comes from one seeded generator and events are ordered by
+// (time, sequence number), so a given set of options always gives the same result.
+
+#include "piece_scheduler.h"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Mirrors of the client and tracker constants that shape the timing
+const double PIECE_BYTES = 512 * 1024;
+const double PEER_CONNECT_TIMEOUT_S = 1.0;  // client PEER_CONNECT_TIMEOUT_MS
+const double SEEDER_TIMEOUT_S = 30.0;       // tracker SEEDER_TIMEOUT_S
+const size_t SEEDER_REPLY_LIMIT = 8;        // tracker SEEDER_REPLY_LIMIT
+// The tracker weighs every seeder; the simulated one weighs a random sample this large
+const size_t TRACKER_SAMPLE = 64;
+
+struct Options {
+    int peers = 10000;
+    int seeders = 4;
+    int pieces = 128;
+    double up_kbps = 10240;
+    double up_spread = 0.5;  // upload rates are uniform in up_kbps * [1 - spread, 1 + spread]
+    double down_kbps = 0;    // 0 = only the uploader limits a transfer
+    double latency_ms = 20;  // mean one-way latency of a peer's link
+    double arrival_s = 0;    // leechers arrive uniformly over this window (0 = flash crowd)
+    double lifetime_s = 0;   // mean time a peer stays before leaving at random (0 = no churn)
+    double seed_time_s = -1; // how long a finished leecher keeps seeding (-1 = until the end)
+    double corrupt = 0;      // probability that a transfer fails its hash
+    double max_time_s = 86400;
+    unsigned long long seed = 1;
+};
+
+enum EventType { ARRIVE, SOURCES, CONNECTED, CONNECT_FAILED, PIECE_DONE, ANNOUNCE, DEPART, LOGOUT, EXPIRE };
+
+struct Event {
+    double time;
+    unsigned long long seq;
+    EventType type;
+    int peer;
+    int piece;
+    int other; // the uploader for PIECE_DONE
+    bool ok;   // PIECE_DONE: arrived intact
+    bool operator>(const Event& e) const { return time != e.time ? time > e.time : seq > e.seq; }
+};
+
+struct Peer {
+    double arrival = 0;
+    double latency_s = 0;
+    double up_bps = 0;
+    double down_bps = 0;
+    bool present = false;
+    bool seeding = false;
+    bool origin = false;
+    double finished = -1;
+    bool gave_up = false;
+    PieceScheduler* scheduler = nullptr;
+    int session = -1;       // uploader of the open session
+    double busy_until = 0;  // when this peer's uplink drains its current queue
+    int queued = 0;         // requests waiting on or using this peer's uplink
+};
+
+struct Stats {
+    unsigned long long events = 0;
+    unsigned long long pieces = 0;
+    unsigned long long corrupt = 0;
+    unsigned long long connect_failures = 0;
+    unsigned long long transfer_failures = 0;
+    unsigned long long refreshes = 0;
+};
+
+class Simulation {
+public:
+    Simulation(const Options& opt) : opt(opt), rng(opt.seed), peers(opt.seeders + opt.peers) {}
+    ~Simulation() {
+        for (auto& peer : peers) delete peer.scheduler;
+    }
+
+    void run();
+    void report(double wall_s) const;
+
+private:
+    void schedule(double time, EventType type, int peer, int piece = -1, int other = -1, bool ok = true);
+    void handle(const Event& e);
+    void advance(int p);  // let leecher p's scheduler take its next step
+    void request(int p, int piece);
+    void finish(int p);
+    void leave(int p, bool graceful);
+    vector<string> tracker_reply();
+    void tracker_add(int p);
+    void tracker_remove(int p);
+
+    static string addr(int p) { return "p" + to_string(p); }
+    static int index_of(const string& addr) { return stoi(addr.substr(1)); }
+    double uniform(double lo, double hi) { return uniform_real_distribution<double>(lo, hi)(rng); }
+    double rtt(int a, int b) const { return peers[a].latency_s + peers[b].latency_s; }
+
+    Options opt;
+    mt19937_64 rng;
+    vector<Peer> peers;
+    priority_queue<Event, vector<Event>, greater<Event>> events;
+    unsigned long long next_seq = 0;
+    double now = 0;
+    vector<int> tracked;          // seeders the tracker hands out
+    vector<int> tracked_slot;     // position of each peer in tracked, or -1
+    Stats stats;
+};
+
+void Simulation::schedule(double time, EventType type, int peer, int piece, int other, bool ok) {
+    events.push(Event{time, next_seq++, type, peer, piece, other, ok});
+}
+
+void Simulation::run() {
+    tracked_slot.assign(peers.size(), -1);
+    for (size_t p = 0; p < peers.size(); ++p) {
+        Peer& peer = peers[p];
+        peer.latency_s = opt.latency_ms / 1000.0 * uniform(0.5, 1.5);
+        peer.up_bps = opt.up_kbps * 1024 * uniform(1 - opt.up_spread, 1 + opt.up_spread);
+        peer.down_bps = opt.down_kbps * 1024;
+        if ((int)p < opt.seeders) {
+            // Origin seeders are there from the start and never leave
+            peer.origin = true;
+            peer.present = true;
+            peer.seeding = true;
+            tracker_add(p);
+            continue;
+        }
+        peer.arrival = opt.arrival_s > 0 ? uniform(0, opt.arrival_s) : 0;
+        schedule(peer.arrival, ARRIVE, p);
+    }
+
+    while (!events.empty() && events.top().time <= opt.max_time_s) {
+        Event e = events.top();
+        events.pop();
+        now = e.time;
+        ++stats.events;
+        handle(e);
+    }
+}
+
+void Simulation::handle(const Event& e) {
+    Peer& peer = peers[e.peer];
+    switch (e.type) {
+    case ARRIVE:
+        peer.present = true;
+        peer.scheduler = new PieceScheduler(opt.pieces, vector<bool>());
+        if (opt.lifetime_s > 0) {
+            schedule(now + exponential_distribution<double>(1.0 / opt.lifetime_s)(rng), DEPART, e.peer);
+        }
+        // download_file round trip to the tracker (taken to sit next to the peer)
+        schedule(now + 2 * peer.latency_s, SOURCES, e.peer);
+        return;
+    case DEPART:
+    case LOGOUT:
+        if (peer.present) leave(e.peer, e.type == LOGOUT);
+        return;
+    case EXPIRE:
+        tracker_remove(e.peer);
+        return;
+    case ANNOUNCE:
+        if (peer.present && peer.seeding) tracker_add(e.peer);
+        return;
+    case PIECE_DONE:
+        peers[e.other].queued--;
+        break;
+    default:
+        break;
+    }
+    if (!peer.present || peer.finished >= 0 || peer.gave_up) return;
+
+    switch (e.type) {
+    case SOURCES:
+        peer.scheduler->set_sources(tracker_reply(), map<string, vector<bool>>());
+        advance(e.peer);
+        break;
+    case CONNECTED:
+        peer.session = e.other;
+        request(e.peer, e.piece);
+        break;
+    case CONNECT_FAILED:
+        advance(e.peer);
+        break;
+    case PIECE_DONE: {
+        if (!peers[e.other].present || !e.ok) {
+            // The session dropped or the piece failed its hash
+            if (!e.ok) ++stats.corrupt;
+            else ++stats.transfer_failures;
+            peer.scheduler->piece_failed(addr(e.other));
+            peer.session = -1;
+        } else {
+            ++stats.pieces;
+            peer.scheduler->piece_received(addr(e.other), e.piece);
+        }
+        advance(e.peer);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void Simulation::advance(int p) {
+    Peer& peer = peers[p];
+    int piece = peer.scheduler->next_piece();
+    if (piece < 0) {
+        finish(p);
+        return;
+    }
+    if (peer.session >= 0 && (!peer.scheduler->covers(addr(peer.session), piece) || !peers[peer.session].present)) {
+        peer.session = -1;
+    }
+    if (peer.session >= 0) {
+        request(p, piece);
+        return;
+    }
+
+    vector<string> racers;
+    PieceScheduler::Action action = peer.scheduler->plan_connect(piece, racers);
+    if (action == PieceScheduler::REFRESH) {
+        ++stats.refreshes;
+        schedule(now + 2 * peer.latency_s, SOURCES, p);
+        return;
+    }
+    if (action == PieceScheduler::GIVE_UP) {
+        peer.gave_up = true;
+        return;
+    }
+
+    // The first racer to complete the TCP handshake wins; the hello exchange then
+    // costs one more round trip. A departed peer never answers.
+    int winner = -1;
+    for (const auto& racer : racers) {
+        int r = index_of(racer);
+        if (peers[r].present && (winner < 0 || rtt(p, r) < rtt(p, winner))) winner = r;
+    }
+    if (winner < 0) {
+        stats.connect_failures += racers.size();
+        peer.scheduler->connect_failed(racers);
+        schedule(now + PEER_CONNECT_TIMEOUT_S, CONNECT_FAILED, p);
+        return;
+    }
+    schedule(now + 2 * rtt(p, winner), CONNECTED, p, piece, winner);
+}
+
+void Simulation::request(int p, int piece) {
+    // The request reaches the uploader after one latency, waits for its uplink, and
+    // the last byte lands one latency after it was sent
+    Peer& peer = peers[p];
+    Peer& uploader = peers[peer.session];
+    double half_rtt = rtt(p, peer.session) / 2;
+    double rate = uploader.up_bps;
+    if (peer.down_bps > 0) rate = min(rate, peer.down_bps);
+    double start = max(now + half_rtt, uploader.busy_until);
+    uploader.busy_until = start + PIECE_BYTES / rate;
+    uploader.queued++;
+    bool ok = opt.corrupt <= 0 || uniform(0, 1) >= opt.corrupt;
+    schedule(uploader.busy_until + half_rtt, PIECE_DONE, p, piece, peer.session, ok);
+}
+
+void Simulation::finish(int p) {
+    Peer& peer = peers[p];
+    peer.finished = now;
+    peer.session = -1;
+    peer.seeding = true;
+    delete peer.scheduler;
+    peer.scheduler = nullptr;
+    // i_am_seeder round trip
+    schedule(now + peer.latency_s, ANNOUNCE, p);
+    if (opt.seed_time_s >= 0) {
+        schedule(now + opt.seed_time_s, LOGOUT, p);
+    }
+}
+
+void Simulation::leave(int p, bool graceful) {
+    Peer& peer = peers[p];
+    peer.present = false;
+    // A peer that stops seeding logs out; one that drops off is only noticed when its
+    // heartbeats stop
+    if (graceful) tracker_remove(p);
+    else schedule(now + SEEDER_TIMEOUT_S, EXPIRE, p);
+}
+
+vector<string> Simulation::tracker_reply() {
+    // Like the tracker's select_seeders: weighted sampling without replacement that
+    // favours seeders with few queued uploads
+    vector<int> sample;
+    if (tracked.size() <= TRACKER_SAMPLE) {
+        sample = tracked;
+    } else {
+        for (size_t k = 0; k < TRACKER_SAMPLE; ++k) sample.push_back(tracked[rng() % tracked.size()]);
+        sort(sample.begin(), sample.end());
+        sample.erase(unique(sample.begin(), sample.end()), sample.end());
+    }
+    vector<pair<double, int>> keyed;
+    for (int s : sample) {
+        double weight = (1.0 + peers[s].up_bps / 1024) / (1.0 + peers[s].queued);
+        keyed.push_back(make_pair(log(uniform(1e-12, 1.0)) / weight, s));
+    }
+    size_t count = min(SEEDER_REPLY_LIMIT, keyed.size());
+    partial_sort(keyed.begin(), keyed.begin() + count, keyed.end(), greater<pair<double, int>>());
+    vector<string> reply;
+    for (size_t k = 0; k < count; ++k) reply.push_back(addr(keyed[k].second));
+    return reply;
+}
+
+void Simulation::tracker_add(int p) {
+    if (tracked_slot[p] >= 0) return;
+    tracked_slot[p] = tracked.size();
+    tracked.push_back(p);
+}
+
+void Simulation::tracker_remove(int p) {
+    int slot = tracked_slot[p];
+    if (slot < 0) return;
+    tracked[slot] = tracked.back();
+    tracked_slot[tracked[slot]] = slot;
+    tracked.pop_back();
+    tracked_slot[p] = -1;
+}
+
+static double percentile(vector<double> values, double p) {
+    if (values.empty()) return 0;
+    sort(values.begin(), values.end());
+    size_t rank = (size_t)(p / 100.0 * (values.size() - 1) + 0.5);
+    return values[min(rank, values.size() - 1)];
+}
+
+void Simulation::report(double wall_s) const {
+    vector<double> completion;
+    int gave_up = 0, left = 0, unfinished = 0;
+    double last = 0;
+    for (const auto& peer : peers) {
+        if (peer.origin) continue;
+        if (peer.finished >= 0) {
+            completion.push_back(peer.finished - peer.arrival);
+            last = max(last, peer.finished);
+        } else if (peer.gave_up) {
+            ++gave_up;
+        } else if (!peer.present) {
+            ++left;
+        } else {
+            ++unfinished;
+        }
+    }
+    double file_mb = opt.pieces * PIECE_BYTES / (1024 * 1024);
+    cout << fixed << setprecision(2);
+    cout << "Swarm: " << opt.seeders << " seeders, " << opt.peers << " leechers, " << file_mb << " MB file ("
+         << opt.pieces << " pieces)\n";
+    cout << "Leechers: " << completion.size() << " completed, " << gave_up << " gave up, " << left
+         << " left early, " << unfinished << " unfinished at " << opt.max_time_s << " s\n";
+    cout << "Time to completion (s): p50 " << percentile(completion, 50) << "  p90 " << percentile(completion, 90)
+         << "  p99 " << percentile(completion, 99) << "  max " << percentile(completion, 100) << "\n";
+    cout << "Swarm completion (s): " << last << "\n";
+    cout << "Pieces transferred: " << stats.pieces << ", corrupt " << stats.corrupt << ", dropped "
+         << stats.transfer_failures << ", failed connects " << stats.connect_failures << ", tracker refreshes "
+         << stats.refreshes << "\n";
+    cout << "Simulated " << stats.events << " events in " << wall_s << " s of wall time" << endl;
+}
+
+static void usage() {
+    cerr << "Usage: swarm_sim [--peers N] [--seeders N] [--pieces N] [--up-kbps N] [--up-spread F]\n"
+            "                 [--down-kbps N] [--latency-ms N] [--arrival-s N] [--lifetime-s N]\n"
+            "                 [--seed-time-s N] [--corrupt P] [--max-time-s N] [--seed N]\n"
+            "  --lifetime-s: mean time before a peer leaves at random (0 = no churn)\n"
+            "  --corrupt: probability that a transfer fails its hash" << endl;
+}
+
+static bool parse_options(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        string value = argv[++i];
+        if (arg == "--peers") opt.peers = stoi(value);
+        else if (arg == "--seeders") opt.seeders = stoi(value);
+        else if (arg == "--pieces") opt.pieces = stoi(value);
+        else if (arg == "--up-kbps") opt.up_kbps = stod(value);
+        else if (arg == "--up-spread") opt.up_spread = stod(value);
+        else if (arg == "--down-kbps") opt.down_kbps = stod(value);
+        else if (arg == "--latency-ms") opt.latency_ms = stod(value);
+        else if (arg == "--arrival-s") opt.arrival_s = stod(value);
+        else if (arg == "--lifetime-s") opt.lifetime_s = stod(value);
+        else if (arg == "--seed-time-s") opt.seed_time_s = stod(value);
+        else if (arg == "--corrupt") opt.corrupt = stod(value);
+        else if (arg == "--max-time-s") opt.max_time_s = stod(value);
+        else if (arg == "--seed") opt.seed = stoull(value);
+        else return false;
+    }
+    return opt.peers > 0 && opt.seeders > 0 && opt.pieces > 0 && opt.up_kbps > 0 && opt.up_spread >= 0
+        && opt.up_spread < 1 && opt.corrupt < 1;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    if (!parse_options(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    auto start = chrono::steady_clock::now();
+    Simulation sim(opt);
+    sim.run();
+    sim.report(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    return 0;
+}
@@ -0,0 +1,465 @@
+// Tracker load generator: opens thousands of concurrent client sessions against a
+// tracker and replays a weighted command mix for a fixed time, then reports
+// throughput and latency percentiles per command.
+//
+// Every session is closed-loop (one outstanding command at a time), and sessions are
+// spread over a few threads that each multiplex theirs with epoll, so the numbers
+// measure the tracker rather than the generator. Point it at a running tracker with
+// --host/--port, or let it start one with --tracker-bin.
+
+#include "latency_histogram.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// Commands the mix may contain, in report order
+static const vector<string> COMMANDS = {"login", "download_file", "list_files", "list_groups", "ping"};
+
+struct Options {
+    string host = "127.0.0.1";
+    int port = 6600;
+    string tracker_bin; // start our own tracker from this binary instead of using host:port
+    int sessions = 2000;
+    int threads = 4;
+    int duration_s = 10;
+    int warmup_s = 1;
+    int files = 64;
+    int pieces = 16; // piece hashes per uploaded file, which sizes download_file replies
+    string mix = "login=1,download_file=5,list_files=3,list_groups=1";
+};
+
+struct Session {
+    int sock = -1;
+    int id = 0;
+    string pending;
+    int command = -1; // index into COMMANDS of the outstanding command
+    Clock::time_point sent_at;
+};
+
+struct WorkerStats {
+    vector<LatencyHistogram> latency = vector<LatencyHistogram>(COMMANDS.size());
+    vector<uint64_t> errors = vector<uint64_t>(COMMANDS.size(), 0);
+};
+
+static void usage() {
+    cerr << "Usage: tracker_loadgen [--host IP] [--port N] [--tracker-bin PATH]\n"
+            "                       [--sessions N] [--threads N] [--duration-s N] [--warmup-s N]\n"
+            "                       [--files N] [--pieces N] [--mix cmd=weight,...]\n"
+            "  --tracker-bin starts a single tracker on --port and stops it afterwards.\n"
+            "  --mix commands: login, download_file, list_files, list_groups, ping\n"
+            "  (default login=1,download_file=5,list_files=3,list_groups=1)." << endl;
+}
+
+static bool parse_options(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        string value = argv[++i];
+        if (arg == "--host") opt.host = value;
+        else if (arg == "--port") opt.port = stoi(value);
+        else if (arg == "--tracker-bin") opt.tracker_bin = value;
+        else if (arg == "--sessions") opt.sessions = stoi(value);
+        else if (arg == "--threads") opt.threads = stoi(value);
+        else if (arg == "--duration-s") opt.duration_s = stoi(value);
+        else if (arg == "--warmup-s") opt.warmup_s = stoi(value);
+        else if (arg == "--files") opt.files = stoi(value);
+        else if (arg == "--pieces") opt.pieces = stoi(value);
+        else if (arg == "--mix") opt.mix = value;
+        else return false;
+    }
+    return opt.sessions > 0 && opt.threads > 0 && opt.duration_s > 0 && opt.files > 0 && opt.pieces > 0;
+}
+
+// "login=1,download_file=5" -> cumulative weights over COMMANDS
+static bool parse_mix(const string& mix, vector<int>& cumulative) {
+    vector<int> weights(COMMANDS.size(), 0);
+    stringstream ss(mix);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos) return false;
+        auto it = find(COMMANDS.begin(), COMMANDS.end(), item.substr(0, eq));
+        if (it == COMMANDS.end()) return false;
+        weights[it - COMMANDS.begin()] = stoi(item.substr(eq + 1));
+    }
+    cumulative.clear();
+    int sum = 0;
+    for (int w : weights) cumulative.push_back(sum += max(w, 0));
+    return sum > 0;
+}
+
+static int connect_to(const string& host, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+static bool send_all(int sock, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Streamed listings arrive as "+ ..." and "= next ..." frames before the final line
+static bool is_frame(const string& line) {
+    return line.compare(0, 2, "+ ") == 0 || line.compare(0, 2, "= ") == 0;
+}
+
+// Pop the final line of a reply out of `pending`, dropping any frames before it
+static bool take_reply(string& pending, string& reply) {
+    size_t newline;
+    while ((newline = pending.find('\n')) != string::npos) {
+        string line = pending.substr(0, newline);
+        pending.erase(0, newline + 1);
+        if (!is_frame(line)) {
+            reply = line;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Blocking request/reply, used only while setting sessions up
+static bool round_trip(Session& session, const string& command, string& reply) {
+    if (!send_all(session.sock, command + "\n")) return false;
+    char buf[65536];
+    while (!take_reply(session.pending, reply)) {
+        ssize_t n = recv(session.sock, buf, sizeof(buf), 0);
+        if (n <= 0) return false;
+        session.pending.append(buf, n);
+    }
+    return true;
+}
+
+static string user_name(const string& prefix, int id) {
+    return prefix + "u" + to_string(id);
+}
+
+static string command_line(int command, const Session& session, const string& prefix,
+                           const string& group, int files, mt19937& rng) {
+    switch (command) {
+    case 0: return "login " + user_name(prefix, session.id) + " pw " + to_string(20000 + session.id % 40000);
+    case 1: return "download_file " + group + " " + prefix + "f" + to_string(rng() % files);
+    case 2: return "list_files " + group;
+    case 3: return "list_groups";
+    default: return "ping";
+    }
+}
+
+// Connect, create the user, log in and ask to join the group
+static bool set_up_session(Session& session, const Options& opt, const string& prefix, const string& group) {
+    session.sock = connect_to(opt.host, opt.port);
+    if (session.sock < 0) return false;
+    string user = user_name(prefix, session.id);
+    string reply;
+    return round_trip(session, "create_user " + user + " pw", reply) && reply.compare(0, 7, "success") == 0
+        && round_trip(session, "login " + user + " pw " + to_string(20000 + session.id % 40000), reply)
+        && reply.compare(0, 7, "success") == 0
+        && round_trip(session, "join_group " + group, reply) && reply.compare(0, 7, "success") == 0;
+}
+
+static void run_worker(vector<Session>& sessions, const Options& opt, const vector<int>& mix,
+                       const string& prefix, const string& group, Clock::time_point measure_from,
+                       Clock::time_point stop_at, unsigned seed, WorkerStats& stats) {
+    mt19937 rng(seed);
+    int epfd = epoll_create1(0);
+    auto issue = [&](Session& session) {
+        int pick = rng() % mix.back();
+        session.command = upper_bound(mix.begin(), mix.end(), pick) - mix.begin();
+        session.sent_at = Clock::now();
+        if (!send_all(session.sock, command_line(session.command, session, prefix, group, opt.files, rng) + "\n")) {
+            session.command = -1;
+        }
+    };
+    int outstanding = 0;
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sessions[i].sock, &ev);
+        issue(sessions[i]);
+        if (sessions[i].command >= 0) ++outstanding;
+    }
+
+    vector<epoll_event> events(256);
+    char buf[65536];
+    while (outstanding > 0) {
+        int n = epoll_wait(epfd, events.data(), events.size(), 100);
+        for (int e = 0; e < n; ++e) {
+            Session& session = sessions[events[e].data.u32];
+            ssize_t got = recv(session.sock, buf, sizeof(buf), 0);
+            if (got <= 0) {
+                if (session.command >= 0) {
+                    stats.errors[session.command]++;
+                    --outstanding;
+                }
+                session.command = -1;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, session.sock, nullptr);
+                continue;
+            }
+            session.pending.append(buf, got);
+            string reply;
+            if (session.command < 0 || !take_reply(session.pending, reply)) continue;
+
+            auto now = Clock::now();
+            if (session.sent_at >= measure_from) {
+                auto us = chrono::duration_cast<chrono::microseconds>(now - session.sent_at).count();
+                stats.latency[session.command].record(us);
+                if (reply.compare(0, 5, "error") == 0) stats.errors[session.command]++;
+            }
+            if (now < stop_at) {
+                issue(session);
+                if (session.command < 0) --outstanding;
+            } else {
+                session.command = -1;
+                --outstanding;
+            }
+        }
+    }
+    close(epfd);
+}
+
+// Start a single tracker on opt.port. Its console reads stdin, so it gets a pipe that
+// stays open for as long as it runs.
+static pid_t start_tracker(const Options& opt, const string& work_dir, int& console_fd) {
+    string info_file = work_dir + "/tracker_info.txt";
+    {
+        ofstream info(info_file);
+        info << opt.host << ":" << opt.port << "\n";
+    }
+    int in_pipe[2];
+    if (pipe(in_pipe) < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(in_pipe[0]); close(in_pipe[1]); close(null_fd);
+        execl(opt.tracker_bin.c_str(), opt.tracker_bin.c_str(), info_file.c_str(), "1", (char*)nullptr);
+        _exit(127);
+    }
+    close(in_pipe[0]);
+    console_fd = in_pipe[1];
+    return pid;
+}
+
+static string format_ms(uint64_t us) {
+    ostringstream out;
+    out << fixed << setprecision(3) << us / 1000.0;
+    return out.str();
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    vector<int> mix;
+    if (!parse_options(argc, argv, opt) || !parse_mix(opt.mix, mix)) {
+        usage();
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // One descriptor per session here, and one per session in a tracker we start
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < (rlim_t)opt.sessions + 64) {
+            cerr << "Descriptor limit " << limit.rlim_cur << " is too low for " << opt.sessions << " sessions" << endl;
+            return 1;
+        }
+    }
+
+    pid_t tracker_pid = -1;
+    int console_fd = -1;
+    string work_dir;
+    if (!opt.tracker_bin.empty()) {
+        char dir_template[] = "/tmp/p2p_loadgen.XXXXXX";
+        if (!mkdtemp(dir_template)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        work_dir = dir_template;
+        tracker_pid = start_tracker(opt, work_dir, console_fd);
+    }
+    auto stop_tracker = [&]() {
+        if (tracker_pid > 0) {
+            kill(tracker_pid, SIGKILL);
+            waitpid(tracker_pid, nullptr, 0);
+            close(console_fd);
+            unlink((work_dir + "/tracker_info.txt").c_str());
+            rmdir(work_dir.c_str());
+        }
+    };
+
+    // Names are unique per run so that repeated runs against one tracker don't collide
+    string prefix = "lg" + to_string(getpid()) + "_";
+    Session owner;
+    owner.id = opt.sessions;
+    for (int attempt = 0; attempt < 50 && owner.sock < 0; ++attempt) {
+        owner.sock = connect_to(opt.host, opt.port);
+        if (owner.sock < 0) this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    string reply;
+    string owner_user = user_name(prefix, owner.id);
+    if (owner.sock < 0 || !round_trip(owner, "create_user " + owner_user + " pw", reply)
+        || !round_trip(owner, "login " + owner_user + " pw 19999", reply) || reply.compare(0, 7, "success") != 0) {
+        cerr << "Could not log in to the tracker at " << opt.host << ":" << opt.port << endl;
+        stop_tracker();
+        return 1;
+    }
+
+    // In a cluster only some trackers host a given group, so try names until one sticks
+    string group;
+    for (int g = 0; g < 64 && group.empty(); ++g) {
+        string candidate = prefix + "g" + to_string(g);
+        if (round_trip(owner, "create_group " + candidate, reply) && reply.compare(0, 7, "success") == 0) {
+            group = candidate;
+        }
+    }
+    if (group.empty()) {
+        cerr << "Could not create a group: " << reply << endl;
+        stop_tracker();
+        return 1;
+    }
+    for (int f = 0; f < opt.files; ++f) {
+        ostringstream upload;
+        upload << "upload_file " << group << " " << prefix << "f" << f << " "
+               << (long long)opt.pieces * 512 * 1024 << " " << string(40, 'a' + f % 26);
+        for (int p = 0; p < opt.pieces; ++p) upload << " " << setw(40) << setfill('0') << f * opt.pieces + p;
+        if (!round_trip(owner, upload.str(), reply) || reply.compare(0, 7, "success") != 0) {
+            cerr << "Upload failed: " << reply << endl;
+            stop_tracker();
+            return 1;
+        }
+    }
+
+    // Set sessions up in parallel, then let the owner accept them with pipelined requests
+    cout << "Setting up " << opt.sessions << " sessions..." << endl;
+    auto setup_start = Clock::now();
+    vector<vector<Session>> shards(opt.threads);
+    for (int i = 0; i < opt.sessions; ++i) {
+        Session session;
+        session.id = i;
+        shards[i % opt.threads].push_back(session);
+    }
+    atomic<int> setup_failures(0);
+    {
+        vector<thread> setup;
+        for (int t = 0; t < opt.threads; ++t) {
+            setup.emplace_back([&, t]() {
+                for (auto& session : shards[t]) {
+                    if (!set_up_session(session, opt, prefix, group)) setup_failures++;
+                }
+            });
+        }
+        for (auto& t : setup) t.join();
+    }
+    if (setup_failures > 0) {
+        cerr << setup_failures << " sessions failed to set up" << endl;
+        stop_tracker();
+        return 1;
+    }
+    string accepts;
+    for (int i = 0; i < opt.sessions; ++i) accepts += "accept_request " + group + " " + user_name(prefix, i) + "\n";
+    send_all(owner.sock, accepts);
+    for (int i = 0; i < opt.sessions; ++i) {
+        char buf[65536];
+        while (!take_reply(owner.pending, reply)) {
+            ssize_t n = recv(owner.sock, buf, sizeof(buf), 0);
+            if (n <= 0) break;
+            owner.pending.append(buf, n);
+        }
+    }
+    double setup_s = chrono::duration<double>(Clock::now() - setup_start).count();
+    cout << "Sessions ready in " << fixed << setprecision(2) << setup_s << " s; running for "
+         << opt.duration_s << " s after " << opt.warmup_s << " s of warm-up" << endl;
+
+    // Measure
+    auto start = Clock::now();
+    auto measure_from = start + chrono::seconds(opt.warmup_s);
+    auto stop_at = measure_from + chrono::seconds(opt.duration_s);
+    vector<WorkerStats> stats(opt.threads);
+    vector<thread> workers;
+    for (int t = 0; t < opt.threads; ++t) {
+        workers.emplace_back(run_worker, ref(shards[t]), cref(opt), cref(mix), cref(prefix), cref(group),
+                             measure_from, stop_at, 1234u + t, ref(stats[t]));
+    }
+    for (auto& t : workers) t.join();
+    double measured_s = chrono::duration<double>(Clock::now() - measure_from).count();
+
+    WorkerStats total;
+    for (auto& s : stats) {
+        for (size_t c = 0; c < COMMANDS.size(); ++c) {
+            total.latency[c].merge(s.latency[c]);
+            total.errors[c] += s.errors[c];
+        }
+    }
+    LatencyHistogram overall;
+    uint64_t overall_errors = 0;
+
+    cout << "\n" << left << setw(15) << "command" << right << setw(10) << "ops" << setw(11) << "ops/s"
+         << setw(10) << "p50 ms" << setw(10) << "p90 ms" << setw(10) << "p99 ms" << setw(10) << "p99.9 ms"
+         << setw(10) << "max ms" << setw(8) << "errors" << "\n";
+    auto print_row = [&](const string& name, const LatencyHistogram& h, uint64_t errors) {
+        cout << left << setw(15) << name << right << setw(10) << h.count() << setw(11) << fixed << setprecision(0)
+             << h.count() / measured_s << setw(10) << format_ms(h.percentile(50)) << setw(10)
+             << format_ms(h.percentile(90)) << setw(10) << format_ms(h.percentile(99)) << setw(10)
+             << format_ms(h.percentile(99.9)) << setw(10) << format_ms(h.maximum()) << setw(8) << errors << "\n";
+    };
+    for (size_t c = 0; c < COMMANDS.size(); ++c) {
+        if (total.latency[c].count() == 0 && total.errors[c] == 0) continue;
+        print_row(COMMANDS[c], total.latency[c], total.errors[c]);
+        overall.merge(total.latency[c]);
+        overall_errors += total.errors[c];
+    }
+    print_row("all", overall, overall_errors);
+    cout << "\nsessions=" << opt.sessions << " threads=" << opt.threads << " mix=" << opt.mix << endl;
+
+    for (auto& shard : shards) {
+        for (auto& session : shard) close(session.sock);
+    }
+    close(owner.sock);
+    stop_tracker();
+    return overall_errors == 0 ? 0 : 2;
+}
@@ -1,5 +1,6 @@
 #include "client.h"
 #include "utils.h"
+#include "disk_io.h"
 #include <iostream>
 #include <sstream>
 #include <cstring>
@@ -12,45 +13,53 @@
 #include <openssl/sha.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <cmath>
+#include <climits>
 #define MSG_SIZE 512*1024
 
 using namespace std;
 
-Client::Client(const string& tracker_info_file) 
-{
-    int fd = open(tracker_info_file.c_str(), O_RDONLY);
-    if (fd < 0) 
-    {
-        perror("Failed to open tracker_info.txt");
-        exit(0);
-    }
+// Leaked on purpose: exiting threads hand their cached buffer back after main returns
+static BufferPool& piece_buffers() {
+    static BufferPool* pool = new BufferPool(PIECE_SIZE, PIECE_BUFFER_POOL_SIZE);
+    return *pool;
+}
 
-    char buffer[256];
-    ssize_t bytes_read = read(fd, buffer, sizeof(buffer) - 1);
-    close(fd);
+// Whole-string unsigned number in base; no sign, spaces or trailing text
+static bool parse_unsigned(const string& text, int base, unsigned long& value) {
+    if (text.empty() || !isxdigit((unsigned char)text[0])) return false;
+    char* end;
+    value = strtoul(text.c_str(), &end, base);
+    return *end == '\0';
+}
 
-    if (bytes_read <= 0) 
+Client::Client(const string& tracker_info_file) 
+{
+    tracker_addresses = load_tracker_addresses(tracker_info_file);
+    if (tracker_addresses.empty()) 
     {
-        log_msg("Failed to read from tracker_info.txt or file is empty.");
+        cerr << "FATAL: tracker_info.txt must contain at least one tracker address." << endl;
         exit(EXIT_FAILURE);
     }
-    buffer[bytes_read] = '\0'; // Null-terminate the buffer
-
-    stringstream ss(buffer);
-    string line;
-    while(getline(ss, line)) 
-    {
-        if(!line.empty()) 
-        {
-            tracker_addresses.push_back(line);
-        }
-    }
 
-    if (tracker_addresses.size() < 2) 
-    {
-        cerr << "FATAL: tracker_info.txt must contain at least two tracker addresses." << endl;
-        exit(EXIT_FAILURE);
-    }
+    ring = HashRing(tracker_addresses);
+    tracker_sockets.assign(tracker_addresses.size(), -1);
+    tracker_authenticated.assign(tracker_addresses.size(), false);
+    tracker_healthy.assign(tracker_addresses.size(), true);
+    tracker_latency_ms.assign(tracker_addresses.size(), 0.0);
+    tracker_rng.seed(random_device()());
+    tracker_reply_buffer.resize(MSG_SIZE);
+    tracker_pending.assign(tracker_addresses.size(), "");
+    tracker_owed_replies.assign(tracker_addresses.size(), 0);
+    tracker_rejoin_due.assign(tracker_addresses.size(), false);
+
+    if (const char* delay = getenv("P2P_EMULATE_DELAY_MS")) emulated_delay_ms = atoi(delay);
+    if (const char* rate = getenv("P2P_EMULATE_RATE_KBPS")) emulated_rate_kbps = atoll(rate);
 }
 
 void Client::run() 
@@ -65,118 +74,481 @@ void Client::run()
         return;
     }
 
+    thread heartbeat_thread(&Client::heartbeat_loop, this);
+    heartbeat_thread.detach();
+
     process_user_input();
     
-    if (tracker_socket != -1) 
+    for (int sock : tracker_sockets) 
     {
-        close(tracker_socket);
+        if (sock != -1) 
+            close(sock);
     }
 }
 
-bool Client::try_connect_to(const string& addr) 
+bool Client::try_connect_to(int tracker_idx) 
+{
+    int sock = open_tracker_socket(tracker_idx);
+    if (sock < 0) 
+        return false;
+    adopt_tracker_socket(tracker_idx, sock);
+    return true;
+}
+
+// Touches no shared state, so it may run without tracker_mutex
+int Client::open_tracker_socket(int tracker_idx)
 {
+    const string& addr = tracker_addresses[tracker_idx];
     size_t delim_pos = addr.find(':');
     if (delim_pos == string::npos) 
-        return false;
+        return -1;
     string ip = addr.substr(0, delim_pos);
     int port = stoi(addr.substr(delim_pos + 1));
+    return connect_with_timeout(ip, port, TRACKER_CONNECT_TIMEOUT_MS);
+}
 
-    tracker_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (tracker_socket < 0) 
-        return false;
+void Client::adopt_tracker_socket(int tracker_idx, int sock)
+{
+    tracker_sockets[tracker_idx] = sock;
+    tracker_authenticated[tracker_idx] = false;
+    tracker_healthy[tracker_idx] = true;
+    tracker_pending[tracker_idx].clear();
+    tracker_owed_replies[tracker_idx] = 0;
+    log_msg("successfully connected to tracker at " + tracker_addresses[tracker_idx]);
+}
 
-    sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip.c_str(), &server_addr.sin_addr);
+bool Client::connect_to_available_tracker() {
+    // Keep a connection to every tracker so that reads can be spread over all replicas
+    int first_connected = -1;
+    for (size_t idx = 0; idx < tracker_addresses.size(); ++idx) {
+        if (try_connect_to(idx)) {
+            if (first_connected < 0) first_connected = idx;
+        } else {
+            log_msg("Could not connect to tracker " + tracker_addresses[idx] + ".");
+        }
+    }
 
-    if (connect(tracker_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) 
-    {
-        close(tracker_socket);
-        tracker_socket = -1;
+    if (first_connected < 0) {
+        cerr << "FATAL: All trackers appear to be down." << endl;
         return false;
     }
-    
-    log_msg("successfully connected to tracker at " + addr);
+    current_tracker_idx = first_connected;
     return true;
 }
 
-bool Client::connect_to_available_tracker() {
-    if (try_connect_to(tracker_addresses[current_tracker_idx])) {
-        return true;
+void Client::drop_tracker_connection(int tracker_idx) {
+    if (tracker_sockets[tracker_idx] != -1) {
+        close(tracker_sockets[tracker_idx]);
     }
+    tracker_sockets[tracker_idx] = -1;
+    tracker_authenticated[tracker_idx] = false;
+    tracker_pending[tracker_idx].clear();
+    tracker_owed_replies[tracker_idx] = 0;
+}
 
-    log_msg("Could not connect to primary tracker. Failing over...");
-    current_tracker_idx = (current_tracker_idx + 1) % tracker_addresses.size();
-    
-    if (try_connect_to(tracker_addresses[current_tracker_idx])) {
-        return true;
+void Client::heartbeat_loop() {
+    // Probe every tracker in the background so that a dead tracker is taken out of
+    // routing before a user command has to wait on it, and reconnect recovered ones.
+    // While logged in, the probe also reports our load as a seeder so that trackers
+    // can steer new leechers towards less busy peers.
+    long long last_uploaded = bytes_uploaded;
+    auto last_report = chrono::steady_clock::now();
+    while (true) {
+        auto now = chrono::steady_clock::now();
+        double seconds = chrono::duration<double>(now - last_report).count();
+        long long uploaded = bytes_uploaded;
+        long long upload_kbps = seconds > 0 ? (long long)((uploaded - last_uploaded) / 1024 / seconds) : 0;
+        long long spare_kbps = max(0LL, UPLOAD_CAPACITY_KBPS - upload_kbps);
+        last_uploaded = uploaded;
+        last_report = now;
+        string probe = "ping " + to_string(active_uploads.load()) + " " + to_string(spare_kbps);
+
+        set<int> rejoin_trackers;
+        for (size_t idx = 0; idx < tracker_addresses.size(); ++idx) {
+            // A connect to a dead tracker can take TRACKER_CONNECT_TIMEOUT_MS, so it is
+            // made without tracker_mutex to keep user commands moving meanwhile
+            bool connected;
+            {
+                lock_guard<mutex> lock(tracker_mutex);
+                connected = tracker_sockets[idx] >= 0;
+            }
+            int fresh_sock = connected ? -1 : open_tracker_socket(idx);
+
+            lock_guard<mutex> lock(tracker_mutex);
+            bool was_healthy = tracker_healthy[idx];
+            bool healthy;
+            if (!connected) {
+                if (fresh_sock >= 0 && tracker_sockets[idx] < 0) adopt_tracker_socket(idx, fresh_sock);
+                else if (fresh_sock >= 0) close(fresh_sock); // a command reconnected first
+                healthy = tracker_sockets[idx] >= 0;
+            } else if (is_logged_in) {
+                string response = exchange_in_session(idx, probe, nullptr, HEARTBEAT_TIMEOUT_MS);
+                healthy = response.compare(0, 7, "success") == 0;
+                if (response.find("rejoin") != string::npos) rejoin_trackers.insert(idx);
+            } else {
+                healthy = exchange_with_tracker(idx, "ping", HEARTBEAT_TIMEOUT_MS).compare(0, 7, "success") == 0;
+            }
+            tracker_healthy[idx] = healthy;
+            if (tracker_rejoin_due[idx]) {
+                rejoin_trackers.insert(idx);
+                tracker_rejoin_due[idx] = false;
+            }
+
+            if (was_healthy && !healthy) {
+                log_msg("Tracker " + tracker_addresses[idx] + " is not responding; routing around it.");
+            } else if (!was_healthy && healthy) {
+                log_msg("Tracker " + tracker_addresses[idx] + " is back.");
+            }
+        }
+
+        // A tracker that was not tracking us (it evicted us after missed heartbeats, or
+        // restarted) asks us to rejoin, and one we had to log in to again has dropped us
+        // as a seeder everywhere: announce again the files we seed in its groups.
+        if (!rejoin_trackers.empty()) {
+            // One batch per group instead of a round trip per file
+            map<string, vector<string>> announcements; // group_id -> i_am_seeder items
+            {
+                lock_guard<mutex> lock(shared_files_mutex);
+                for (const auto& entry : shared_file_groups) {
+                    for (int owner : ring.owners(entry.second)) {
+                        if (rejoin_trackers.count(owner)) {
+                            announcements[entry.second].push_back("i_am_seeder " + entry.first);
+                            break;
+                        }
+                    }
+                }
+            }
+            for (const auto& group : announcements) {
+                send_batch(group.first, group.second);
+            }
+        }
+        this_thread::sleep_for(chrono::milliseconds(HEARTBEAT_INTERVAL_MS));
+    }
+}
+
+// Remove the " session=<token>" suffix of a login reply and return the token
+static string take_session_token(string& response) {
+    size_t pos = response.find(" session=");
+    if (pos == string::npos) return "";
+    string token = response.substr(pos + 9);
+    token = token.substr(0, token.find_first_of(" \r\n"));
+    response.erase(pos);
+    return token;
+}
+
+string Client::exchange_in_session(int tracker_idx, const string& command, const FrameHandler& on_frame, int timeout_ms) {
+    if (tracker_sockets[tracker_idx] < 0 && !try_connect_to(tracker_idx)) {
+        return "";
+    }
+    if (!is_logged_in || tracker_authenticated[tracker_idx]) {
+        return exchange_with_tracker(tracker_idx, command, timeout_ms, on_frame);
+    }
+
+    // Attach the session token to the command itself, so that moving the session to
+    // another tracker costs no extra round trip.
+    if (!session_token.empty()) {
+        string response = exchange_with_tracker(tracker_idx, "@" + session_token + " " + command,
+                                                timeout_ms, on_frame);
+        if (response.empty()) {
+            return "";
+        }
+        if (response.find("Invalid session token") == string::npos) {
+            tracker_authenticated[tracker_idx] = true;
+            return response;
+        }
+    }
+
+    // The tracker does not know our token (e.g. it was restarted): log in again
+    log_msg("Authenticating session with tracker " + tracker_addresses[tracker_idx] + "...");
+    string login_cmd = "login " + user_id + " " + password + " " + to_string(seeder_port);
+    string login_response = exchange_with_tracker(tracker_idx, login_cmd);
+    if (login_response.empty()) {
+        return "";
     }
+    if (login_response.find("success") == string::npos) {
+        LOG_WARN("Re-login failed. You may need to login manually.");
+    } else {
+        session_token = take_session_token(login_response);
+        tracker_authenticated.assign(tracker_addresses.size(), false);
+        tracker_authenticated[tracker_idx] = true;
+        tracker_rejoin_due[tracker_idx] = true; // picked up by the next heartbeat
+        log_msg("Re-authentication successful.");
+    }
+    return exchange_with_tracker(tracker_idx, command, timeout_ms, on_frame);
+}
+
+// Group commands that only read tracker state and may be served by any replica
+static bool is_read_only_command(const vector<string>& args) {
+    return args[0] == "list_files" || args[0] == "download_file";
+}
 
-    cerr << "FATAL: Both trackers appear to be down." << endl;
-    return false;
+// Commands whose first argument is a group_id and which must reach that group's shard
+static bool is_group_command(const vector<string>& args) {
+    static const set<string> group_commands = {
+        "create_group", "join_group", "leave_group", "list_requests", "accept_request",
+        "list_files", "upload_file", "download_file", "stop_share", "i_am_seeder", "batch"
+    };
+    return args.size() >= 2 && group_commands.count(args[0]);
 }
 
-string Client::send_to_tracker(const string& command, bool is_retry) {
-    if (tracker_socket < 0) {
-        return "ERROR: Not connected to any tracker.";
+vector<int> Client::route_command(const vector<string>& args) {
+    // Group-scoped commands go to the trackers holding that group's shard, primary first
+    // Reads are spread over all replicas, writes always start at the primary
+    vector<int> candidates;
+    if (is_group_command(args)) {
+        vector<int> replicas = ring.owners(args[1]);
+        if (is_read_only_command(args)) return order_by_latency(replicas);
+        candidates = replicas;
+    } else {
+        for (size_t i = 0; i < tracker_addresses.size(); ++i) {
+            candidates.push_back((current_tracker_idx + i) % tracker_addresses.size());
+        }
     }
 
-    auto attempt_failover_and_retry = [&]() -> string {
-        if (is_retry) {
-            return "ERROR: Failed to send command to the secondary tracker.";
+    // Trackers that failed their last heartbeat are only tried as a last resort
+    stable_partition(candidates.begin(), candidates.end(), [&](int idx) { return tracker_healthy[idx]; });
+    return candidates;
+}
+
+vector<int> Client::order_by_latency(const vector<int>& replicas) {
+    // Pick the first tracker at random with weight 1/latency so faster replicas take more
+    // reads without starving the others; trackers not measured yet get the best weight so
+    // they are tried. The remaining replicas follow fastest-first as failover targets.
+    double best = 0;
+    for (int idx : replicas) {
+        if (tracker_latency_ms[idx] > 0 && (best == 0 || tracker_latency_ms[idx] < best)) {
+            best = tracker_latency_ms[idx];
         }
+    }
 
-        log_msg("Connection lost. Attempting to reconnect and retry...");
-        close(tracker_socket);
-        tracker_socket = -1;
+    vector<int> ordered;
+    vector<double> weights;
+    for (int idx : replicas) {
+        if (tracker_sockets[idx] < 0 || !tracker_healthy[idx]) continue; // keep for failover only
+        double latency = tracker_latency_ms[idx] > 0 ? tracker_latency_ms[idx] : (best > 0 ? best : 1.0);
+        ordered.push_back(idx);
+        weights.push_back(1.0 / latency);
+    }
+    if (!ordered.empty()) {
+        discrete_distribution<int> pick(weights.begin(), weights.end());
+        swap(ordered[0], ordered[pick(tracker_rng)]);
+        sort(ordered.begin() + 1, ordered.end(), [&](int a, int b) {
+            return tracker_latency_ms[a] < tracker_latency_ms[b];
+        });
+    }
+    for (int idx : replicas) {
+        if (tracker_sockets[idx] < 0 || !tracker_healthy[idx]) ordered.push_back(idx);
+    }
+    return ordered;
+}
 
-        if (!connect_to_available_tracker()) {
-            return "ERROR: All trackers are down.";
+bool Client::read_tracker_frame(int tracker_idx, string& frame, int timeout_ms, bool& timed_out) {
+    // Frames are newline-terminated; keep whatever follows for the next call
+    string& pending = tracker_pending[tracker_idx];
+    size_t newline;
+    timed_out = false;
+    while ((newline = pending.find('\n')) == string::npos) {
+        if (!wait_readable(tracker_sockets[tracker_idx], timeout_ms)) {
+            timed_out = true;
+            return false;
+        }
+        ssize_t bytes_read = read(tracker_sockets[tracker_idx], tracker_reply_buffer.data(), tracker_reply_buffer.size());
+        if (bytes_read <= 0) {
+            return false;
         }
+        pending.append(tracker_reply_buffer.data(), bytes_read);
+    }
+    frame = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    return true;
+}
 
-        if (is_logged_in) {
-            log_msg("Re-authenticating session with new tracker...");
-            string login_cmd = "login " + user_id + " " + password + " " + to_string(seeder_port);
-            
-            send(tracker_socket, login_cmd.c_str(), login_cmd.length(), 0);
-            
-            // --- FIX: Allocate buffer on HEAP ---
-            char* login_buffer = new char[MSG_SIZE];
-            memset(login_buffer, 0, MSG_SIZE);
-            read(tracker_socket, login_buffer, MSG_SIZE);
-            string login_response(login_buffer);
-            delete[] login_buffer; // Clean up memory
+string Client::exchange_with_tracker(int tracker_idx, const string& command, int timeout_ms, const FrameHandler& on_frame) {
+    int sock = tracker_sockets[tracker_idx];
+    auto started = chrono::steady_clock::now();
+    string framed = command + "\n";
+    if (send(sock, framed.c_str(), framed.length(), MSG_NOSIGNAL) < 0) {
+        drop_tracker_connection(tracker_idx);
+        return "";
+    }
 
-            if(login_response.find("success") == string::npos) {
-                log_msg("Warning: Re-login failed. You may need to login manually.");
-                is_logged_in = false;
+    // A reply that misses its deadline still arrives later, ahead of the next one, so it
+    // is counted as owed and skipped when it comes. Closing the connection instead would
+    // log us out of that tracker. Streamed replies send "+ ..." / "= ..." frames before
+    // the final one; the deadline applies per frame.
+    string response;
+    bool first_frame = true;
+    while (true) {
+        bool timed_out;
+        if (!read_tracker_frame(tracker_idx, response, timeout_ms, timed_out)) {
+            if (timed_out && tracker_owed_replies[tracker_idx] < TRACKER_MAX_OWED_REPLIES) {
+                tracker_owed_replies[tracker_idx]++;
             } else {
-                 log_msg("Re-authentication successful.");
+                drop_tracker_connection(tracker_idx);
             }
+            return "";
         }
-        
-        return send_to_tracker(command, true);
-    };
-
-    if (send(tracker_socket, command.c_str(), command.length(), 0) < 0) {
-        return attempt_failover_and_retry();
+        bool final_frame = response.empty() || (response[0] != '+' && response[0] != '=');
+        if (tracker_owed_replies[tracker_idx] > 0) {
+            if (final_frame) tracker_owed_replies[tracker_idx]--;
+            continue;
+        }
+        if (first_frame) {
+            double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+            double& average = tracker_latency_ms[tracker_idx];
+            average = (average == 0) ? elapsed_ms : 0.8 * average + 0.2 * elapsed_ms;
+            first_frame = false;
+        }
+        if (final_frame) {
+            return response.empty() ? "error : Empty reply" : response;
+        }
+        if (on_frame) on_frame(response);
     }
+}
 
-    char* buffer = new char[MSG_SIZE];
-    memset(buffer, 0, MSG_SIZE);
-    ssize_t bytes_read = read(tracker_socket, buffer, MSG_SIZE);
-    
-    if (bytes_read <= 0) {
-        delete[] buffer; // Clean up memory on error
-        return attempt_failover_and_retry();
+string Client::send_to_tracker(const string& command, const FrameHandler& on_frame) {
+    lock_guard<mutex> lock(tracker_mutex);
+    auto args = parse(command, " ");
+    vector<int> candidates = route_command(args);
+
+    // Once part of a streamed reply has been handed out, retrying elsewhere would repeat it
+    bool frames_delivered = false;
+    FrameHandler track_frames = nullptr;
+    if (on_frame) {
+        track_frames = [&](const string& frame) {
+            frames_delivered = true;
+            on_frame(frame);
+        };
     }
 
-    string response(buffer);
-    delete[] buffer; // Clean up memory
-    return response;
+    for (size_t attempt = 0; attempt < candidates.size(); ++attempt) {
+        int idx = candidates[attempt];
+        if (attempt > 0) {
+            log_msg("Failing over to tracker " + tracker_addresses[idx] + "...");
+        }
+
+        string response = exchange_in_session(idx, command, track_frames);
+        if (response.empty()) {
+            tracker_healthy[idx] = false;
+            if (frames_delivered) {
+                return "ERROR: Connection to tracker lost during the reply.";
+            }
+            continue;
+        }
+
+        if (args[0] == "login" && response.find("success") != string::npos) {
+            // Other connections pick the session up from the token on their next use
+            session_token = take_session_token(response);
+            tracker_authenticated.assign(tracker_addresses.size(), false);
+            tracker_authenticated[idx] = true;
+        } else if (args[0] == "logout" && response.find("success") != string::npos) {
+            session_token = "";
+            tracker_authenticated.assign(tracker_addresses.size(), false);
+        }
+        if (!is_group_command(args)) {
+            current_tracker_idx = idx;
+        }
+        return response;
+    }
+    return "ERROR: All trackers responsible for this command are down.";
 }
 
+void Client::handle_list_groups(const vector<string>& args) {
+    // Each tracker only holds its own shards, so the listings of all trackers are merged.
+    // They are fetched page by page and merged like sorted runs: a name can only be
+    // printed once every tracker that still has more names has moved past it.
+    string filters;
+    string cursor;
+    size_t limit = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i].compare(0, 6, "after=") == 0) cursor = args[i].substr(6);
+        else if (args[i].compare(0, 6, "limit=") == 0) {
+            const char* digits = args[i].c_str() + 6;
+            char* end;
+            limit = strtoul(digits, &end, 10);
+            if (*digits < '0' || *digits > '9' || *end != '\0') {
+                cout << "Usage: list_groups [prefix=<p>] [contains=<s>] [after=<group_id>] [limit=<n>]" << endl;
+                return;
+            }
+        }
+        else filters += " " + args[i];
+    }
+
+    size_t printed = 0;
+    bool any_reply = false;
+    bool header_printed = false;
+    bool more_available = false;
+    while (true) {
+        set<string> merged;
+        string boundary; // highest name that every unfinished tracker has reached
+        bool has_boundary = false;
+        {
+            lock_guard<mutex> lock(tracker_mutex);
+            for (size_t idx = 0; idx < tracker_addresses.size(); ++idx) {
+                string command = "list_groups" + filters + " limit=" + to_string(LIST_PAGE_SIZE);
+                if (!cursor.empty()) command += " after=" + cursor;
+
+                vector<string> names;
+                bool more = false;
+                auto collect = [&](const string& frame) {
+                    if (frame.compare(0, 7, "= next ") == 0) {
+                        more = true;
+                        return;
+                    }
+                    for (const auto& name : parse(frame.substr(1), " ")) {
+                        if (!name.empty()) names.push_back(name);
+                    }
+                };
+                string response = exchange_in_session(idx, command, collect);
+                if (response.compare(0, 7, "success") != 0) continue;
+                any_reply = true;
+                if (response.find("No groups available.") == string::npos) {
+                    collect("+" + response.substr(7));
+                }
+
+                merged.insert(names.begin(), names.end());
+                if (more && !names.empty() && (!has_boundary || names.back() < boundary)) {
+                    boundary = names.back();
+                    has_boundary = true;
+                }
+            }
+        }
+
+        string line;
+        size_t taken = 0;
+        for (const auto& name : merged) {
+            if (has_boundary && name > boundary) break;
+            if (limit > 0 && printed == limit) break;
+            line += name + " ";
+            cursor = name;
+            ++printed;
+            ++taken;
+        }
+        if (!line.empty()) {
+            cout << (header_printed ? "" : "success ") << line << flush;
+            header_printed = true;
+        }
+        if (limit > 0 && printed == limit) {
+            more_available = has_boundary || taken < merged.size();
+            break;
+        }
+        if (!has_boundary) {
+            break;
+        }
+    }
+
+    if (!any_reply) {
+        cout << "ERROR: All trackers are down." << endl;
+        return;
+    }
+    if (printed == 0) {
+        cout << "success No groups available.";
+    }
+    if (more_available) {
+        cout << "(more: list_groups" << filters << " after=" << cursor << ")";
+    }
+    cout << endl;
+}
 
 void Client::process_user_input() {
     string line;
@@ -191,13 +563,39 @@ void Client::process_user_input() {
             handle_login(args);
         } else if (command == "upload_file") {
             handle_upload(args);
-        } else if (command == "download_file") {
+        } else if (command == "upload_bundle") {
+            handle_upload_bundle(args);
+        } else if (command == "download_file" || command == "download_range") {
             handle_download(args);
+        } else if (command == "pause_download" || command == "resume_download" ||
+                   command == "set_priority" || command == "set_max_downloads") {
+            handle_transfer_control(args);
         } else if (command == "show_downloads") {
-            show_downloads();
+            show_downloads(args.size() > 1 && args[1] == "json");
+        } else if (command == "list_groups") {
+            handle_list_groups(args);
+        } else if (command == "list_files") {
+            handle_list_files(line, args);
+        } else if (command == "set_compression") {
+            if (args.size() != 2 || (args[1] != "on" && args[1] != "off")) {
+                cout << "Usage: set_compression <on|off>" << endl;
+            } else {
+                compression_enabled = (args[1] == "on");
+                cout << "success Compression " << args[1] << endl;
+            }
+        } else if (command == "set_direct_io") {
+            if (args.size() != 2 || (args[1] != "on" && args[1] != "off")) {
+                cout << "Usage: set_direct_io <on|off>" << endl;
+            } else {
+                direct_io_enabled = (args[1] == "on");
+                cout << "success Direct I/O " << args[1] << endl;
+            }
         } else {
             string response = send_to_tracker(line);
             cout << response << endl;
+            if (command == "stop_share" && args.size() > 2) {
+                invalidate_cached_seeders(args[1], args[2]);
+            }
             if (command == "logout" && response.find("success") != string::npos) {
                 is_logged_in = false;
                 user_id = "";
@@ -254,112 +652,607 @@ void Client::start_seeder_service() {
 }
 
 void Client::handle_peer_connection(int peer_socket) {
-    char buffer[1024] = {0};
-    read(peer_socket, buffer, 1024);
-    
-    auto args = parse(string(buffer), " ");
-    if (args.size() == 3 && args[0] == "get_piece") {
+    // A leecher keeps its connection open and asks for one piece after another.
+    // Every request is a "get_piece <filename> <index> [piece hash]" line, answered by
+    // a "piece <length>" line and the piece bytes, or by an "error <reason>" line. A
+    // piece hash is looked up first, so identical content shared under another name
+    // can be served to leechers of any file.
+    // A session may start with "hello deflate"; if we agree, pieces that shrink
+    // are sent as "zpiece <length> <compressed length>" plus the deflated bytes.
+    // "pex <group>/<filename> <port> [address...]" swaps known seeders of a file we
+    // share; see answer_peer_exchange.
+    timeval send_timeout;
+    send_timeout.tv_sec = PIECE_READ_TIMEOUT_MS / 1000;
+    send_timeout.tv_usec = (PIECE_READ_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(peer_socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    PooledBuffer pooled_piece(piece_buffers());
+    char* piece_buffer = pooled_piece.get();
+    vector<char> compressed;
+    bool compress_session = false;
+    int compression_misses = 0;
+    int pieces_served = 0;
+    string request;
+    while (read_line(peer_socket, request, PEER_IDLE_TIMEOUT_MS)) {
+        auto args = parse(request, " ");
+        if (!args.empty() && args[0] == "hello") {
+            compress_session = compression_enabled && find(args.begin() + 1, args.end(), "deflate") != args.end();
+            string reply = compress_session ? "hello deflate\n" : "hello none\n";
+            if (!send_all(peer_socket, reply.c_str(), reply.length())) break;
+            continue;
+        }
+        if (args.size() >= 3 && args[0] == "pex") {
+            string reply = answer_peer_exchange(peer_socket, args) + "\n";
+            if (!send_all(peer_socket, reply.c_str(), reply.length())) break;
+            continue;
+        }
+        if ((args.size() != 3 && args.size() != 4) || args[0] != "get_piece") {
+            string reply = "error Unknown request\n";
+            send_all(peer_socket, reply.c_str(), reply.length());
+            continue;
+        }
         const string& filename = args[1];
-        int piece_index = stoi(args[2]);
+        unsigned long requested_piece;
+        if (!parse_unsigned(args[2], 10, requested_piece) || requested_piece > INT_MAX) {
+            string reply = "error Bad request\n";
+            if (!send_all(peer_socket, reply.c_str(), reply.length())) break;
+            continue;
+        }
+        int piece_index = requested_piece;
 
         string file_path;
+        long long offset = (long long)piece_index * PIECE_SIZE;
         {
             lock_guard<mutex> lock(shared_files_mutex);
-            if (shared_files.count(filename)) {
+            auto local = args.size() == 4 ? local_pieces.find(args[3]) : local_pieces.end();
+            if (local != local_pieces.end()) {
+                file_path = local->second.first;
+                offset = local->second.second;
+            } else if (shared_files.count(filename)) {
                 file_path = shared_files.at(filename);
             }
         }
 
-        if (!file_path.empty()) {
-            int fd = open(file_path.c_str(), O_RDONLY);
-            if (fd != -1) {
-                lseek(fd, (long long)piece_index * PIECE_SIZE, SEEK_SET);
-                
-                // --- FIX: Allocate buffer on HEAP ---
-                char* piece_buffer = new char[PIECE_SIZE];
-                ssize_t bytes_read = read(fd, piece_buffer, PIECE_SIZE);
-                
-                if (bytes_read > 0) {
-                    send(peer_socket, piece_buffer, bytes_read, 0);
-                }
-                delete[] piece_buffer; // Clean up memory
-                close(fd);
-            }
+        ssize_t bytes_read = file_path.empty() ? -1 : read_stored(file_path, piece_buffer, PIECE_SIZE, offset);
+        if (bytes_read <= 0) {
+            string reply = "error Piece not available\n";
+            if (!send_all(peer_socket, reply.c_str(), reply.length())) break;
+            continue;
+        }
+
+        // Already-compressed content never shrinks, so stop paying for deflate after a
+        // few misses and only probe occasionally in case the file changes character.
+        bool try_compress = compress_session &&
+            (compression_misses < COMPRESSION_MISS_LIMIT || pieces_served % COMPRESSION_RETRY_INTERVAL == 0);
+        bool use_compressed = false;
+        if (try_compress) {
+            use_compressed = compress_piece(piece_buffer, bytes_read, compressed);
+            compression_misses = use_compressed ? 0 : compression_misses + 1;
+        }
+        pieces_served++;
+
+        if (emulated_delay_ms > 0) {
+            this_thread::sleep_for(chrono::milliseconds(emulated_delay_ms));
+        }
+        active_uploads++;
+        auto send_started = chrono::steady_clock::now();
+        bool sent;
+        if (use_compressed) {
+            string header = "zpiece " + to_string(bytes_read) + " " + to_string(compressed.size()) + "\n";
+            sent = send_all(peer_socket, header.c_str(), header.length()) &&
+                   send_all(peer_socket, compressed.data(), compressed.size());
+            if (sent) bytes_uploaded += compressed.size();
+        } else {
+            string header = "piece " + to_string(bytes_read) + "\n";
+            sent = send_all(peer_socket, header.c_str(), header.length()) &&
+                   send_all(peer_socket, piece_buffer, bytes_read);
+            if (sent) bytes_uploaded += bytes_read;
+        }
+        if (sent && emulated_rate_kbps > 0) {
+            size_t wire_bytes = use_compressed ? compressed.size() : bytes_read;
+            auto paced_until = send_started + chrono::microseconds(wire_bytes * 1000000LL / (emulated_rate_kbps * 1024));
+            this_thread::sleep_until(paced_until);
         }
+        active_uploads--;
+        if (!sent) break;
     }
     close(peer_socket);
 }
 
-void Client::handle_upload(const vector<string>& args) {
-    if (args.size() != 3) {
-        cout << "Usage: upload_file <group_id> <file_path>" << endl;
-        return;
+// Hash a piece space read through read_at: SHA1 and rolling checksum of every piece
+// (rolling checksums let consumers of a later version find these pieces) and the
+// SHA1 of the whole content
+static bool hash_piece_space(const function<ssize_t(char*, size_t, long long)>& read_at, long long total_size,
+                             vector<string>& piece_hashes, string& weak_checksums, string& file_hash) {
+    PooledBuffer pooled_piece(piece_buffers());
+    char* piece_buffer = pooled_piece.get();
+    stringstream weak_stream;
+
+    SHA_CTX sha_context;
+    SHA1_Init(&sha_context);
+
+    bool ok = true;
+    for (long long offset = 0; offset < total_size; offset += PIECE_SIZE) {
+        size_t piece_len = min((long long)PIECE_SIZE, total_size - offset);
+        if (read_at(piece_buffer, piece_len, offset) != (ssize_t)piece_len) {
+            ok = false;
+            break;
+        }
+        piece_hashes.push_back(sha(piece_buffer, piece_len));
+        RollingChecksum weak;
+        weak.init((const unsigned char*)piece_buffer, piece_len);
+        weak_stream << (weak_stream.tellp() > 0 ? "," : "") << hex << weak.digest();
+        SHA1_Update(&sha_context, piece_buffer, piece_len);
     }
-    if (!is_logged_in) {
-        cout << "You must be logged in to upload files." << endl;
-        return;
+
+    unsigned char full_hash_raw[SHA_DIGEST_LENGTH];
+    SHA1_Final(full_hash_raw, &sha_context);
+
+    stringstream ss;
+    ss << hex << setfill('0');
+    for (int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+        ss << setw(2) << static_cast<unsigned int>(full_hash_raw[i]);
     }
+    file_hash = ss.str();
+    weak_checksums = weak_stream.str();
+    return ok;
+}
 
-    const string& group_id = args[1];
-    const string& file_path = args[2];
-    string filename = file_path.substr(file_path.find_last_of("/\\") + 1);
+// The arguments of upload_file after its group_id
+static string upload_record(const string& name, long long size, const vector<string>& piece_hashes,
+                            const string& weak_checksums, const string& file_hash, const string& manifest) {
+    stringstream record;
+    record << name << " " << size << " " << file_hash;
+    for(const auto& p_hash : piece_hashes) {
+        record << " " << p_hash;
+    }
+    if (!piece_hashes.empty()) {
+        record << " weak=" << weak_checksums;
+    }
+    if (!manifest.empty()) {
+        record << " bundle=" << manifest;
+    }
+    return record.str();
+}
 
+// SHA1, rolling checksums and whole-file hash of the file at file_path
+static bool hash_upload(const string& file_path, long long& file_size, vector<string>& piece_hashes,
+                        string& weak_checksums, string& file_hash) {
     int fd = open(file_path.c_str(), O_RDONLY);
     if (fd < 0) {
         cout << "ERROR: Cannot open file " << file_path << endl;
-        return;
+        return false;
     }
     
     struct stat file_stat;
     if (fstat(fd, &file_stat) < 0) {
         cout << "ERROR: Cannot get file stats for " << file_path << endl;
         close(fd);
+        return false;
+    }
+    file_size = file_stat.st_size;
+
+    bool hashed = hash_piece_space([fd](char* buf, size_t len, long long offset) { return pread(fd, buf, len, offset); },
+                                   file_size, piece_hashes, weak_checksums, file_hash);
+    close(fd);
+    if (!hashed) {
+        cout << "ERROR: Cannot read file " << file_path << endl;
+    }
+    return hashed;
+}
+
+void Client::handle_upload(const vector<string>& args) {
+    // Several files are published with one batch command
+    if (args.size() < 3) {
+        cout << "Usage: upload_file <group_id> <file_path> [file_path...]" << endl;
+        return;
+    }
+    if (!is_logged_in) {
+        cout << "You must be logged in to upload files." << endl;
         return;
     }
-    long long file_size = file_stat.st_size;
 
-    vector<string> piece_hashes;
-    char* piece_buffer = new char[PIECE_SIZE];
+    const string& group_id = args[1];
+    vector<string> names, paths, items;
+    vector<vector<string>> hashes;
+    for (size_t k = 2; k < args.size(); ++k) {
+        const string& file_path = args[k];
+        string filename = file_path.substr(file_path.find_last_of("/\\") + 1);
+        long long file_size;
+        vector<string> piece_hashes;
+        string weak_checksums, full_file_hash;
+        if (!hash_upload(file_path, file_size, piece_hashes, weak_checksums, full_file_hash)) continue;
+
+        if (args.size() == 3) {
+            publish_upload(group_id, filename, file_path, file_size, piece_hashes, weak_checksums, full_file_hash, "");
+            return;
+        }
+        names.push_back(filename);
+        paths.push_back(file_path);
+        items.push_back("upload_file " + upload_record(filename, file_size, piece_hashes, weak_checksums, full_file_hash, ""));
+        hashes.push_back(piece_hashes);
+    }
+    if (items.empty()) return;
+
+    vector<string> results = send_batch(group_id, items);
+    int uploaded = 0;
+    for (size_t k = 0; k < items.size(); ++k) {
+        if (results[k] == "ok") {
+            adopt_upload(group_id, names[k], paths[k], hashes[k]);
+            uploaded++;
+        } else {
+            cout << "error " << names[k] << ": " << results[k] << endl;
+        }
+    }
+    cout << (uploaded > 0 ? "success " : "error ") << uploaded << " of " << items.size() << " files uploaded" << endl;
+}
 
-    SHA_CTX sha_context;
-    SHA1_Init(&sha_context);
+// Collect the regular files under root/rel, as paths relative to root
+static bool list_bundle_files(const string& root, const string& rel, vector<string>& files) {
+    string dir_path = rel.empty() ? root : root + "/" + rel;
+    DIR* dir = opendir(dir_path.c_str());
+    if (!dir) return false;
+    bool ok = true;
+    while (dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        string child = rel.empty() ? name : rel + "/" + name;
+        struct stat child_stat;
+        if (stat((root + "/" + child).c_str(), &child_stat) < 0) continue;
+        if (S_ISDIR(child_stat.st_mode)) {
+            ok = list_bundle_files(root, child, files) && ok;
+        } else if (S_ISREG(child_stat.st_mode)) {
+            files.push_back(child);
+        }
+    }
+    closedir(dir);
+    return ok;
+}
 
-    ssize_t bytes_read;
-    while((bytes_read = read(fd, piece_buffer, PIECE_SIZE)) > 0) {
-        piece_hashes.push_back(sha(piece_buffer, bytes_read));
-        SHA1_Update(&sha_context, piece_buffer, bytes_read);
+void Client::handle_upload_bundle(const vector<string>& args) {
+    // A bundle packs every file under a directory into one piece space, in path
+    // order, so the whole tree is hashed in one pass, published with one tracker
+    // command and downloaded by one scheduler. Pieces may span file boundaries.
+    if (args.size() != 3) {
+        cout << "Usage: upload_bundle <group_id> <directory_path>" << endl;
+        return;
+    }
+    if (!is_logged_in) {
+        cout << "You must be logged in to upload files." << endl;
+        return;
     }
-    close(fd);
-    delete[] piece_buffer; // Clean up memory
 
-    unsigned char full_hash_raw[SHA_DIGEST_LENGTH];
-    SHA1_Final(full_hash_raw, &sha_context);
+    const string& group_id = args[1];
+    string root = args[2];
+    while (root.size() > 1 && root.back() == '/') root.pop_back();
+    string bundle_name = root.substr(root.find_last_of('/') + 1);
 
-    stringstream ss;
-    ss << hex << setfill('0');
-    for (int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
-        ss << setw(2) << static_cast<unsigned int>(full_hash_raw[i]);
+    vector<string> files;
+    if (!list_bundle_files(root, "", files)) {
+        cout << "ERROR: Cannot read directory " << root << endl;
+        return;
     }
-    string full_file_hash = ss.str();
-    
-    stringstream command_stream;
-    command_stream << "upload_file " << group_id << " " << filename << " " << file_size << " " << full_file_hash;
-    for(const auto& p_hash : piece_hashes) {
-        command_stream << " " << p_hash;
+    sort(files.begin(), files.end());
+
+    vector<FileSpan> layout;
+    stringstream manifest;
+    long long total_size = 0;
+    for (const auto& rel : files) {
+        struct stat file_stat;
+        if (stat((root + "/" + rel).c_str(), &file_stat) < 0) continue;
+        FileSpan span;
+        span.path = root + "/" + rel;
+        span.offset = total_size;
+        span.length = file_stat.st_size;
+        layout.push_back(span);
+        total_size += span.length;
+        manifest << (layout.size() > 1 ? "," : "") << escape_manifest_path(rel) << ":" << span.length;
+    }
+    if (layout.empty()) {
+        cout << "ERROR: No files to share in " << root << endl;
+        return;
     }
 
-    string response = send_to_tracker(command_stream.str());
+    vector<string> piece_hashes;
+    string weak_checksums, bundle_hash;
+    bool hashed = hash_piece_space([&layout](char* buf, size_t len, long long offset) { return layout_pread(layout, buf, len, offset); },
+                                   total_size, piece_hashes, weak_checksums, bundle_hash);
+    if (!hashed) {
+        cout << "ERROR: Cannot read files under " << root << endl;
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(shared_files_mutex);
+        bundle_layouts[root] = make_shared<const vector<FileSpan>>(layout);
+    }
+    log_msg("Bundle " + bundle_name + ": " + to_string(layout.size()) + " files, " + to_string(total_size) + " bytes");
+    publish_upload(group_id, bundle_name, root, total_size, piece_hashes, weak_checksums, bundle_hash, manifest.str());
+}
+
+void Client::publish_upload(const string& group_id, const string& name, const string& storage, long long size,
+                            const vector<string>& piece_hashes, const string& weak_checksums,
+                            const string& file_hash, const string& manifest) {
+    string response = send_to_tracker("upload_file " + group_id + " " +
+                                      upload_record(name, size, piece_hashes, weak_checksums, file_hash, manifest));
     cout << response << endl;
 
     if (response.find("success") != string::npos) {
+        adopt_upload(group_id, name, storage, piece_hashes);
+    }
+}
+
+// Start seeding a file the tracker accepted
+void Client::adopt_upload(const string& group_id, const string& name, const string& storage,
+                          const vector<string>& piece_hashes) {
+    {
         lock_guard<mutex> lock(shared_files_mutex);
-        shared_files[filename] = file_path;
+        shared_files[name] = storage;
+        shared_file_groups[name] = group_id;
+    }
+    register_local_pieces(storage, piece_hashes);
+    lock_guard<mutex> lock(metadata_cache_mutex);
+    list_files_cache.erase(group_id);
+    metadata_cache.erase(group_id + "/" + name);
+}
+
+vector<string> Client::send_batch(const string& group_id, const vector<string>& items) {
+    vector<string> results;
+    for (size_t first = 0; first < items.size(); first += BATCH_MAX_ITEMS) {
+        size_t last = min(items.size(), first + BATCH_MAX_ITEMS);
+        string command = "batch " + group_id;
+        for (size_t k = first; k < last; ++k) command += (k == first ? " " : " ; ") + items[k];
+        string response = send_to_tracker(command);
+
+        auto fields = parse(response, " ");
+        if (fields.size() == 3 + last - first && fields[0] == "success" && fields[1] == "batch") {
+            results.insert(results.end(), fields.begin() + 3, fields.end());
+            continue;
+        }
+        if (response.find("Invalid command") == string::npos) {
+            // The whole batch was refused (not logged in, unknown group, ...)
+            results.insert(results.end(), last - first, response);
+            continue;
+        }
+        // A tracker from before batching: one command per item
+        for (size_t k = first; k < last; ++k) {
+            size_t op_end = items[k].find(' ');
+            string single = items[k].substr(0, op_end) + " " + group_id + items[k].substr(op_end);
+            string reply = send_to_tracker(single);
+            results.push_back(reply.compare(0, 7, "success") == 0 ? "ok" : reply);
+        }
+    }
+    return results;
+}
+
+ssize_t Client::read_stored(const string& storage, char* buf, size_t len, long long offset) {
+    shared_ptr<const vector<FileSpan>> layout;
+    {
+        lock_guard<mutex> lock(shared_files_mutex);
+        auto it = bundle_layouts.find(storage);
+        if (it != bundle_layouts.end()) layout = it->second;
+    }
+    if (layout) {
+        return layout_pread(*layout, buf, len, offset);
+    }
+    int fd = open(storage.c_str(), O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t bytes_read = DiskIO::instance().read_at(fd, buf, len, offset);
+    close(fd);
+    return bytes_read;
+}
+
+// Parse the "<seeders...> [alt <addr> <ranges>]... [weak <c0,c1,...>] [bundle <manifest>]"
+// tail of a download_file reply, where ranges such as "0-99,120" list the pieces an
+// alternate seeder can serve and weak carries the per-piece rolling checksums in hex.
+// Both come from the uploader: malformed checksums are dropped, and so is an alternate
+// seeder with malformed ranges.
+static void parse_seeder_fields(const vector<string>& fields, size_t start, FileMetadata& metadata) {
+    metadata.seeders.clear();
+    metadata.partial_seeders.clear();
+    size_t i = start;
+    for (; i < fields.size() && fields[i] != "alt" && fields[i] != "weak" && fields[i] != "bundle"; ++i) {
+        if (!fields[i].empty()) metadata.seeders.push_back(fields[i]);
+    }
+    while (i < fields.size()) {
+        if (fields[i] == "weak" && i + 1 < fields.size()) {
+            metadata.weak_checksums.clear();
+            for (const auto& checksum : parse(fields[i + 1], ",")) {
+                unsigned long value;
+                if (!parse_unsigned(checksum, 16, value) || value > UINT32_MAX) {
+                    metadata.weak_checksums.clear();
+                    break;
+                }
+                metadata.weak_checksums.push_back(value);
+            }
+            i += 2;
+        } else if (fields[i] == "bundle" && i + 1 < fields.size()) {
+            metadata.bundle_manifest = fields[i + 1];
+            i += 2;
+        } else if (fields[i] == "alt" && i + 2 < fields.size()) {
+            vector<bool>& covered = metadata.partial_seeders[fields[i + 1]];
+            covered.assign(metadata.piece_hashes.size(), false);
+            for (const auto& range : parse(fields[i + 2], ",")) {
+                size_t dash = range.find('-');
+                unsigned long first, last;
+                if (!parse_unsigned(range.substr(0, dash), 10, first) ||
+                    (dash != string::npos && !parse_unsigned(range.substr(dash + 1), 10, last))) {
+                    metadata.partial_seeders.erase(fields[i + 1]);
+                    break;
+                }
+                if (dash == string::npos) last = first;
+                for (size_t piece = first; piece <= last && piece < covered.size(); ++piece) {
+                    covered[piece] = true;
+                }
+            }
+            i += 3;
+        } else {
+            break;
+        }
     }
 }
 
+// Parse a full "success <size> <file_hash> <piece hashes...> <seeders...>" reply
+static bool parse_file_metadata(const string& response, FileMetadata& metadata) {
+    auto fields = parse(response, " ");
+    if (fields.size() < 3 || fields[0] != "success") return false;
+
+    metadata.file_size = stoll(fields[1]);
+    metadata.file_hash = fields[2];
+    size_t total_pieces = (metadata.file_size + PIECE_SIZE - 1) / PIECE_SIZE;
+    if (fields.size() < 3 + total_pieces) {
+        LOG_ERROR("Missing piece hash metadata in tracker reply");
+        return false;
+    }
+    metadata.piece_hashes.assign(fields.begin() + 3, fields.begin() + 3 + total_pieces);
+    metadata.weak_checksums.clear();
+    metadata.bundle_manifest.clear();
+    parse_seeder_fields(fields, 3 + total_pieces, metadata);
+    metadata.seeders_fetched_at = chrono::steady_clock::now();
+    return true;
+}
+
+bool Client::fetch_file_metadata(const string& group_id, const string& filename, FileMetadata& metadata) {
+    string key = group_id + "/" + filename;
+    bool cached = false;
+    {
+        lock_guard<mutex> lock(metadata_cache_mutex);
+        auto it = metadata_cache.find(key);
+        if (it != metadata_cache.end()) {
+            metadata = it->second;
+            cached = true;
+        }
+    }
+
+    // Fresh cache entry: no tracker round trip at all
+    if (cached && chrono::steady_clock::now() - metadata.seeders_fetched_at < chrono::milliseconds(SEEDER_CACHE_TTL_MS)) {
+        return true;
+    }
+
+    // Stale entry: send the known file hash so the tracker only returns seeders if
+    // the file is unchanged, instead of the whole piece-hash list.
+    string command = "download_file " + group_id + " " + filename;
+    if (cached) command += " " + metadata.file_hash;
+    string response = send_to_tracker(command);
+
+    if (cached && response.compare(0, 17, "success unchanged") == 0) {
+        parse_seeder_fields(parse(response, " "), 2, metadata);
+        metadata.seeders_fetched_at = chrono::steady_clock::now();
+    } else if (!parse_file_metadata(response, metadata)) {
+        lock_guard<mutex> lock(metadata_cache_mutex);
+        metadata_cache.erase(key);
+        cout << response << endl;
+        return false;
+    }
+
+    lock_guard<mutex> lock(metadata_cache_mutex);
+    metadata_cache[key] = metadata;
+    return true;
+}
+
+void Client::invalidate_cached_seeders(const string& group_id, const string& filename) {
+    lock_guard<mutex> lock(metadata_cache_mutex);
+    auto it = metadata_cache.find(group_id + "/" + filename);
+    if (it != metadata_cache.end()) {
+        it->second.seeders_fetched_at = chrono::steady_clock::time_point();
+    }
+}
+
+void Client::handle_list_files(const string& line, const vector<string>& args) {
+    if (args.size() < 2) {
+        cout << send_to_tracker(line) << endl;
+        return;
+    }
+    bool plain_listing = args.size() == 2;
+    if (plain_listing) {
+        lock_guard<mutex> lock(metadata_cache_mutex);
+        auto it = list_files_cache.find(args[1]);
+        if (it != list_files_cache.end() &&
+            chrono::steady_clock::now() - it->second.first < chrono::milliseconds(LIST_FILES_CACHE_TTL_MS)) {
+            cout << it->second.second << endl;
+            return;
+        }
+    }
+
+    // Large listings arrive as several frames; print each one as it comes in
+    // instead of holding the whole catalog in memory.
+    bool streamed = false;
+    string next_cursor;
+    auto print_frame = [&](const string& frame) {
+        if (frame.compare(0, 7, "= next ") == 0) {
+            next_cursor = frame.substr(7);
+            return;
+        }
+        cout << (streamed ? "" : "success") << frame.substr(1) << " " << flush;
+        streamed = true;
+    };
+    string response = send_to_tracker(line, print_frame);
+
+    if (!streamed) {
+        cout << response;
+    } else if (response.compare(0, 7, "success") == 0) {
+        cout << response.substr(8);
+    } else {
+        cout << endl << response;
+    }
+    if (!next_cursor.empty()) {
+        cout << "(more: " << line << " after=" << next_cursor << ")";
+    }
+    cout << endl;
+
+    // Only small, unfiltered listings are worth caching
+    if (plain_listing && !streamed && response.compare(0, 7, "success") == 0) {
+        lock_guard<mutex> lock(metadata_cache_mutex);
+        list_files_cache[args[1]] = make_pair(chrono::steady_clock::now(), response);
+    }
+}
+
+// Downloads are known by file name; a byte range also by its offset and length
+static string download_name(const string& filename, const DownloadOptions& options) {
+    if (options.range_length < 0) return filename;
+    return filename + ":" + to_string(options.range_offset) + "+" + to_string(options.range_length);
+}
+
 void Client::handle_download(const vector<string>& args) {
-    if (args.size() != 4) {
-        cout << "Usage: download_file <group_id> <file_name> <destination_path>" << endl;
+    // The optional base_path names an older local version of the file: pieces found in
+    // it (at any offset) are copied instead of downloaded. It may be the destination itself.
+    // download_range fetches only the pieces covering the range and writes only its bytes.
+    // priority= and weight= place the download in the client's transfer scheduler;
+    // progress= publishes the verified prefix so the file can be read while it downloads.
+    bool ranged = args[0] == "download_range";
+    vector<string> positional;
+    TransferPriority priority = PRIORITY_NORMAL;
+    int weight = 1;
+    DownloadOptions options;
+    bool valid = true;
+    for (const auto& arg : args) {
+        if (arg.compare(0, 9, "progress=") == 0) {
+            options.progress_path = arg.substr(9);
+            valid = valid && !options.progress_path.empty();
+        } else if (arg.compare(0, 9, "priority=") == 0) {
+            valid = valid && parse_priority(arg.substr(9), priority);
+        } else if (arg.compare(0, 7, "weight=") == 0) {
+            weight = atoi(arg.substr(7).c_str());
+            valid = valid && weight > 0;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (ranged && valid && positional.size() == 6) {
+        char* end_offset;
+        char* end_length;
+        options.range_offset = strtoll(positional[3].c_str(), &end_offset, 10);
+        options.range_length = strtoll(positional[4].c_str(), &end_length, 10);
+        valid = *end_offset == '\0' && *end_length == '\0' && options.range_offset >= 0 && options.range_length > 0;
+    }
+    if (ranged && (!valid || positional.size() != 6)) {
+        cout << "Usage: download_range <group_id> <file_name> <offset> <length> <destination_path>"
+             << " [priority=<high|normal|low>] [weight=<n>] [progress=<file>]" << endl;
+        return;
+    }
+    if (!ranged && (!valid || (positional.size() != 4 && positional.size() != 5))) {
+        cout << "Usage: download_file <group_id> <file_name> <destination_path> [base_path]"
+             << " [priority=<high|normal|low>] [weight=<n>] [progress=<file>]" << endl;
         return;
     }
     if (!is_logged_in) {
@@ -367,170 +1260,854 @@ void Client::handle_download(const vector<string>& args) {
         return;
     }
 
-    string command = "download_file " + args[1] + " " + args[2];
-    string response = send_to_tracker(command);
-    
-    auto metadata = parse(response, " ");
-    if (metadata[0] == "success") {
-        log_msg("Starting download for " + args[2]);
-        thread downloader(&Client::download_manager, this, args[1], args[2], args[3], metadata);
-        downloader.detach();
+    const string& group_id = positional[1];
+    const string& filename = positional[2];
+    const string& dest_path = ranged ? positional[5] : positional[3];
+    FileMetadata metadata;
+    if (!fetch_file_metadata(group_id, filename, metadata)) return;
+    if (ranged && !metadata.bundle_manifest.empty()) {
+        cout << "ERROR: Byte ranges of bundles are not supported." << endl;
+        return;
+    }
+    if (ranged && options.range_offset + options.range_length > metadata.file_size) {
+        cout << "ERROR: The range ends past the end of " << filename << " (" << metadata.file_size << " bytes)." << endl;
+        return;
+    }
+
+    string name = download_name(filename, options);
+    transfers.add(name, priority, weight);
+    if (transfers.runnable(name)) {
+        log_msg("Starting download for " + name);
     } else {
-        // cout << response << endl;
+        log_msg("Queued download of " + name + " behind more urgent downloads");
+    }
+    if (positional.size() == 5) options.base_path = positional[4];
+    thread downloader(&Client::download_manager, this, group_id, filename, dest_path, metadata, options);
+    downloader.detach();
+}
+
+void Client::handle_transfer_control(const vector<string>& args) {
+    const string& command = args[0];
+    if (command == "set_max_downloads") {
+        if (args.size() != 2 || atoi(args[1].c_str()) <= 0) {
+            cout << "Usage: set_max_downloads <n>" << endl;
+            return;
+        }
+        transfers.set_max_active(atoi(args[1].c_str()));
+        cout << "success At most " << args[1] << " downloads run at once" << endl;
+        return;
+    }
+    if (command == "set_priority") {
+        TransferPriority priority;
+        int weight = args.size() == 4 ? atoi(args[3].c_str()) : 0;
+        if ((args.size() != 3 && args.size() != 4) || !parse_priority(args[2], priority) ||
+            (args.size() == 4 && weight <= 0)) {
+            cout << "Usage: set_priority <file_name> <high|normal|low> [weight]" << endl;
+            return;
+        }
+        if (!transfers.set_priority(args[1], priority, weight)) {
+            cout << "ERROR: No download in progress for " << args[1] << endl;
+            return;
+        }
+        cout << "success " << args[1] << " is now " << args[2] << " priority" << endl;
+        return;
+    }
+    if (args.size() != 2) {
+        cout << "Usage: " << command << " <file_name>" << endl;
+        return;
+    }
+    bool found = command == "pause_download" ? transfers.pause(args[1]) : transfers.resume(args[1]);
+    if (!found) {
+        cout << "ERROR: No download in progress for " << args[1] << endl;
+        return;
+    }
+    cout << "success " << args[1] << (command == "pause_download" ? " paused" : " resumed") << endl;
+}
+
+bool Client::open_peer_session(int peer_sock) {
+    if (!compression_enabled) {
+        return true;
+    }
+    string hello = "hello deflate\n";
+    string reply;
+    if (!send_all(peer_sock, hello.c_str(), hello.length()) ||
+        !read_line(peer_sock, reply, PIECE_READ_TIMEOUT_MS)) {
+        return false;
+    }
+    return reply.compare(0, 5, "hello") == 0;
+}
+
+// Peer exchange gossips per swarm: one file of one group
+static string pex_swarm(const string& group_id, const string& filename) {
+    return group_id + "/" + filename;
+}
+
+// A leecher that will seed the file sends its seeder port, and is remembered at the
+// address it connected from. Gossip about files we do not share is ignored, so the
+// peer lists stay bounded by our own files. Names are only unique within a group, so
+// the swarm is named "<group>/<filename>"; a bare filename from an older peer means
+// the file of that name we share.
+string Client::answer_peer_exchange(int peer_socket, const vector<string>& args) {
+    size_t slash = args[1].rfind('/');
+    string filename = slash == string::npos ? args[1] : args[1].substr(slash + 1);
+    string swarm;
+    bool shared;
+    {
+        lock_guard<mutex> lock(shared_files_mutex);
+        auto group = shared_file_groups.find(filename);
+        shared = shared_files.count(filename) > 0 && group != shared_file_groups.end() &&
+                 (slash == string::npos || args[1].substr(0, slash) == group->second);
+        swarm = shared ? pex_swarm(group->second, filename) : args[1];
+    }
+    string requester;
+    if (shared) {
+        int port = atoi(args[2].c_str());
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        char ip[INET_ADDRSTRLEN];
+        if (port > 0 && getpeername(peer_socket, (sockaddr*)&addr, &addr_len) == 0 &&
+            inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip))) {
+            requester = string(ip) + ":" + to_string(port);
+            peer_exchange.seen(swarm, requester);
+        }
+        peer_exchange.heard(swarm, vector<string>(args.begin() + 3, args.end()));
+    }
+    string reply = "pex";
+    for (const auto& address : peer_exchange.sample(swarm, requester)) reply += " " + address;
+    return reply;
+}
+
+bool Client::exchange_peers(int peer_sock, const string& swarm, bool announce, vector<string>& learned) {
+    string request = "pex " + swarm + " " + (announce ? to_string(seeder_port) : "0");
+    for (const auto& address : peer_exchange.sample(swarm)) request += " " + address;
+    request += "\n";
+    string reply;
+    if (!send_all(peer_sock, request.c_str(), request.length()) ||
+        !read_line(peer_sock, reply, PIECE_READ_TIMEOUT_MS)) {
+        return false;
+    }
+    // Peers without peer exchange answer "error Unknown request"
+    auto fields = parse(reply, " ");
+    learned.clear();
+    if (!fields.empty() && fields[0] == "pex") learned.assign(fields.begin() + 1, fields.end());
+    return true;
+}
+
+vector<string> Client::known_seeders(const string& swarm) {
+    // Our own address comes back through gossip too; it is the one with our port
+    string own_port = ":" + to_string(seeder_port);
+    vector<string> seeders;
+    for (const auto& address : peer_exchange.sample(swarm)) {
+        if (address.size() <= own_port.size() ||
+            address.compare(address.size() - own_port.size(), own_port.size(), own_port) != 0) {
+            seeders.push_back(address);
+        }
+    }
+    return seeders;
+}
+
+bool Client::request_piece(int peer_sock, const string& filename, int piece_index, const string& piece_hash,
+                           long long expected_size, char* buffer) {
+    string request = "get_piece " + filename + " " + to_string(piece_index) + " " + piece_hash + "\n";
+    if (!send_all(peer_sock, request.c_str(), request.length())) {
+        return false;
+    }
+
+    string header;
+    if (!read_line(peer_sock, header, PIECE_READ_TIMEOUT_MS)) {
+        return false;
+    }
+    // A malformed header fails the piece like any other bad reply
+    auto fields = parse(header, " ");
+    unsigned long piece_size = 0;
+    bool sized = fields.size() >= 2 && parse_unsigned(fields[1], 10, piece_size) &&
+                 piece_size == (unsigned long)expected_size;
+    if (fields.size() == 3 && fields[0] == "zpiece" && sized) {
+        unsigned long compressed_size;
+        if (!parse_unsigned(fields[2], 10, compressed_size) || compressed_size == 0 || compressed_size > PIECE_SIZE) {
+            return false;
+        }
+        PooledBuffer compressed(piece_buffers());
+        return read_full(peer_sock, compressed.get(), compressed_size, PIECE_READ_TIMEOUT_MS) &&
+               decompress_piece(compressed.get(), compressed_size, buffer, expected_size);
+    }
+    if (fields.size() != 2 || fields[0] != "piece" || !sized) {
+        LOG_EVERY_MS(LOG_LEVEL_WARN, 1000, "Seeder refused piece " + to_string(piece_index) + ": " + header);
+        return false;
+    }
+    return read_full(peer_sock, buffer, expected_size, PIECE_READ_TIMEOUT_MS);
+}
+
+void Client::register_local_pieces(const string& file_path, const vector<string>& piece_hashes) {
+    lock_guard<mutex> lock(shared_files_mutex);
+    for (size_t i = 0; i < piece_hashes.size(); ++i) {
+        local_pieces[piece_hashes[i]] = make_pair(file_path, (long long)i * PIECE_SIZE);
+    }
+}
+
+int Client::reuse_local_pieces(const PieceWriter& write_at, const string& dest_path, const vector<string>& piece_hashes,
+                               long long file_size, char* buffer, vector<bool>& have) {
+    // Copy pieces whose content we already hold in some other local file or bundle instead of
+    // downloading them. The source is re-hashed since it may have changed on disk.
+    int reused = 0;
+    for (size_t i = 0; i < piece_hashes.size(); ++i) {
+        if (have[i]) continue;
+        pair<string, long long> source;
+        {
+            lock_guard<mutex> lock(shared_files_mutex);
+            auto it = local_pieces.find(piece_hashes[i]);
+            if (it == local_pieces.end() || it->second.first == dest_path) continue;
+            source = it->second;
+        }
+        long long expected = min((long long)PIECE_SIZE, file_size - (long long)i * PIECE_SIZE);
+        ssize_t bytes_read = read_stored(source.first, buffer, expected, source.second);
+        if (bytes_read != expected || sha(buffer, expected) != piece_hashes[i]) continue;
+        if (!write_at((long long)i * PIECE_SIZE, buffer, expected)) continue;
+        have[i] = true;
+        reused++;
     }
+    return reused;
 }
 
-void Client::download_manager(const string& group_id, const string& filename, const string& dest_path, const vector<string>& metadata) {
+int Client::reuse_base_pieces(const PieceWriter& write_at, const string& base_path, const FileMetadata& metadata, vector<bool>& have) {
+    // rsync-style matching: slide a piece-sized window over the old version one byte at
+    // a time, and only when its rolling checksum matches a missing piece confirm with
+    // SHA1. Matches are found even when data was inserted or removed before them.
+    const vector<uint32_t>& weak = metadata.weak_checksums;
+    size_t total_pieces = metadata.piece_hashes.size();
+    if (weak.size() != total_pieces || total_pieces == 0) return 0;
+
+    int base_fd = open(base_path.c_str(), O_RDONLY);
+    if (base_fd < 0) return 0;
+    struct stat base_stat;
+    if (fstat(base_fd, &base_stat) < 0 || base_stat.st_size == 0) {
+        close(base_fd);
+        return 0;
+    }
+    long long base_size = base_stat.st_size;
+    void* mapped = mmap(nullptr, base_size, PROT_READ, MAP_PRIVATE, base_fd, 0);
+    close(base_fd);
+    if (mapped == MAP_FAILED) return 0;
+    const unsigned char* data = (const unsigned char*)mapped;
+
+    int reused = 0;
+    auto try_window = [&](long long pos, long long len, const vector<int>& pieces) {
+        bool wanted = false;
+        for (int piece : pieces) wanted = wanted || !have[piece];
+        if (!wanted) return false;
+        string strong = sha((const char*)data + pos, len);
+        bool matched = false;
+        for (int piece : pieces) {
+            if (have[piece] || metadata.piece_hashes[piece] != strong) continue;
+            if (!write_at((long long)piece * PIECE_SIZE, (const char*)data + pos, len)) continue;
+            have[piece] = true;
+            reused++;
+            matched = true;
+        }
+        return matched;
+    };
+
+    // Full-size pieces, looked up by weak checksum
+    unordered_map<uint32_t, vector<int>> full_pieces;
+    long long last_len = metadata.file_size - (long long)(total_pieces - 1) * PIECE_SIZE;
+    for (size_t i = 0; i < total_pieces; ++i) {
+        if (!have[i] && (i + 1 < total_pieces || last_len == PIECE_SIZE)) full_pieces[weak[i]].push_back(i);
+    }
+    if (!full_pieces.empty() && base_size >= PIECE_SIZE) {
+        RollingChecksum window;
+        long long pos = 0;
+        window.init(data, PIECE_SIZE);
+        while (true) {
+            auto hit = full_pieces.find(window.digest());
+            if (hit != full_pieces.end() && try_window(pos, PIECE_SIZE, hit->second)) {
+                pos += PIECE_SIZE;
+                if (pos + PIECE_SIZE > base_size) break;
+                window.init(data + pos, PIECE_SIZE);
+                continue;
+            }
+            if (pos + PIECE_SIZE >= base_size) break;
+            window.roll(data[pos], data[pos + PIECE_SIZE]);
+            pos++;
+        }
+    }
+
+    // A short last piece usually sits at the end of the old version or at its old offset
+    int last = total_pieces - 1;
+    if (last_len < PIECE_SIZE && !have[last]) {
+        vector<int> only_last(1, last);
+        long long offsets[2] = {base_size - last_len, (long long)last * PIECE_SIZE};
+        for (long long pos : offsets) {
+            if (pos >= 0 && pos + last_len <= base_size && try_window(pos, last_len, only_last)) break;
+        }
+    }
+
+    munmap(mapped, base_size);
+    return reused;
+}
+
+// Turn a bundle manifest into a layout rooted at dest_dir, creating every file (and
+// its directories) at its final size so that pieces can be written in any order
+static bool prepare_bundle_layout(const string& manifest, const string& dest_dir, long long total_size,
+                                  vector<FileSpan>& layout) {
+    long long offset = 0;
+    for (const auto& entry : parse(manifest, ",")) {
+        size_t colon = entry.rfind(':');
+        string rel;
+        if (colon == string::npos || !unescape_manifest_path(entry.substr(0, colon), rel)) return false;
+        FileSpan span;
+        span.path = dest_dir + "/" + rel;
+        span.offset = offset;
+        // The manifest comes from the uploader: no file may reach past the bundle's end
+        const char* size_text = entry.c_str() + colon + 1;
+        char* size_end;
+        span.length = strtoll(size_text, &size_end, 10);
+        if (*size_text < '0' || *size_text > '9' || *size_end != '\0' || span.length > total_size - offset) return false;
+        if (!make_parent_dirs(span.path)) return false;
+        int fd = open(span.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) return false;
+        bool sized = ftruncate(fd, span.length) == 0;
+        close(fd);
+        if (!sized) return false;
+        layout.push_back(span);
+        offset += span.length;
+    }
+    return offset == total_size && !layout.empty();
+}
+
+// Fold `bytes` that arrived at `now` into the download rate
+static void update_rate(DownloadState& state, long long bytes, chrono::steady_clock::time_point now) {
+    // Exponentially weighted with a time constant of DOWNLOAD_RATE_WINDOW_S, so
+    // irregular piece arrivals still average over roughly the same window. The
+    // first piece sets the rate outright.
+    double elapsed_s = max(chrono::duration<double>(now - state.rate_updated_at).count(), 1e-6);
+    double weight = state.rate_bps > 0 ? exp(-elapsed_s / DOWNLOAD_RATE_WINDOW_S) : 0;
+    state.rate_bps = weight * state.rate_bps + (1 - weight) * (bytes / elapsed_s);
+    state.rate_updated_at = now;
+}
+
+// Publish how much of a streaming download can be read: written to a temporary file and
+// renamed over the progress file, so a reader never sees a partial line
+static void write_progress(const string& progress_path, const string& data_path, long long ready_bytes,
+                           long long total_bytes, const string& status) {
+    string tmp_path = progress_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return;
+    string line = data_path + " " + to_string(ready_bytes) + " " + to_string(total_bytes) + " " + status + "\n";
+    bool written = write(fd, line.c_str(), line.size()) == (ssize_t)line.size();
+    close(fd);
+    if (!written || rename(tmp_path.c_str(), progress_path.c_str()) != 0) unlink(tmp_path.c_str());
+}
+
+void Client::download_manager(const string& group_id, const string& filename, const string& dest_path,
+                              const FileMetadata& metadata, const DownloadOptions& options) {
+    const string& base_path = options.base_path;
+    const string name = download_name(filename, options);
+
+    // A byte range needs only the pieces that overlap it
+    bool ranged = options.range_length >= 0;
+    long long range_offset = ranged ? options.range_offset : 0;
+    long long range_end = ranged ? options.range_offset + options.range_length : metadata.file_size;
+    int first_piece = range_offset / PIECE_SIZE;
+    int end_piece = (range_end + PIECE_SIZE - 1) / PIECE_SIZE;
+
     DownloadState state;
     state.group_id = group_id;
     state.filename = filename;
     state.destination_path = dest_path;
-    state.file_size = stoll(metadata[1]);
+    state.file_size = metadata.file_size;
     state.status = "Downloading";
-    state.total_pieces = (state.file_size + PIECE_SIZE - 1) / PIECE_SIZE;
+    state.started_at = state.rate_updated_at = chrono::steady_clock::now();
+    state.total_pieces = metadata.piece_hashes.size();
+    state.wanted_pieces = end_piece - first_piece;
+    state.wanted_bytes = min((long long)end_piece * PIECE_SIZE, state.file_size) - (long long)first_piece * PIECE_SIZE;
     state.pieces_downloaded.resize(state.total_pieces, false);
-    
-    size_t seeder_start_index = 3 + state.total_pieces;
-    for (size_t i = 0; i < state.total_pieces; ++i) {
-        if ((3 + i) < metadata.size()) {
-            state.piece_hashes[i] = metadata[3 + i];
-        } else {
-             log_msg("Error: Missing piece hash metadata for piece " + to_string(i));
-             return;
-        }
+    for (int i = 0; i < state.total_pieces; ++i) {
+        state.piece_hashes[i] = metadata.piece_hashes[i];
     }
     
-    vector<string> seeders;
-    if (seeder_start_index < metadata.size()) {
-        for (size_t i = seeder_start_index; i < metadata.size(); ++i) {
-            seeders.push_back(metadata[i]);
-        }
-    }
-
+    vector<string> seeders = metadata.seeders;
+    map<string, vector<bool>> partial_seeders = metadata.partial_seeders;
 
     {
         lock_guard<mutex> lock(downloads_mutex);
-        ongoing_downloads[filename] = state;
+        ongoing_downloads[name] = state;
+    }
+    transfers.wait_turn(name);
+    {
+        // Time spent queued is not part of the transfer
+        lock_guard<mutex> lock(downloads_mutex);
+        DownloadState& live = ongoing_downloads[name];
+        live.started_at = live.rate_updated_at = chrono::steady_clock::now();
     }
 
-    int fd = open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0) {
-        log_msg("Failed to create destination file: " + dest_path);
+    // Updating a file in place: build the new version next to it, since the old one
+    // is read while pieces are written
+    string write_path = base_path == dest_path ? dest_path + ".part" : dest_path;
+    int fd = -1;
+    vector<FileSpan> layout;
+    bool created;
+    if (metadata.bundle_manifest.empty()) {
+        fd = open(write_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        created = fd >= 0;
+        // Reserve the space up front so the file is not fragmented as pieces arrive
+        if (created && !DiskIO::preallocate(fd, range_end - range_offset)) {
+            LOG_DEBUG("Could not preallocate " + write_path);
+        }
+    } else {
+        write_path = dest_path;
+        created = prepare_bundle_layout(metadata.bundle_manifest, dest_path, metadata.file_size, layout);
+    }
+    if (!created) {
+        LOG_ERROR("Failed to create destination file: " + write_path);
+        transfers.finish(name);
+        if (!options.progress_path.empty()) {
+            write_progress(options.progress_path, write_path, 0, range_end - range_offset, "failed");
+        }
         lock_guard<mutex> lock(downloads_mutex);
-        ongoing_downloads[filename].status = "Failed";
+        ongoing_downloads[name].status = "Failed";
+        ongoing_downloads[name].finished_at = chrono::steady_clock::now();
         return;
     }
+    // A bundle is written file by file through its layout, a plain file through fd. Of a
+    // byte range only the bytes inside the range are kept, relative to its start.
+    PieceWriter write_at = [&](long long offset, const char* data, size_t len) {
+        if (!layout.empty()) return layout_pwrite(layout, data, len, offset);
+        long long from = max(offset, range_offset);
+        long long to = min(offset + (long long)len, range_end);
+        if (from >= to) return true;
+        return pwrite(fd, data + (from - offset), to - from, from - range_offset) == to - from;
+    };
 
-    char* piece_buf = new char[PIECE_SIZE];
+    // Full pieces of a huge file can bypass the page cache. The last, partial piece is
+    // not aligned for O_DIRECT and goes through fd.
+    int direct_fd = -1;
+    if (direct_io_enabled && layout.empty() && !ranged && state.file_size >= DIRECT_IO_MIN_BYTES) {
+        direct_fd = open(write_path.c_str(), O_WRONLY | O_DIRECT);
+        if (direct_fd < 0) LOG_WARN("O_DIRECT is not supported for " + write_path + "; using buffered writes");
+    }
 
-    int pieces_to_get = state.total_pieces;
-    int seeder_idx = 0;
-    
-    for (int i = 0; i < state.total_pieces; ++i) {
-        bool piece_ok = false;
-        while(!piece_ok) {
-            if (seeders.empty()) {
-                 log_msg("No more seeders. Download failed for " + filename);
+    PooledBuffer pooled_piece(piece_buffers());
+    char* piece_buf = pooled_piece.get();
+    // Downloaded pieces of a plain file are written in the background, each from its
+    // own pool buffer; bundle pieces may span files and are written in place
+    bool async_writes = layout.empty();
+    PendingWrites writes(piece_buffers(), MAX_PENDING_WRITES);
+    auto queue_write = [&](int piece, long long len) {
+        long long offset = (long long)piece * PIECE_SIZE;
+        long long from = max(offset, range_offset);
+        long long to = min(offset + len, range_end);
+        int target = direct_fd >= 0 && len == PIECE_SIZE ? direct_fd : fd;
+        char* buffer = pooled_piece.take();
+        piece_buf = pooled_piece.get();
+        writes.submit(target, piece, buffer, buffer + (from - offset), to - from, from - range_offset);
+    };
+
+    // Pieces outside a byte range count as present, so nothing fetches them
+    vector<bool> have(state.total_pieces, false);
+    for (int p = 0; p < state.total_pieces; ++p) have[p] = p < first_piece || p >= end_piece;
+    int reused = reuse_local_pieces(write_at, write_path, metadata.piece_hashes, state.file_size, piece_buf, have);
+    if (!base_path.empty() && !layout.empty()) {
+        log_msg("Delta downloads are not supported for bundles; ignoring " + base_path);
+    } else if (!base_path.empty()) {
+        int delta_reused = reuse_base_pieces(write_at, base_path, metadata, have);
+        log_msg("Found " + to_string(delta_reused) + " of " + to_string(state.total_pieces) +
+                " pieces of " + filename + " in " + base_path);
+        reused += delta_reused;
+    }
+    if (reused > 0) {
+        log_msg("Reused " + to_string(reused) + " pieces of " + filename + " from local files");
+        lock_guard<mutex> lock(downloads_mutex);
+        DownloadState& live = ongoing_downloads[name];
+        live.pieces_reused = reused;
+        for (int i = first_piece; i < end_piece; ++i) {
+            if (!have[i]) continue;
+            live.pieces_downloaded[i] = true;
+            live.bytes_reused += min((long long)PIECE_SIZE, state.file_size - (long long)i * PIECE_SIZE);
+        }
+    }
+
+    const string swarm = pex_swarm(group_id, filename);
+    // Full seeders serve every piece, alternate seeders only the pieces they cover
+    PieceScheduler scheduler(state.total_pieces, have);
+    scheduler.set_sources(metadata.seeders, metadata.partial_seeders);
+    // Add the seeders other peers told us about, and pass on the ones the tracker listed
+    peer_exchange.heard(swarm, metadata.seeders);
+    scheduler.add_sources(known_seeders(swarm));
+
+    // Pieces are fetched in order, so the pieces before the scheduler's cursor form a
+    // verified prefix that can be read while the rest downloads, up to the first piece
+    // that is still being written
+    long long published_bytes = -1;
+    auto publish_ready = [&](const string& status, const string& data_path) {
+        int prefix = scheduler.contiguous();
+        int writing = writes.first_in_flight();
+        if (writing >= 0) prefix = min(prefix, writing);
+        // A range that starts inside a piece has nothing ready until that piece is in
+        long long ready = max(0LL, min((long long)prefix * PIECE_SIZE, range_end) - range_offset);
+        if (ready == published_bytes && status == "downloading") return;
+        published_bytes = ready;
+        {
+            lock_guard<mutex> lock(downloads_mutex);
+            ongoing_downloads[name].ready_bytes = ready;
+        }
+        if (!options.progress_path.empty()) {
+            write_progress(options.progress_path, data_path, ready, range_end - range_offset, status);
+        }
+    };
+    publish_ready("downloading", write_path);
+
+    // A piece whose write failed is fetched again, up to MAX_WRITE_FAILURES times
+    vector<pair<int, bool>> settled;
+    int write_failures = 0;
+    auto settle_writes = [&](bool wait) {
+        writes.collect(settled, wait);
+        if (settled.empty()) return;
+        {
+            lock_guard<mutex> lock(downloads_mutex);
+            DownloadState& live = ongoing_downloads[name];
+            for (const auto& write : settled) {
+                if (write.second) live.pieces_downloaded[write.first] = true;
+                else live.pieces_verified--;
+            }
+        }
+        for (const auto& write : settled) {
+            if (write.second) continue;
+            write_failures++;
+            LOG_EVERY_MS(LOG_LEVEL_WARN, 1000, "Failed to write piece " + to_string(write.first) + " of " + filename + ". Retrying.");
+            scheduler.piece_lost(write.first);
+        }
+        publish_ready("downloading", write_path);
+    };
+    auto close_files = [&]() {
+        settle_writes(true);
+        if (direct_fd >= 0) close(direct_fd);
+        if (fd >= 0) close(fd);
+    };
+
+    int peer_sock = -1;
+    string peer_addr;
+    int i;
+
+    while (true) {
+        settle_writes(false);
+        if (write_failures > MAX_WRITE_FAILURES) break;
+        if ((i = scheduler.next_piece()) < 0) {
+            // A write that failed hands its piece back once collected, so only stop when
+            // every write has settled and still nothing is missing
+            settle_writes(true);
+            if ((i = scheduler.next_piece()) < 0) break;
+        }
+        // Queued behind more urgent downloads or paused: let go of the seeder while waiting
+        if (peer_sock >= 0 && !transfers.runnable(name)) {
+            close(peer_sock);
+            peer_sock = -1;
+        }
+        transfers.wait_turn(name);
+
+        if (peer_sock >= 0 && !scheduler.covers(peer_addr, i)) {
+            close(peer_sock);
+            peer_sock = -1;
+        }
+        if (peer_sock < 0) {
+            vector<string> racers;
+            PieceScheduler::Action action = scheduler.plan_connect(i, racers);
+            if (action == PieceScheduler::REFRESH) {
+                // Every known seeder failed: try the seeders other peers have told us about
+                // since, then ask the tracker who seeds the file now
+                if (scheduler.add_sources(known_seeders(swarm)) > 0) continue;
+                invalidate_cached_seeders(group_id, filename);
+                FileMetadata fresh;
+                if (fetch_file_metadata(group_id, filename, fresh) && fresh.file_hash == metadata.file_hash) {
+                    scheduler.set_sources(fresh.seeders, fresh.partial_seeders);
+                }
+                continue;
+            }
+            if (action == PieceScheduler::GIVE_UP) {
+                 LOG_ERROR("No more seeders. Download failed for " + filename);
+                 invalidate_cached_seeders(group_id, filename);
+                 transfers.finish(name);
+                 close_files();
+                 publish_ready("failed", write_path);
                  lock_guard<mutex> lock(downloads_mutex);
-                 ongoing_downloads[filename].status = "Failed";
-                 close(fd);
-                 delete[] piece_buf; // Clean up memory on error
+                 ongoing_downloads[name].status = "Failed";
+                 ongoing_downloads[name].finished_at = chrono::steady_clock::now();
                  return;
             }
-            string seeder_addr = seeders[seeder_idx % seeders.size()];
-            seeder_idx++;
-            
-            int peer_sock = socket(AF_INET, SOCK_STREAM, 0);
-            size_t delim_pos = seeder_addr.find(':');
-            string peer_ip = seeder_addr.substr(0, delim_pos);
-            int peer_port = stoi(seeder_addr.substr(delim_pos + 1));
-            
-            sockaddr_in peer_server_addr;
-            peer_server_addr.sin_family = AF_INET;
-            peer_server_addr.sin_port = htons(peer_port);
-            inet_pton(AF_INET, peer_ip.c_str(), &peer_server_addr.sin_addr);
-
-            if (connect(peer_sock, (struct sockaddr*)&peer_server_addr, sizeof(peer_server_addr)) < 0) {
-                log_msg("Failed to connect to seeder " + seeder_addr);
+
+            // Race connects to the chosen seeders and keep whichever answers first, so
+            // a single blackholed seeder costs at most one connect deadline.
+            int winner = -1;
+            auto connect_started = chrono::steady_clock::now();
+            peer_sock = race_connect(racers, PEER_CONNECT_TIMEOUT_MS, winner);
+            double connect_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - connect_started).count();
+            vector<string> learned;
+            if (peer_sock >= 0 && (!open_peer_session(peer_sock) || !exchange_peers(peer_sock, swarm, false, learned))) {
                 close(peer_sock);
+                peer_sock = -1;
+            }
+            if (peer_sock < 0) {
+                for (const auto& racer : racers) {
+                    LOG_EVERY_MS(LOG_LEVEL_WARN, 1000, "Failed to connect to seeder " + racer);
+                    peer_exchange.forget(swarm, racer);
+                }
+                scheduler.connect_failed(racers);
+                invalidate_cached_seeders(group_id, filename);
+                lock_guard<mutex> lock(downloads_mutex);
+                for (const auto& racer : racers) ongoing_downloads[name].peers[racer].failures++;
                 continue;
             }
+            peer_addr = racers[winner];
+            peer_exchange.seen(swarm, peer_addr);
+            if (peer_exchange.heard(swarm, learned) > 0) {
+                int added = scheduler.add_sources(known_seeders(swarm));
+                if (added > 0) LOG_DEBUG("Learned " + to_string(added) + " seeders of " + filename + " from " + peer_addr);
+            }
+            lock_guard<mutex> lock(downloads_mutex);
+            PeerTransferStats& peer = ongoing_downloads[name].peers[peer_addr];
+            peer.rtt_ms = peer.rtt_ms < 0 ? connect_ms : 0.75 * peer.rtt_ms + 0.25 * connect_ms;
+        }
 
-            log_msg("Downloading piece " + to_string(i) + " from seeder " + seeder_addr);
+        LOG_EVERY_MS(LOG_LEVEL_INFO, 1000, "Downloading piece " + to_string(i) + " of " + filename + " from seeder " + peer_addr);
 
-            string request = "get_piece " + filename + " " + to_string(i);
-            send(peer_sock, request.c_str(), request.length(), 0);
-            
-            long long piece_size_to_expect = PIECE_SIZE;
-            if (i == state.total_pieces - 1) {
-                piece_size_to_expect = state.file_size % PIECE_SIZE;
-                if (piece_size_to_expect == 0) {
-                    piece_size_to_expect = PIECE_SIZE;
-                }
+        long long piece_size_to_expect = PIECE_SIZE;
+        if (i == state.total_pieces - 1) {
+            piece_size_to_expect = state.file_size % PIECE_SIZE;
+            if (piece_size_to_expect == 0) {
+                piece_size_to_expect = PIECE_SIZE;
             }
-            
-            long long total_bytes_read = 0;
-            while (total_bytes_read < piece_size_to_expect) {
-                ssize_t bytes_read_now = read(peer_sock, piece_buf + total_bytes_read, piece_size_to_expect - total_bytes_read);
-                if (bytes_read_now <= 0) {
-                    log_msg("Seeder disconnected while reading piece " + to_string(i));
-                    total_bytes_read = -1;
-                    break;
-                }
-                total_bytes_read += bytes_read_now;
+        }
+
+        // Each stage is timed so show_downloads can tell what limits the transfer
+        auto requested = chrono::steady_clock::now();
+        bool received = request_piece(peer_sock, filename, i, state.piece_hashes[i], piece_size_to_expect, piece_buf);
+        auto arrived = chrono::steady_clock::now();
+        bool verified = received && sha(piece_buf, piece_size_to_expect) == state.piece_hashes[i];
+        auto hashed = chrono::steady_clock::now();
+        // With async writes, disk time is how long the queue held the download back
+        bool written = verified;
+        if (verified && async_writes) queue_write(i, piece_size_to_expect);
+        else if (verified) written = write_at((long long)i * PIECE_SIZE, piece_buf, piece_size_to_expect);
+        auto stored = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> lock(downloads_mutex);
+            DownloadState& live = ongoing_downloads[name];
+            PeerTransferStats& peer = live.peers[peer_addr];
+            double network_ms = chrono::duration<double, milli>(arrived - requested).count();
+            live.network_ms += network_ms;
+            peer.transfer_ms += network_ms;
+            if (received) live.hash_ms += chrono::duration<double, milli>(hashed - arrived).count();
+            if (verified) live.disk_ms += chrono::duration<double, milli>(stored - hashed).count();
+            if (written) {
+                if (!async_writes) live.pieces_downloaded[i] = true;
+                live.pieces_verified++;
+                live.bytes_downloaded += piece_size_to_expect;
+                peer.pieces++;
+                peer.bytes += piece_size_to_expect;
+                update_rate(live, piece_size_to_expect, stored);
+            } else {
+                peer.failures++;
+                if (!received) live.transfer_failures++;
+                else if (!verified) live.hash_failures++;
             }
+        }
 
-            if (total_bytes_read > 0) {
-                string received_hash = sha(piece_buf, total_bytes_read);
-                if (received_hash == state.piece_hashes[i]) {
-                    lseek(fd, (long long)i * PIECE_SIZE, SEEK_SET);
-                    write(fd, piece_buf, total_bytes_read);
-                    
-                    piece_ok = true;
-                    pieces_to_get--;
-
-                    lock_guard<mutex> lock(downloads_mutex);
-                    ongoing_downloads[filename].pieces_downloaded[i] = true;
-                } else {
-                    log_msg("Hash mismatch for piece " + to_string(i) + ". Retrying.");
-                }
+        if (written) {
+            scheduler.piece_received(peer_addr, i);
+            transfers.transferred(name, piece_size_to_expect);
+            publish_ready("downloading", write_path);
+        } else {
+            if (verified) {
+                write_failures++;
+                LOG_EVERY_MS(LOG_LEVEL_WARN, 1000, "Failed to write piece " + to_string(i) + " of " + filename + ". Retrying.");
+            } else if (received) {
+                LOG_EVERY_MS(LOG_LEVEL_WARN, 1000, "Hash mismatch for piece " + to_string(i) + " of " + filename + ". Retrying.");
+            } else {
+                LOG_EVERY_MS(LOG_LEVEL_WARN, 1000, "Seeder " + peer_addr + " failed or timed out while sending piece " + to_string(i));
             }
+            scheduler.piece_failed(peer_addr);
             close(peer_sock);
+            peer_sock = -1;
         }
     }
+    // A download that will be seeded keeps its last session to announce itself
+    if (peer_sock >= 0 && (ranged || scheduler.remaining() > 0)) {
+        close(peer_sock);
+        peer_sock = -1;
+    }
 
-    close(fd);
-    delete[] piece_buf; // Clean up memory on success
+    close_files();
+    transfers.finish(name);
 
-    if (pieces_to_get == 0) {
-        log_msg("Download completed for " + filename);
+    if (scheduler.remaining() > 0) {
+        if (write_failures > MAX_WRITE_FAILURES) LOG_ERROR("Too many failed writes. Download failed for " + name);
+        else LOG_ERROR("Could not store every piece. Download failed for " + name);
+        if (peer_sock >= 0) close(peer_sock);
+        publish_ready("failed", write_path);
         lock_guard<mutex> lock(downloads_mutex);
-        ongoing_downloads[filename].status = "Completed";
-        
-        {
-            lock_guard<mutex> share_lock(shared_files_mutex);
-            shared_files[filename] = dest_path;
+        ongoing_downloads[name].status = "Failed";
+        ongoing_downloads[name].finished_at = chrono::steady_clock::now();
+        return;
+    }
+    if (write_path != dest_path && rename(write_path.c_str(), dest_path.c_str()) != 0) {
+        LOG_ERROR("Failed to replace " + dest_path + " with the downloaded version");
+        if (peer_sock >= 0) close(peer_sock);
+        publish_ready("failed", write_path);
+        lock_guard<mutex> lock(downloads_mutex);
+        ongoing_downloads[name].status = "Failed";
+        ongoing_downloads[name].finished_at = chrono::steady_clock::now();
+        return;
+    }
+    log_msg("Download completed for " + name);
+    publish_ready("completed", dest_path);
+    {
+        lock_guard<mutex> lock(downloads_mutex);
+        ongoing_downloads[name].status = "Completed";
+        ongoing_downloads[name].finished_at = chrono::steady_clock::now();
+    }
+    // A byte range holds parts of pieces only, so there is nothing to seed from it
+    if (ranged) return;
+
+    {
+        lock_guard<mutex> share_lock(shared_files_mutex);
+        shared_files[filename] = dest_path;
+        shared_file_groups[filename] = group_id;
+        if (!layout.empty()) {
+            bundle_layouts[dest_path] = make_shared<const vector<FileSpan>>(layout);
         }
+    }
+    register_local_pieces(dest_path, metadata.piece_hashes);
+
+    string command = "i_am_seeder " + group_id + " " + filename;
+    send_to_tracker(command);
 
-        string command = "i_am_seeder " + group_id + " " + filename;
-        send_to_tracker(command);
+    // Tell the last seeder we serve the file now, so it can point later leechers at us
+    if (peer_sock >= 0) {
+        vector<string> learned;
+        if (exchange_peers(peer_sock, swarm, true, learned)) peer_exchange.heard(swarm, learned);
+        close(peer_sock);
+    }
+}
+
+// Figures derived from a DownloadState for show_downloads
+struct DownloadSummary {
+    int pieces_done = 0;
+    double elapsed_s = 0;
+    double rate_bps = 0; // current rate while downloading, average rate once finished
+    double eta_s = -1; // -1 when unknown or finished
+    const char* limited_by = "none";
+};
+
+static DownloadSummary summarize(const DownloadState& state, chrono::steady_clock::time_point now) {
+    DownloadSummary summary;
+    summary.pieces_done = count(state.pieces_downloaded.begin(), state.pieces_downloaded.end(), true);
+    bool running = state.status == "Downloading";
+    summary.elapsed_s = chrono::duration<double>((running ? now : state.finished_at) - state.started_at).count();
+    if (running) {
+        // Let the rate decay while no piece arrives
+        double idle_s = chrono::duration<double>(now - state.rate_updated_at).count();
+        summary.rate_bps = state.rate_bps * exp(-idle_s / DOWNLOAD_RATE_WINDOW_S);
+        long long remaining = state.wanted_bytes - state.bytes_downloaded - state.bytes_reused;
+        if (summary.rate_bps > 1) summary.eta_s = remaining / summary.rate_bps;
+    } else if (summary.elapsed_s > 0) {
+        summary.rate_bps = state.bytes_downloaded / summary.elapsed_s;
+    }
+    double slowest = max(state.network_ms, max(state.hash_ms, state.disk_ms));
+    if (slowest > 0) {
+        summary.limited_by = slowest == state.network_ms ? "network" : slowest == state.hash_ms ? "hash" : "disk";
     }
+    return summary;
 }
 
-void Client::show_downloads() {
+void Client::show_downloads(bool as_json) {
     lock_guard<mutex> lock(downloads_mutex);
+    auto now = chrono::steady_clock::now();
+    if (as_json) {
+        // One line, for scripts: show_downloads json
+        ostringstream out;
+        out << fixed << setprecision(3) << "{\"downloads\":[";
+        bool first = true;
+        for (const auto& pair : ongoing_downloads) {
+            const auto& state = pair.second;
+            DownloadSummary summary = summarize(state, now);
+            out << (first ? "" : ",") << "{\"name\":\"" << json_escape(pair.first)
+                << "\",\"group\":\"" << json_escape(state.group_id)
+                << "\",\"file\":\"" << json_escape(state.filename)
+                << "\",\"destination\":\"" << json_escape(state.destination_path)
+                << "\",\"status\":\"" << state.status << "\"";
+            TransferScheduler::Info transfer;
+            if (state.status == "Downloading" && transfers.lookup(pair.first, transfer)) {
+                const char* states[] = {"queued", "active", "paused"};
+                out << ",\"scheduling\":\"" << states[transfer.state] << "\",\"priority\":\""
+                    << priority_name(transfer.priority) << "\",\"weight\":" << transfer.weight;
+            }
+            out << ",\"size\":" << state.file_size
+                << ",\"pieces_total\":" << state.total_pieces << ",\"pieces_wanted\":" << state.wanted_pieces
+                << ",\"bytes_wanted\":" << state.wanted_bytes << ",\"pieces_done\":" << summary.pieces_done
+                << ",\"pieces_verified\":" << state.pieces_verified << ",\"pieces_reused\":" << state.pieces_reused
+                << ",\"hash_failures\":" << state.hash_failures << ",\"transfer_failures\":" << state.transfer_failures
+                << ",\"bytes_downloaded\":" << state.bytes_downloaded << ",\"bytes_reused\":" << state.bytes_reused
+                << ",\"ready_bytes\":" << state.ready_bytes
+                << ",\"elapsed_s\":" << summary.elapsed_s << ",\"rate_bps\":" << summary.rate_bps
+                << ",\"eta_s\":" << summary.eta_s << ",\"network_s\":" << state.network_ms / 1000
+                << ",\"hash_s\":" << state.hash_ms / 1000 << ",\"disk_s\":" << state.disk_ms / 1000
+                << ",\"limited_by\":\"" << summary.limited_by << "\",\"peers\":[";
+            bool first_peer = true;
+            for (const auto& peer : state.peers) {
+                out << (first_peer ? "" : ",") << "{\"address\":\"" << json_escape(peer.first)
+                    << "\",\"bytes\":" << peer.second.bytes << ",\"pieces\":" << peer.second.pieces
+                    << ",\"failures\":" << peer.second.failures << ",\"rtt_ms\":" << peer.second.rtt_ms
+                    << ",\"transfer_s\":" << peer.second.transfer_ms / 1000 << "}";
+                first_peer = false;
+            }
+            out << "]}";
+            first = false;
+        }
+        out << "]}";
+        cout << out.str() << endl;
+        return;
+    }
+
     if (ongoing_downloads.empty()) {
         cout << "No active or completed downloads." << endl;
         return;
     }
+    const double MB = 1024.0 * 1024.0;
+    cout << fixed << setprecision(1);
     for (const auto& pair : ongoing_downloads) {
         const auto& state = pair.second;
+        DownloadSummary summary = summarize(state, now);
+        TransferScheduler::Info transfer;
+        bool scheduled = state.status == "Downloading" && transfers.lookup(pair.first, transfer);
         if (state.status == "Completed") {
-            cout << "[C] [" << state.group_id << "] " << state.filename << endl;
+            cout << "[C] [" << state.group_id << "] " << pair.first;
+        } else if (scheduled && transfer.state == TransferScheduler::QUEUED) {
+            cout << "[Q] [" << state.group_id << "] " << pair.first;
+        } else if (scheduled && transfer.state == TransferScheduler::PAUSED) {
+            cout << "[P] [" << state.group_id << "] " << pair.first;
         } else {
-            cout << "[D] [" << state.group_id << "] " << state.filename << endl;
+            cout << "[D] [" << state.group_id << "] " << pair.first;
+        }
+        cout << ": " << summary.pieces_done << "/" << state.wanted_pieces << " pieces, "
+             << (state.bytes_downloaded + state.bytes_reused) / MB << " of " << state.wanted_bytes / MB << " MB, "
+             << summary.rate_bps / MB << " MB/s";
+        if (state.status == "Failed") cout << ", failed";
+        if (summary.eta_s >= 0) cout << ", ETA " << summary.eta_s << " s";
+        cout << ", limited by " << summary.limited_by;
+        if (scheduled) cout << ", " << priority_name(transfer.priority) << " priority, weight " << transfer.weight;
+        cout << endl;
+        cout << "    " << summary.elapsed_s << " s elapsed: network " << state.network_ms / 1000 << " s, hash "
+             << state.hash_ms / 1000 << " s, disk " << state.disk_ms / 1000 << " s; " << state.pieces_reused
+             << " pieces reused, " << state.hash_failures << " hash failures, " << state.transfer_failures
+             << " transfer failures" << endl;
+        for (const auto& peer : state.peers) {
+            const PeerTransferStats& stats = peer.second;
+            cout << "    seeder " << peer.first << ": " << stats.bytes / MB << " MB in " << stats.pieces << " pieces";
+            if (stats.transfer_ms > 0) cout << " at " << stats.bytes / MB / (stats.transfer_ms / 1000) << " MB/s";
+            if (stats.rtt_ms >= 0) cout << ", rtt " << setprecision(2) << stats.rtt_ms << setprecision(1) << " ms";
+            cout << ", " << stats.failures << " failures" << endl;
         }
     }
+    cout << defaultfloat;
 }
 
 int main(int argc, char* argv[]) {
@@ -6,10 +6,107 @@
 #include <map>
 #include <mutex>
 #include <thread>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include "utils.h"
+#include "piece_scheduler.h"
+#include "transfer_scheduler.h"
+#include "peer_exchange.h"
 
 using namespace std;
 
 const int PIECE_SIZE = 512 * 1024; // 512KB
+// Piece buffers for seeding, hashing and downloading come from a pool that keeps at
+// most this many
+const size_t PIECE_BUFFER_POOL_SIZE = 64;
+// Verified pieces one download may have queued for the disk (see disk_io.h)
+const int MAX_PENDING_WRITES = 8;
+// Failed piece writes a download retries before it gives up, so a full or broken
+// disk ends the download instead of fetching the same pieces forever
+const int MAX_WRITE_FAILURES = 16;
+// With set_direct_io on, plain files at least this large are written with O_DIRECT,
+// so a huge download does not push everything else out of the page cache
+const long long DIRECT_IO_MIN_BYTES = 1LL << 30;
+
+// Tracker health probing and failover deadlines
+const int HEARTBEAT_INTERVAL_MS = 500;
+const int HEARTBEAT_TIMEOUT_MS = 300;
+const int TRACKER_CONNECT_TIMEOUT_MS = 200;
+// Late replies a tracker may owe before its connection is given up on
+const int TRACKER_MAX_OWED_REPLIES = 4;
+const int TRACKER_REPLY_TIMEOUT_MS = 5000;
+
+// How long a cached seeder list is trusted before it is revalidated with the tracker
+const int SEEDER_CACHE_TTL_MS = 10000;
+// How long a cached list_files reply is reused
+const int LIST_FILES_CACHE_TTL_MS = 5000;
+
+// Peer transfer deadlines: reads fail after PIECE_READ_TIMEOUT_MS without progress,
+// idle seeder sessions are closed. Retry limits live in piece_scheduler.h.
+const int PEER_CONNECT_TIMEOUT_MS = 1000;
+const int PIECE_READ_TIMEOUT_MS = 5000;
+const int PEER_IDLE_TIMEOUT_MS = 30000;
+
+// After this many pieces in a row fail to compress, a seeder only retries
+// compression on every COMPRESSION_RETRY_INTERVAL-th piece of the session
+const int COMPRESSION_MISS_LIMIT = 4;
+const int COMPRESSION_RETRY_INTERVAL = 16;
+
+// Uplink capacity assumed when reporting spare upload bandwidth to the trackers
+const long long UPLOAD_CAPACITY_KBPS = 100 * 1024;
+
+// Time constant of the moving average behind the download rate in show_downloads
+const double DOWNLOAD_RATE_WINDOW_S = 5.0;
+
+// Items per batch command (the tracker accepts up to 10000); re-announcing and bulk
+// uploads are split into batches of this size
+const size_t BATCH_MAX_ITEMS = 1000;
+
+// Page size the client asks each tracker for when merging list_groups across trackers
+const int LIST_PAGE_SIZE = 1000;
+
+// Receives the "+ ..." and "= ..." frames of a streamed tracker reply
+typedef function<void(const string& frame)> FrameHandler;
+// Stores len bytes of a download at the given offset of its piece space
+typedef function<bool(long long offset, const char* data, size_t len)> PieceWriter;
+
+// File metadata as returned by the tracker's download_file. The file hash and
+// piece hashes never change for a given file_hash; only the seeders go stale.
+struct FileMetadata {
+    long long file_size = 0;
+    string file_hash;
+    vector<string> piece_hashes;
+    vector<string> seeders;
+    // Seeders of other files that hold identical pieces: addr -> pieces of this file they can serve
+    map<string, vector<bool>> partial_seeders;
+    vector<uint32_t> weak_checksums; // rolling checksum per piece, empty if the uploader sent none
+    string bundle_manifest; // "<escaped path>:<size>,..." for a directory bundle, empty for a single file
+    chrono::steady_clock::time_point seeders_fetched_at;
+};
+
+// Per-download choices from the download_file command line
+struct DownloadOptions {
+    string base_path; // older local version to copy pieces from, empty for none
+    // Streaming: after every piece that extends the verified prefix, this file is
+    // rewritten (atomically) with "<data path> <ready bytes> <total bytes> <status>"
+    string progress_path;
+    // download_range: only the bytes [range_offset, range_offset + range_length) are
+    // fetched and written to the destination; range_length -1 means the whole file
+    long long range_offset = 0;
+    long long range_length = -1;
+};
+
+// What one seeder contributed to a download
+struct PeerTransferStats {
+    long long bytes = 0;
+    int pieces = 0;
+    int failures = 0; // failed connects, transfers and hash checks
+    double rtt_ms = -1; // smoothed TCP connect time, -1 until connected
+    double transfer_ms = 0; // time spent waiting for its pieces
+};
 
 struct DownloadState {
     string group_id;
@@ -17,9 +114,28 @@ struct DownloadState {
     string destination_path;
     long long file_size;
     int total_pieces;
+    int wanted_pieces; // pieces this download fetches: all of them, or those covering a byte range
+    long long wanted_bytes; // size of the wanted pieces
     vector<bool> pieces_downloaded;
     string status; // "Downloading", "Completed", "Failed"
     map<int, string> piece_hashes;
+
+    // Telemetry: time spent per stage shows whether network, hashing or disk limits the download
+    chrono::steady_clock::time_point started_at;
+    chrono::steady_clock::time_point finished_at;
+    chrono::steady_clock::time_point rate_updated_at;
+    double rate_bps = 0; // moving average of network throughput
+    long long bytes_downloaded = 0;
+    long long bytes_reused = 0; // copied from local files instead of downloaded
+    int pieces_verified = 0;
+    int pieces_reused = 0;
+    int hash_failures = 0;
+    int transfer_failures = 0;
+    long long ready_bytes = 0; // verified prefix, readable while the rest downloads
+    double network_ms = 0;
+    double hash_ms = 0;
+    double disk_ms = 0;
+    map<string, PeerTransferStats> peers; // seeder address -> contribution
 };
 
 class Client {
@@ -34,32 +150,100 @@ private:
     
     // connection failover management
     bool connect_to_available_tracker();
-    bool try_connect_to(const string& addr);
-    string send_to_tracker(const string& command, bool is_retry = false);
+    bool try_connect_to(int tracker_idx);
+    int open_tracker_socket(int tracker_idx);
+    void adopt_tracker_socket(int tracker_idx, int sock);
+    void drop_tracker_connection(int tracker_idx);
+    void heartbeat_loop();
+    vector<int> route_command(const vector<string>& args);
+    vector<int> order_by_latency(const vector<int>& replicas);
+    bool read_tracker_frame(int tracker_idx, string& frame, int timeout_ms, bool& timed_out);
+    string exchange_with_tracker(int tracker_idx, const string& command, int timeout_ms = TRACKER_REPLY_TIMEOUT_MS,
+                                 const FrameHandler& on_frame = nullptr);
+    string exchange_in_session(int tracker_idx, const string& command, const FrameHandler& on_frame = nullptr,
+                               int timeout_ms = TRACKER_REPLY_TIMEOUT_MS);
+    string send_to_tracker(const string& command, const FrameHandler& on_frame = nullptr);
 
     // command handlers
     void handle_upload(const vector<string>& args);
-    void handle_download(const vector<string>& args);
-    void show_downloads();
+    void handle_upload_bundle(const vector<string>& args);
+    void adopt_upload(const string& group_id, const string& name, const string& storage,
+                      const vector<string>& piece_hashes);
+    // Send "<command> <args>" items for group_id as batch commands; one result per item,
+    // "ok" or the reason it failed
+    vector<string> send_batch(const string& group_id, const vector<string>& items);
+    void publish_upload(const string& group_id, const string& name, const string& storage, long long size,
+                        const vector<string>& piece_hashes, const string& weak_checksums,
+                        const string& file_hash, const string& manifest);
+    ssize_t read_stored(const string& storage, char* buf, size_t len, long long offset);
+    void handle_download(const vector<string>& args); // download_file and download_range
+    void handle_transfer_control(const vector<string>& args);
+    void show_downloads(bool as_json);
     void handle_login(const vector<string>& args);
+    void handle_list_groups(const vector<string>& args);
+    void handle_list_files(const string& line, const vector<string>& args);
+    bool fetch_file_metadata(const string& group_id, const string& filename, FileMetadata& metadata);
+    void invalidate_cached_seeders(const string& group_id, const string& filename);
     
-    void download_manager(const string& group_id, const string& filename, const string& dest_path, const vector<string>& metadata);
+    bool open_peer_session(int peer_sock);
+    // Swap known seeders of filename with a peer ("pex"), announcing our own seeder port
+    // if we seed the file. False if the peer did not answer.
+    bool exchange_peers(int peer_sock, const string& swarm, bool announce, vector<string>& learned);
+    string answer_peer_exchange(int peer_socket, const vector<string>& args);
+    vector<string> known_seeders(const string& swarm); // from peer exchange, without ourselves
+    bool request_piece(int peer_sock, const string& filename, int piece_index, const string& piece_hash,
+                       long long expected_size, char* buffer);
+    void register_local_pieces(const string& file_path, const vector<string>& piece_hashes);
+    int reuse_local_pieces(const PieceWriter& write_at, const string& dest_path, const vector<string>& piece_hashes,
+                           long long file_size, char* buffer, vector<bool>& have);
+    int reuse_base_pieces(const PieceWriter& write_at, const string& base_path, const FileMetadata& metadata, vector<bool>& have);
+    void download_manager(const string& group_id, const string& filename, const string& dest_path,
+                          const FileMetadata& metadata, const DownloadOptions& options);
 
     // tracker state variables
     vector<string> tracker_addresses;
-    int current_tracker_idx = 0;
-    int tracker_socket = -1;
+    HashRing ring; // group_id -> trackers holding that group, primary first
+    vector<int> tracker_sockets; // one connection per tracker, -1 when closed
+    vector<bool> tracker_authenticated; // whether that connection carries our login
+    vector<bool> tracker_healthy; // last heartbeat result
+    int current_tracker_idx = 0; // tracker used for commands not tied to a group
+    vector<double> tracker_latency_ms; // moving average of command round trips, 0 until measured
+    mt19937 tracker_rng;
+    vector<char> tracker_reply_buffer; // reused for every reply, guarded by tracker_mutex
+    vector<string> tracker_pending; // bytes read past the last complete frame, per tracker
+    vector<int> tracker_owed_replies; // replies to commands that missed their deadline, still to be skipped
+    vector<bool> tracker_rejoin_due; // we logged in again there, so our shared files must be announced again
+    mutex tracker_mutex;
     
     int seeder_port;
+    atomic<int> active_uploads{0}; // pieces being served right now
+    atomic<long long> bytes_uploaded{0}; // total bytes served to peers
+    atomic<bool> compression_enabled{true}; // offer/accept deflate on peer sessions
+    atomic<bool> direct_io_enabled{false}; // O_DIRECT writes for downloads of DIRECT_IO_MIN_BYTES or more
+    // Link emulation for benchmarks, from P2P_EMULATE_DELAY_MS / P2P_EMULATE_RATE_KBPS:
+    // every peer reply is held back by the delay, and piece uploads are paced to the rate
+    int emulated_delay_ms = 0;
+    long long emulated_rate_kbps = 0;
 
-    bool is_logged_in = false;
+    atomic<bool> is_logged_in{false}; // read by the heartbeat thread
     string user_id;
     string password;
+    string session_token; // issued at login, accepted by every tracker
 
     map<string, DownloadState> ongoing_downloads; // filename -> state
     mutex downloads_mutex;
+    TransferScheduler transfers; // which downloads may transfer, and how fast relative to each other
+    PeerExchange peer_exchange; // seeders of shared and downloading files, learned from peers
+
+    map<string, FileMetadata> metadata_cache; // "group_id/filename" -> last metadata seen
+    map<string, pair<chrono::steady_clock::time_point, string>> list_files_cache; // group_id -> reply
+    mutex metadata_cache_mutex;
 
     map<string, string> shared_files; // filename -> local_path
+    map<string, string> shared_file_groups; // filename -> group_id it is shared in
+    map<string, pair<string, long long>> local_pieces; // piece hash -> (storage, offset) of a verified local copy
+    // Root directory of a shared bundle -> its files; any other storage is a plain file path
+    map<string, shared_ptr<const vector<FileSpan>>> bundle_layouts;
     mutex shared_files_mutex;
 };
 
@@ -0,0 +1,328 @@
+#include "disk_io.h"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <thread>
+#include <deque>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// io_uring without liburing: the rings are mapped by hand. Callers fill SQEs under
+// submit_mutex; a submitter thread hands everything queued to the kernel in one
+// io_uring_enter, and a reaper thread waits for completions and runs the callbacks.
+// Requests are owned by the thread that entered them and cancelled when it exits,
+// which is why short-lived download threads never enter the ring themselves.
+class UringDiskIO : public DiskIO {
+public:
+    bool start() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &params);
+        if (ring_fd < 0) return false;
+        if (!supports(IORING_OP_READ) || !supports(IORING_OP_WRITE)) {
+            close(ring_fd);
+            return false;
+        }
+
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_map) sq_size = cq_size = max(sq_size, cq_size);
+        char* sq = static_cast<char*>(mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           ring_fd, IORING_OFF_SQ_RING));
+        if (sq == MAP_FAILED) return false;
+        char* cq = sq;
+        if (!single_map) {
+            cq = static_cast<char*>(mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         ring_fd, IORING_OFF_CQ_RING));
+            if (cq == MAP_FAILED) return false;
+        }
+        void* entries = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (entries == MAP_FAILED) return false;
+
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqes = static_cast<io_uring_sqe*>(entries);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        capacity = params.sq_entries;
+        in_flight = 0;
+        unsubmitted = 0;
+
+        thread(&UringDiskIO::enter, this).detach();
+        thread(&UringDiskIO::reap, this).detach();
+        return true;
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    // IORING_OP_READ and IORING_OP_WRITE only exist since Linux 5.6. Older kernels set
+    // up the ring but fail every such request with -EINVAL, so ask before relying on them.
+    bool supports(int op) {
+        const unsigned max_ops = 256;
+        vector<char> space(sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(space.data());
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, max_ops) < 0) return false;
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    void write_at(int fd, const char* data, size_t len, long long offset, function<void(bool ok)> done) override {
+        submit(new Request{fd, true, const_cast<char*>(data), len, offset, 0,
+                           [done](ssize_t result) { done(result >= 0); }});
+    }
+
+    ssize_t read_at(int fd, char* data, size_t len, long long offset) override {
+        mutex read_mutex;
+        condition_variable read_done;
+        bool finished = false;
+        ssize_t bytes_read = -1;
+        submit(new Request{fd, false, data, len, offset, 0, [&](ssize_t result) {
+            lock_guard<mutex> lock(read_mutex);
+            bytes_read = result;
+            finished = true;
+            read_done.notify_one();
+        }});
+        unique_lock<mutex> lock(read_mutex);
+        read_done.wait(lock, [&finished] { return finished; });
+        return bytes_read;
+    }
+
+private:
+    void submit(Request* request) {
+        unique_lock<mutex> lock(submit_mutex);
+        // Never queue more than the completion ring can hold
+        space.wait(lock, [this] { return in_flight < capacity; });
+        in_flight++;
+        push(request);
+    }
+
+    // Called with submit_mutex held, for a request already counted in in_flight
+    void push(Request* request) {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & sq_mask;
+        io_uring_sqe& sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = request->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = request->fd;
+        sqe.addr = reinterpret_cast<unsigned long long>(request->data);
+        sqe.len = request->len;
+        sqe.off = request->offset;
+        sqe.user_data = reinterpret_cast<unsigned long long>(request);
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        if (unsubmitted++ == 0) queued.notify_one();
+    }
+
+    // SQEs pushed while a batch is in the kernel go with the next one, so a burst of
+    // pieces costs one io_uring_enter rather than one each
+    void enter() {
+        unique_lock<mutex> lock(submit_mutex);
+        while (true) {
+            queued.wait(lock, [this] { return unsubmitted > 0; });
+            unsigned batch = unsubmitted;
+            lock.unlock();
+            int submitted = syscall(__NR_io_uring_enter, ring_fd, batch, 0, 0, nullptr, 0);
+            // EAGAIN/EBUSY: the kernel is short of resources, let completions drain first
+            if (submitted == 0 || (submitted < 0 && errno != EINTR)) this_thread::sleep_for(chrono::milliseconds(1));
+            lock.lock();
+            if (submitted > 0) unsubmitted -= submitted;
+        }
+    }
+
+    void reap() {
+        vector<pair<Request*, int>> finished;
+        vector<pair<Request*, ssize_t>> completed;
+        while (true) {
+            int waited = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (waited < 0 && errno != EINTR) {
+                this_thread::sleep_for(chrono::milliseconds(1));
+                continue;
+            }
+            // The kernel publishes completions up to cq_tail; everything before it is ours
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            finished.clear();
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                finished.push_back(make_pair(reinterpret_cast<Request*>(cqe.user_data), cqe.res));
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (finished.empty()) continue;
+
+            completed.clear();
+            {
+                lock_guard<mutex> lock(submit_mutex);
+                for (const auto& entry : finished) {
+                    Request* request = entry.first;
+                    int result = entry.second;
+                    if (result > 0 && (size_t)result < request->len) {
+                        // Short transfer: queue the rest. It keeps its in_flight slot, so
+                        // the reaper never waits for space that only it can free.
+                        request->data += result;
+                        request->len -= result;
+                        request->offset += result;
+                        request->transferred += result;
+                        push(request);
+                        continue;
+                    }
+                    // A write that makes no progress failed; a read that returns 0 hit end of file
+                    bool ok = result > 0 || (result == 0 && !request->is_write);
+                    if (result > 0) request->transferred += result;
+                    completed.push_back(make_pair(request, ok ? (ssize_t)request->transferred : -1));
+                }
+                in_flight -= completed.size();
+            }
+            space.notify_all();
+
+            for (const auto& entry : completed) {
+                entry.first->done(entry.second);
+                delete entry.first;
+            }
+        }
+    }
+
+    int ring_fd = -1;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+    unsigned capacity;
+    unsigned in_flight;   // guarded by submit_mutex
+    unsigned unsubmitted; // SQEs queued but not yet entered; guarded by submit_mutex
+    mutex submit_mutex;
+    condition_variable space;
+    condition_variable queued;
+};
+
+// Fallback: worker threads doing plain pwrite
+class ThreadPoolDiskIO : public DiskIO {
+public:
+    ThreadPoolDiskIO() {
+        for (int i = 0; i < DISK_WRITE_THREADS; ++i) thread(&ThreadPoolDiskIO::work, this).detach();
+    }
+
+    const char* name() const override { return "threads"; }
+
+    void write_at(int fd, const char* data, size_t len, long long offset, function<void(bool ok)> done) override {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            queue.push_back(new Request{fd, true, const_cast<char*>(data), len, offset, 0,
+                                        [done](ssize_t result) { done(result >= 0); }});
+        }
+        queued.notify_one();
+    }
+
+    // Reads already block their caller, so they skip the queue
+    ssize_t read_at(int fd, char* data, size_t len, long long offset) override {
+        size_t total = 0;
+        while (total < len) {
+            ssize_t got = pread(fd, data + total, len - total, offset + total);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) return -1;
+            if (got == 0) break;
+            total += got;
+        }
+        return total;
+    }
+
+private:
+    void work() {
+        while (true) {
+            Request* request;
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                queued.wait(lock, [this] { return !queue.empty(); });
+                request = queue.front();
+                queue.pop_front();
+            }
+            bool ok = true;
+            while (ok && request->len > 0) {
+                ssize_t written = pwrite(request->fd, request->data, request->len, request->offset);
+                if (written < 0 && errno == EINTR) continue;
+                ok = written > 0;
+                if (!ok) break;
+                request->data += written;
+                request->len -= written;
+                request->offset += written;
+                request->transferred += written;
+            }
+            request->done(ok ? (ssize_t)request->transferred : -1);
+            delete request;
+        }
+    }
+
+    deque<Request*> queue;
+    mutex queue_mutex;
+    condition_variable queued;
+};
+
+// Leaked on purpose: the completion threads run until the process exits
+DiskIO& DiskIO::instance() {
+    static DiskIO* disk = [] {
+        const char* forced = getenv("P2P_DISK_BACKEND");
+        if (!forced || string(forced) != "threads") {
+            UringDiskIO* uring = new UringDiskIO();
+            if (uring->start()) return static_cast<DiskIO*>(uring);
+            LOG_WARN("io_uring is not available; writing pieces from a thread pool");
+        }
+        return static_cast<DiskIO*>(new ThreadPoolDiskIO());
+    }();
+    return *disk;
+}
+
+bool DiskIO::preallocate(int fd, long long size) {
+    return size <= 0 || fallocate(fd, 0, 0, size) == 0;
+}
+
+void PendingWrites::submit(int fd, int piece, char* buffer, const char* data, size_t len, long long offset) {
+    {
+        unique_lock<mutex> lock(writes_mutex);
+        changed.wait(lock, [this] { return in_flight < limit; });
+        in_flight++;
+        writing.push_back(piece);
+    }
+    DiskIO::instance().write_at(fd, data, len, offset, [this, piece, buffer](bool ok) {
+        pool.release(buffer);
+        {
+            lock_guard<mutex> lock(writes_mutex);
+            in_flight--;
+            writing.erase(find(writing.begin(), writing.end(), piece));
+            completed.push_back(make_pair(piece, ok));
+        }
+        changed.notify_all();
+    });
+}
+
+void PendingWrites::collect(vector<pair<int, bool>>& finished, bool wait) {
+    unique_lock<mutex> lock(writes_mutex);
+    if (wait) changed.wait(lock, [this] { return in_flight == 0; });
+    finished.swap(completed);
+    completed.clear();
+}
+
+int PendingWrites::first_in_flight() {
+    lock_guard<mutex> lock(writes_mutex);
+    return writing.empty() ? -1 : *min_element(writing.begin(), writing.end());
+}
+
+bool PendingWrites::idle() {
+    lock_guard<mutex> lock(writes_mutex);
+    return in_flight == 0;
+}
+
+void PendingWrites::wait_idle() {
+    unique_lock<mutex> lock(writes_mutex);
+    changed.wait(lock, [this] { return in_flight == 0; });
+}
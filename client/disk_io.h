@@ -0,0 +1,80 @@
+#ifndef DISK_IO_H
+#define DISK_IO_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <sys/types.h>
+#include "utils.h"
+
+using namespace std;
+
+// Submission queue depth of the io_uring backend, and the worker count of the
+// pwrite thread pool used when io_uring is not available
+const unsigned DISK_QUEUE_DEPTH = 64;
+const int DISK_WRITE_THREADS = 4;
+
+// Positional writes that complete in the background, so a download keeps receiving
+// while earlier pieces reach the disk, and positional reads for the seeder. io_uring is
+// driven through its raw syscalls; where the kernel refuses it (or
+// P2P_DISK_BACKEND=threads is set) a small pool of pwrite threads takes its place.
+class DiskIO {
+public:
+    static DiskIO& instance();
+    virtual ~DiskIO() {}
+    virtual const char* name() const = 0;
+
+    // Queue a write of len bytes; done(ok) runs on a completion thread once all of
+    // them are on disk, or the write failed. data must stay valid until then.
+    virtual void write_at(int fd, const char* data, size_t len, long long offset, function<void(bool ok)> done) = 0;
+    // Read len bytes, waiting for them; fewer only at end of file, -1 on error
+    virtual ssize_t read_at(int fd, char* data, size_t len, long long offset) = 0;
+
+    // Reserve size bytes for fd up front, so a large download is laid out contiguously
+    // instead of fragmenting as pieces arrive. False if the filesystem cannot.
+    static bool preallocate(int fd, long long size);
+
+protected:
+    struct Request {
+        int fd;
+        bool is_write;
+        char* data;
+        size_t len;
+        long long offset;
+        size_t transferred;
+        function<void(ssize_t)> done; // bytes transferred, or -1
+    };
+};
+
+// The writes of one download that are still in flight. Each owns a pool buffer until
+// it completes; at most `limit` are queued, so a slow disk holds the download back
+// instead of filling memory.
+class PendingWrites {
+public:
+    PendingWrites(BufferPool& pool, int limit) : pool(pool), limit(limit), in_flight(0) {}
+    ~PendingWrites() { wait_idle(); }
+
+    // Write len bytes of buffer (a pool buffer, now owned by the write) at offset
+    void submit(int fd, int piece, char* buffer, const char* data, size_t len, long long offset);
+    // Pieces whose writes finished since the last call, with their outcome; with wait,
+    // first waits for every write in flight
+    void collect(vector<pair<int, bool>>& finished, bool wait);
+    // Lowest piece still being written, or -1
+    int first_in_flight();
+    bool idle();
+    void wait_idle();
+
+private:
+    BufferPool& pool;
+    int limit;
+    int in_flight;
+    vector<int> writing; // pieces in flight
+    vector<pair<int, bool>> completed;
+    mutex writes_mutex;
+    condition_variable changed;
+};
+
+#endif // DISK_IO_H
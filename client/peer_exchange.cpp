@@ -0,0 +1,85 @@
+#include "peer_exchange.h"
+#include <algorithm>
+#include <cstdlib>
+#include <arpa/inet.h>
+
+bool valid_peer_address(const string& address) {
+    size_t colon = address.rfind(':');
+    if (colon == string::npos || colon + 1 == address.size() || address.size() - colon > 6) return false;
+    in_addr ip;
+    if (inet_pton(AF_INET, address.substr(0, colon).c_str(), &ip) != 1) return false;
+    for (size_t k = colon + 1; k < address.size(); ++k) {
+        if (address[k] < '0' || address[k] > '9') return false;
+    }
+    int port = atoi(address.c_str() + colon + 1);
+    return port > 0 && port <= 65535;
+}
+
+void PeerExchange::seen(const string& file, const string& address) {
+    if (!valid_peer_address(address)) return;
+    lock_guard<mutex> lock(pex_mutex);
+    insert(files[file], address, chrono::steady_clock::now());
+}
+
+int PeerExchange::heard(const string& file, const vector<string>& addresses) {
+    lock_guard<mutex> lock(pex_mutex);
+    PeerAges& peers = files[file];
+    auto now = chrono::steady_clock::now();
+    expire(peers, now);
+    auto half_aged = now - chrono::milliseconds(PEX_PEER_TTL_MS / 2);
+    int added = 0;
+    for (size_t k = 0; k < addresses.size() && (int)k < PEX_SHARE_PEERS; ++k) {
+        if (peers.count(addresses[k]) || !valid_peer_address(addresses[k])) continue;
+        insert(peers, addresses[k], half_aged);
+        ++added;
+    }
+    return added;
+}
+
+void PeerExchange::forget(const string& file, const string& address) {
+    lock_guard<mutex> lock(pex_mutex);
+    auto it = files.find(file);
+    if (it != files.end()) it->second.erase(address);
+}
+
+vector<string> PeerExchange::sample(const string& file, const string& except) {
+    lock_guard<mutex> lock(pex_mutex);
+    vector<string> addresses;
+    auto it = files.find(file);
+    if (it == files.end()) return addresses;
+    expire(it->second, chrono::steady_clock::now());
+
+    vector<pair<chrono::steady_clock::time_point, string>> by_age;
+    for (const auto& peer : it->second) {
+        if (peer.first != except) by_age.push_back(make_pair(peer.second, peer.first));
+    }
+    sort(by_age.rbegin(), by_age.rend());
+    for (size_t k = 0; k < by_age.size() && (int)k < PEX_SHARE_PEERS; ++k) addresses.push_back(by_age[k].second);
+    return addresses;
+}
+
+// Called with pex_mutex held. A full list makes room by dropping its oldest peer.
+void PeerExchange::insert(PeerAges& peers, const string& address, chrono::steady_clock::time_point seen_at) {
+    auto existing = peers.find(address);
+    if (existing != peers.end()) {
+        existing->second = max(existing->second, seen_at);
+        return;
+    }
+    if ((int)peers.size() >= PEX_MAX_PEERS) {
+        auto oldest = peers.begin();
+        for (auto it = peers.begin(); it != peers.end(); ++it) {
+            if (it->second < oldest->second) oldest = it;
+        }
+        if (oldest->second >= seen_at) return;
+        peers.erase(oldest);
+    }
+    peers[address] = seen_at;
+}
+
+// Called with pex_mutex held
+void PeerExchange::expire(PeerAges& peers, chrono::steady_clock::time_point now) {
+    for (auto it = peers.begin(); it != peers.end();) {
+        if (now - it->second >= chrono::milliseconds(PEX_PEER_TTL_MS)) it = peers.erase(it);
+        else ++it;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef PEER_EXCHANGE_H
+#define PEER_EXCHANGE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+
+using namespace std;
+
+// At most PEX_MAX_PEERS addresses are remembered per file, and at most
+// PEX_SHARE_PEERS are sent or accepted in one message
+const int PEX_MAX_PEERS = 64;
+const int PEX_SHARE_PEERS = 16;
+// A peer that has not been seen for this long is forgotten
+const int PEX_PEER_TTL_MS = 10 * 60 * 1000;
+
+// "ip:port" with a dotted IPv4 address and a port in 1..65535
+bool valid_peer_address(const string& address);
+
+// Seeders known per file, gossiped between peers so a download can find seeders
+// that joined after it asked the tracker. A file is named "<group>/<filename>", as
+// names are only unique within a group. Only direct evidence (the peer answered,
+// or announced itself) keeps an address alive; addresses heard from others start
+// half-aged and are never refreshed by hearsay, so a dead peer drops out of the
+// gossip within PEX_PEER_TTL_MS. Like PieceScheduler it holds no sockets.
+class PeerExchange {
+public:
+    void seen(const string& file, const string& address);
+    // Returns how many of the addresses were new
+    int heard(const string& file, const vector<string>& addresses);
+    void forget(const string& file, const string& address);
+    // The PEX_SHARE_PEERS most recently seen addresses, without except
+    vector<string> sample(const string& file, const string& except = "");
+
+private:
+    typedef map<string, chrono::steady_clock::time_point> PeerAges;
+
+    void insert(PeerAges& peers, const string& address, chrono::steady_clock::time_point seen_at);
+    void expire(PeerAges& peers, chrono::steady_clock::time_point now);
+
+    map<string, PeerAges> files; // file -> address -> last seen
+    mutex pex_mutex;
+};
+
+#endif // PEER_EXCHANGE_H
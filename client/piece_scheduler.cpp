@@ -0,0 +1,92 @@
+#include "piece_scheduler.h"
+#include <algorithm>
+
+PieceScheduler::PieceScheduler(int total_pieces, const vector<bool>& have)
+    : have(have), missing(0), cursor(0), rotation(0), refreshes(0) {
+    this->have.resize(total_pieces, false);
+    missing = count(this->have.begin(), this->have.end(), false);
+    while (cursor < total_pieces && this->have[cursor]) ++cursor;
+}
+
+void PieceScheduler::set_sources(const vector<string>& full, const map<string, vector<bool>>& partial) {
+    full_seeders = full;
+    partial_seeders = partial;
+    failures.clear();
+}
+
+int PieceScheduler::add_sources(const vector<string>& full) {
+    int added = 0;
+    for (const auto& seeder : full) {
+        if (find(full_seeders.begin(), full_seeders.end(), seeder) != full_seeders.end()) continue;
+        full_seeders.push_back(seeder);
+        ++added;
+    }
+    if (added > 0 && refreshes > 0) --refreshes;
+    return added;
+}
+
+int PieceScheduler::next_piece() const {
+    // Pieces are fetched in order, which keeps a single seeder session busy and
+    // writes the file front to back
+    return cursor < (int)have.size() ? cursor : -1;
+}
+
+bool PieceScheduler::covers(const string& seeder, int piece) const {
+    if (find(full_seeders.begin(), full_seeders.end(), seeder) != full_seeders.end()) return true;
+    auto it = partial_seeders.find(seeder);
+    return it != partial_seeders.end() && it->second[piece];
+}
+
+PieceScheduler::Action PieceScheduler::plan_connect(int piece, vector<string>& racers) {
+    vector<string> candidates;
+    for (const auto& seeder : full_seeders) {
+        if (failures[seeder] < MAX_SEEDER_FAILURES) candidates.push_back(seeder);
+    }
+    for (const auto& partial : partial_seeders) {
+        if (partial.second[piece] && failures[partial.first] < MAX_SEEDER_FAILURES) {
+            candidates.push_back(partial.first);
+        }
+    }
+
+    if (candidates.empty()) {
+        // Every known seeder failed: the caller should ask the tracker who seeds the file now
+        if (refreshes < MAX_SEEDER_REFRESHES) {
+            ++refreshes;
+            return REFRESH;
+        }
+        return GIVE_UP;
+    }
+
+    // Take the next seeders in rotation, so a failing one is not retried first
+    racers.clear();
+    for (int k = 0; k < PEER_RACE_WIDTH && k < (int)candidates.size(); ++k) {
+        racers.push_back(candidates[(rotation + k) % candidates.size()]);
+    }
+    rotation += racers.size();
+    return CONNECT;
+}
+
+void PieceScheduler::connect_failed(const vector<string>& racers) {
+    for (const auto& racer : racers) failures[racer]++;
+}
+
+void PieceScheduler::piece_received(const string& seeder, int piece) {
+    failures[seeder] = 0;
+    if (!have[piece]) {
+        have[piece] = true;
+        --missing;
+    }
+    while (cursor < (int)have.size() && have[cursor]) ++cursor;
+}
+
+void PieceScheduler::piece_failed(const string& seeder) {
+    failures[seeder]++;
+}
+
+void PieceScheduler::piece_lost(int piece) {
+    if (have[piece]) {
+        have[piece] = false;
+        ++missing;
+    }
+    cursor = min(cursor, piece);
+}
@@ -0,0 +1,61 @@
+#ifndef PIECE_SCHEDULER_H
+#define PIECE_SCHEDULER_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+// Connects to seeders are raced this many at a time
+const int PEER_RACE_WIDTH = 2;
+// A seeder is skipped after this many consecutive failures
+const int MAX_SEEDER_FAILURES = 3;
+// How often a download may go back to the tracker for fresh seeders
+const int MAX_SEEDER_REFRESHES = 2;
+
+// Decides which piece a download fetches next and which seeders to ask for it.
+// It holds no sockets, threads or clocks: the client's download_manager feeds it
+// real transfers and bench/swarm_sim feeds it simulated ones, so a scheduling
+// change can be evaluated on a simulated swarm before it ships.
+class PieceScheduler {
+public:
+    enum Action { CONNECT, REFRESH, GIVE_UP };
+
+    // have marks the pieces that are already in place
+    PieceScheduler(int total_pieces, const vector<bool>& have);
+
+    // Seeders from the tracker: full seeders serve every piece, partial ones only the
+    // pieces they cover. Replacing them forgets earlier failures.
+    void set_sources(const vector<string>& full, const map<string, vector<bool>>& partial);
+    // Full seeders learned from other peers, added to the known ones. Returns how many
+    // were new; each batch of new seeders earns back one tracker refresh.
+    int add_sources(const vector<string>& full);
+
+    // Next piece to fetch, or -1 once every piece is in
+    int next_piece() const;
+    int remaining() const { return missing; }
+    int contiguous() const { return cursor; } // pieces 0 .. contiguous()-1 are all in
+    bool covers(const string& seeder, int piece) const;
+
+    // What to do for piece when there is no usable connection: race connects to
+    // `racers` (in order), ask the tracker for fresh seeders, or give up
+    Action plan_connect(int piece, vector<string>& racers);
+
+    void connect_failed(const vector<string>& racers);
+    void piece_received(const string& seeder, int piece);
+    void piece_failed(const string& seeder); // timed out, dropped or failed its hash
+    void piece_lost(int piece);              // received, but could not be stored
+
+private:
+    vector<bool> have;
+    int missing;
+    int cursor; // every piece before it is in
+    vector<string> full_seeders;
+    map<string, vector<bool>> partial_seeders;
+    map<string, int> failures; // consecutive failures per seeder
+    size_t rotation;
+    int refreshes;
+};
+
+#endif // PIECE_SCHEDULER_H
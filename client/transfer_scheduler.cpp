@@ -0,0 +1,166 @@
+#include "transfer_scheduler.h"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+bool parse_priority(const string& name, TransferPriority& priority) {
+    if (name == "high") priority = PRIORITY_HIGH;
+    else if (name == "normal") priority = PRIORITY_NORMAL;
+    else if (name == "low") priority = PRIORITY_LOW;
+    else return false;
+    return true;
+}
+
+const char* priority_name(TransferPriority priority) {
+    switch (priority) {
+        case PRIORITY_HIGH: return "high";
+        case PRIORITY_LOW: return "low";
+        default: return "normal";
+    }
+}
+
+void TransferScheduler::add(const string& name, TransferPriority priority, int weight) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    Transfer transfer;
+    transfer.priority = priority;
+    transfer.weight = max(weight, 1);
+    transfer.paused = false;
+    transfer.active = false;
+    transfer.order = next_order++;
+    transfer.served = 0;
+    transfers[name] = transfer;
+    rebalance();
+}
+
+void TransferScheduler::finish(const string& name) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    transfers.erase(name);
+    rebalance();
+}
+
+bool TransferScheduler::runnable(const string& name) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    auto it = transfers.find(name);
+    return it == transfers.end() || it->second.active;
+}
+
+void TransferScheduler::wait_turn(const string& name) {
+    unique_lock<mutex> lock(scheduler_mutex);
+    while (true) {
+        auto it = transfers.find(name);
+        if (it == transfers.end()) return;
+        if (!it->second.active) {
+            changed.wait(lock);
+            continue;
+        }
+        const Transfer* slowest = slowest_other(name, chrono::steady_clock::now());
+        if (!slowest || it->second.served - slowest->served <= FAIR_SHARE_LEAD_BYTES) return;
+        // Wait for the slowest to catch up, or until it counts as stalled
+        changed.wait_until(lock, slowest->progressed_at + chrono::milliseconds(FAIR_SHARE_STALL_MS));
+    }
+}
+
+void TransferScheduler::transferred(const string& name, long long bytes) {
+    {
+        lock_guard<mutex> lock(scheduler_mutex);
+        auto it = transfers.find(name);
+        if (it == transfers.end()) return;
+        it->second.served += (double)bytes / it->second.weight;
+        it->second.progressed_at = chrono::steady_clock::now();
+    }
+    changed.notify_all();
+}
+
+bool TransferScheduler::set_priority(const string& name, TransferPriority priority, int weight) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    auto it = transfers.find(name);
+    if (it == transfers.end()) return false;
+    it->second.priority = priority;
+    if (weight > 0) it->second.weight = weight;
+    rebalance();
+    return true;
+}
+
+bool TransferScheduler::pause(const string& name) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    auto it = transfers.find(name);
+    if (it == transfers.end()) return false;
+    it->second.paused = true;
+    rebalance();
+    return true;
+}
+
+bool TransferScheduler::resume(const string& name) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    auto it = transfers.find(name);
+    if (it == transfers.end()) return false;
+    it->second.paused = false;
+    rebalance();
+    return true;
+}
+
+bool TransferScheduler::lookup(const string& name, Info& info) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    auto it = transfers.find(name);
+    if (it == transfers.end()) return false;
+    info.priority = it->second.priority;
+    info.weight = it->second.weight;
+    info.state = it->second.paused ? PAUSED : it->second.active ? ACTIVE : QUEUED;
+    return true;
+}
+
+void TransferScheduler::set_max_active(int count) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    max_active = max(count, 1);
+    rebalance();
+}
+
+// Hand the active slots to the most urgent downloads. Called with scheduler_mutex held.
+void TransferScheduler::rebalance() {
+    vector<pair<string, Transfer*>> ready;
+    for (auto& entry : transfers) {
+        if (!entry.second.paused) ready.push_back(make_pair(entry.first, &entry.second));
+    }
+    sort(ready.begin(), ready.end(), [](const pair<string, Transfer*>& a, const pair<string, Transfer*>& b) {
+        if (a.second->priority != b.second->priority) return a.second->priority < b.second->priority;
+        return a.second->order < b.second->order;
+    });
+
+    // A download that gets a slot starts level with the slowest one that keeps its
+    // slot, so it cannot claim the bandwidth it was not allowed to use while waiting
+    bool any_kept = false;
+    double level = 0;
+    for (size_t k = 0; k < ready.size() && (int)k < max_active; ++k) {
+        if (!ready[k].second->active) continue;
+        level = any_kept ? min(level, ready[k].second->served) : ready[k].second->served;
+        any_kept = true;
+    }
+    auto now = chrono::steady_clock::now();
+    for (size_t k = 0; k < ready.size(); ++k) {
+        Transfer* transfer = ready[k].second;
+        bool wins = (int)k < max_active;
+        if (wins && !transfer->active) {
+            if (any_kept) transfer->served = max(transfer->served, level);
+            transfer->progressed_at = now;
+        }
+        transfer->active = wins;
+    }
+    for (auto& entry : transfers) {
+        if (entry.second.paused) entry.second.active = false;
+    }
+    changed.notify_all();
+}
+
+// The other active download with the fewest weighted bytes that is still making
+// progress, or null. Called with scheduler_mutex held.
+const TransferScheduler::Transfer* TransferScheduler::slowest_other(const string& name,
+                                                                   chrono::steady_clock::time_point now) const {
+    const Transfer* slowest = nullptr;
+    for (const auto& entry : transfers) {
+        const Transfer& other = entry.second;
+        if (entry.first == name || !other.active) continue;
+        if (now - other.progressed_at >= chrono::milliseconds(FAIR_SHARE_STALL_MS)) continue;
+        if (!slowest || other.served < slowest->served) slowest = &other;
+    }
+    return slowest;
+}
@@ -0,0 +1,80 @@
+#ifndef TRANSFER_SCHEDULER_H
+#define TRANSFER_SCHEDULER_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+using namespace std;
+
+// Downloads that may transfer at the same time; the rest wait in priority order
+const int MAX_ACTIVE_DOWNLOADS = 3;
+// A download may run this many weighted bytes ahead of the slowest active one before
+// it waits for it. Downloads that made no progress for FAIR_SHARE_STALL_MS (stuck on
+// a slow or failing seeder) are not waited for.
+const long long FAIR_SHARE_LEAD_BYTES = 2 * 1024 * 1024;
+const int FAIR_SHARE_STALL_MS = 1000;
+
+enum TransferPriority { PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW };
+
+// Parse "high", "normal" or "low"; false for anything else
+bool parse_priority(const string& name, TransferPriority& priority);
+const char* priority_name(TransferPriority priority);
+
+// Client-wide admission of downloads. The max_active slots go to the downloads that are
+// not paused, highest priority first and oldest first within a priority; a download
+// that loses its slot to a more urgent one stops at its next piece. Active downloads
+// share bandwidth by weight: one that gets ahead of its share waits for the others.
+class TransferScheduler {
+public:
+    enum State { QUEUED, ACTIVE, PAUSED };
+
+    struct Info {
+        TransferPriority priority;
+        int weight;
+        State state;
+    };
+
+    explicit TransferScheduler(int max_active = MAX_ACTIVE_DOWNLOADS) : max_active(max_active), next_order(0) {}
+
+    // A new download replaces an earlier one of the same name
+    void add(const string& name, TransferPriority priority, int weight);
+    void finish(const string& name);
+
+    // Whether name could fetch a piece right now
+    bool runnable(const string& name);
+    // Block until name may fetch its next piece
+    void wait_turn(const string& name);
+    void transferred(const string& name, long long bytes);
+
+    // False if there is no such download
+    bool set_priority(const string& name, TransferPriority priority, int weight);
+    bool pause(const string& name);
+    bool resume(const string& name);
+    bool lookup(const string& name, Info& info);
+    void set_max_active(int count);
+
+private:
+    struct Transfer {
+        TransferPriority priority;
+        int weight;
+        bool paused;
+        bool active;
+        long long order;  // arrival, breaks ties within a priority
+        double served;    // bytes transferred while active, divided by weight
+        chrono::steady_clock::time_point progressed_at; // last piece, or when it got its slot
+    };
+
+    void rebalance();
+    const Transfer* slowest_other(const string& name, chrono::steady_clock::time_point now) const;
+
+    int max_active;
+    long long next_order;
+    map<string, Transfer> transfers;
+    mutex scheduler_mutex;
+    condition_variable changed;
+};
+
+#endif // TRANSFER_SCHEDULER_H
@@ -2,7 +2,25 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
+#include <cerrno>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <vector>
+#include <chrono>
+#include <zlib.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <cstdlib>
+#include <sys/stat.h>
 #include <openssl/sha.h> // Reverted to the required SHA1 header
 
 using namespace std;
@@ -31,6 +49,528 @@ vector<string> parse(const string& str, const string& delimiter) {
     return tokens;
 }
 
+// Bounded multi-producer queue of log lines (after Vyukov). A slot whose sequence
+// equals a producer's ticket is free for it; once written, its sequence moves one
+// ahead and the writer thread may take it. Producers never wait on each other or
+// on the console.
+class AsyncLog {
+public:
+    AsyncLog() : slots(new Slot[LOG_QUEUE_SLOTS]), tail(0), head(0), dropped(0) {
+        for (int i = 0; i < LOG_QUEUE_SLOTS; ++i) slots[i].sequence.store(i, memory_order_relaxed);
+        thread(&AsyncLog::run, this).detach();
+        atexit(log_flush);
+    }
+
+    void push(int level, const string& msg) {
+        uint64_t pos = tail.load(memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots[pos & (LOG_QUEUE_SLOTS - 1)];
+            int64_t diff = (int64_t)slot->sequence.load(memory_order_acquire) - (int64_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+        slot->level = level;
+        slot->length = min(msg.size(), (size_t)LOG_LINE_MAX);
+        memcpy(slot->text, msg.data(), slot->length);
+        slot->sequence.store(pos + 1, memory_order_release);
+    }
+
+    // Write out every message queued so far in one go; returns how many there were
+    size_t drain() {
+        lock_guard<mutex> lock(writer_mutex);
+        batch.clear();
+        size_t count = 0;
+        while (true) {
+            Slot& slot = slots[head & (LOG_QUEUE_SLOTS - 1)];
+            if (slot.sequence.load(memory_order_acquire) != head + 1) break;
+            batch += "[log] ";
+            if (slot.level == LOG_LEVEL_DEBUG) batch += "debug: ";
+            else if (slot.level == LOG_LEVEL_WARN) batch += "warning: ";
+            else if (slot.level >= LOG_LEVEL_ERROR) batch += "error: ";
+            batch.append(slot.text, slot.length);
+            batch += '\n';
+            slot.sequence.store(head + LOG_QUEUE_SLOTS, memory_order_release);
+            ++head;
+            ++count;
+        }
+        long long lost = dropped.exchange(0, memory_order_relaxed);
+        if (lost > 0) batch += "[log] " + to_string(lost) + " messages dropped: log queue full\n";
+        if (!batch.empty()) {
+            fwrite(batch.data(), 1, batch.size(), stdout);
+            fflush(stdout);
+        }
+        return count;
+    }
+
+private:
+    struct Slot {
+        atomic<uint64_t> sequence;
+        int level;
+        size_t length;
+        char text[LOG_LINE_MAX];
+    };
+
+    void run() {
+        while (true) {
+            if (drain() == 0) this_thread::sleep_for(chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        }
+    }
+
+    Slot* slots;
+    atomic<uint64_t> tail;
+    uint64_t head; // only touched under writer_mutex
+    atomic<long long> dropped;
+    mutex writer_mutex;
+    string batch;
+};
+
+// Leaked on purpose: threads may still log while static destructors run at exit
+static AsyncLog& async_log() {
+    static AsyncLog* log = new AsyncLog();
+    return *log;
+}
+
+void log_at(int level, const string& msg) {
+    async_log().push(level, msg);
+}
+
+void log_flush() {
+    async_log().drain();
+}
+
 void log_msg(const string& msg) {
-    cout << "[log] " << msg << endl;
+    LOG_INFO(msg);
+}
+
+bool LogRateLimit::allow(long long& suppressed_since) {
+    long long now = chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+    long long next = next_ms.load(memory_order_relaxed);
+    if (now < next || !next_ms.compare_exchange_strong(next, now + interval_ms, memory_order_relaxed)) {
+        suppressed.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    suppressed_since = suppressed.exchange(0, memory_order_relaxed);
+    return true;
+}
+
+// The buffer a thread released last, kept for its next acquire and handed back to
+// its pool when the thread exits
+struct ThreadBufferCache {
+    BufferPool* pool = nullptr;
+    char* buffer = nullptr;
+    ~ThreadBufferCache() {
+        if (buffer) pool->release_shared(buffer);
+    }
+};
+static thread_local ThreadBufferCache thread_buffer;
+
+BufferPool::BufferPool(size_t buffer_bytes, size_t capacity)
+    : buffer_bytes(buffer_bytes), capacity(capacity), carved(0), overflow_total(0) {
+    void* region = mmap(nullptr, buffer_bytes * capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        // Without a slab every buffer is an overflow buffer
+        slab = nullptr;
+        this->capacity = 0;
+    } else {
+        slab = static_cast<char*>(region);
+    }
+    free_buffers.reserve(this->capacity);
+}
+
+char* BufferPool::acquire() {
+    if (thread_buffer.pool == this && thread_buffer.buffer) {
+        char* buffer = thread_buffer.buffer;
+        thread_buffer.buffer = nullptr;
+        return buffer;
+    }
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        if (!free_buffers.empty()) {
+            char* buffer = free_buffers.back();
+            free_buffers.pop_back();
+            return buffer;
+        }
+        if (carved < capacity) return slab + buffer_bytes * carved++;
+    }
+    overflow_total++;
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), buffer_bytes) != 0) throw bad_alloc();
+    return static_cast<char*>(buffer);
+}
+
+void BufferPool::release(char* buffer) {
+    if (!in_slab(buffer)) {
+        free(buffer);
+        return;
+    }
+    if (thread_buffer.buffer) {
+        release_shared(buffer);
+        return;
+    }
+    thread_buffer.pool = this;
+    thread_buffer.buffer = buffer;
+}
+
+void BufferPool::release_shared(char* buffer) {
+    lock_guard<mutex> lock(pool_mutex);
+    free_buffers.push_back(buffer);
+}
+
+size_t BufferPool::slab_buffers() {
+    lock_guard<mutex> lock(pool_mutex);
+    return carved;
+}
+
+int connect_with_timeout(const string& ip, int port, int timeout_ms) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1) {
+        close(sock);
+        return -1;
+    }
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    int rc = connect(sock, (struct sockaddr*)&addr, sizeof(addr));
+    if (rc < 0 && errno == EINPROGRESS) {
+        pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        rc = -1;
+        if (poll(&pfd, 1, timeout_ms) == 1) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) rc = 0;
+        }
+    }
+    if (rc < 0) {
+        close(sock);
+        return -1;
+    }
+
+    fcntl(sock, F_SETFL, flags);
+    return sock;
+}
+
+bool wait_readable(int sock, int timeout_ms) {
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeout_ms) == 1;
+}
+
+int race_connect(const vector<string>& addrs, int timeout_ms, int& winner) {
+    vector<int> socks(addrs.size(), -1);
+    vector<pollfd> pfds;
+    vector<int> pfd_owner;
+    winner = -1;
+
+    for (size_t i = 0; i < addrs.size(); ++i) {
+        size_t delim_pos = addrs[i].find(':');
+        if (delim_pos == string::npos) continue;
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(stoi(addrs[i].substr(delim_pos + 1)));
+        if (inet_pton(AF_INET, addrs[i].substr(0, delim_pos).c_str(), &addr.sin_addr) != 1) continue;
+
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) continue;
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+        int rc = connect(sock, (struct sockaddr*)&addr, sizeof(addr));
+        if (rc < 0 && errno != EINPROGRESS) {
+            close(sock);
+            continue;
+        }
+        socks[i] = sock;
+        pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        pfds.push_back(pfd);
+        pfd_owner.push_back(i);
+    }
+
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    while (winner < 0 && !pfds.empty()) {
+        int remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (remaining <= 0 || poll(pfds.data(), pfds.size(), remaining) <= 0) break;
+
+        for (size_t p = 0; p < pfds.size(); ) {
+            if (pfds[p].revents == 0) {
+                ++p;
+                continue;
+            }
+            int i = pfd_owner[p];
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0 && winner < 0) {
+                winner = i;
+                ++p;
+            } else {
+                // Refused or unreachable: drop it and keep waiting for the others
+                close(socks[i]);
+                socks[i] = -1;
+                pfds.erase(pfds.begin() + p);
+                pfd_owner.erase(pfd_owner.begin() + p);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < socks.size(); ++i) {
+        if (socks[i] >= 0 && (int)i != winner) close(socks[i]);
+    }
+    if (winner < 0) return -1;
+
+    int sock = socks[winner];
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+    return sock;
+}
+
+bool read_full(int sock, char* buf, size_t len, int timeout_ms) {
+    size_t total = 0;
+    while (total < len) {
+        if (!wait_readable(sock, timeout_ms)) return false;
+        ssize_t n = read(sock, buf + total, len - total);
+        if (n <= 0) return false;
+        total += n;
+    }
+    return true;
+}
+
+bool read_line(int sock, string& line, int timeout_ms, size_t max_len) {
+    line.clear();
+    char c;
+    while (line.size() < max_len) {
+        if (!wait_readable(sock, timeout_ms)) return false;
+        if (read(sock, &c, 1) != 1) return false;
+        if (c == '\n') return true;
+        line += c;
+    }
+    return false;
+}
+
+bool send_all(int sock, const char* buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = send(sock, buf + total, len - total, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        total += n;
+    }
+    return true;
+}
+
+bool compress_piece(const char* data, size_t len, vector<char>& out) {
+    uLongf out_len = compressBound(len);
+    if (out.size() < out_len) out.resize(out_len);
+    if (compress2((Bytef*)out.data(), &out_len, (const Bytef*)data, len, Z_BEST_SPEED) != Z_OK) {
+        return false;
+    }
+    if (out_len > len * (1.0 - COMPRESSION_MIN_SAVING)) {
+        return false;
+    }
+    out.resize(out_len);
+    return true;
+}
+
+bool decompress_piece(const char* data, size_t len, char* out, size_t expected_len) {
+    uLongf out_len = expected_len;
+    if (uncompress((Bytef*)out, &out_len, (const Bytef*)data, len) != Z_OK) {
+        return false;
+    }
+    return out_len == expected_len;
+}
+
+void RollingChecksum::init(const unsigned char* data, size_t n) {
+    a = 0;
+    b = 0;
+    len = n;
+    for (size_t i = 0; i < n; ++i) {
+        a += data[i];
+        b += (uint32_t)(n - i) * data[i];
+    }
+    a &= 0xffff;
+    b &= 0xffff;
+}
+
+void RollingChecksum::roll(unsigned char out, unsigned char in) {
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)len * out + a) & 0xffff;
+}
+
+// First span that ends after offset
+static vector<FileSpan>::const_iterator span_at(const vector<FileSpan>& layout, long long offset) {
+    return upper_bound(layout.begin(), layout.end(), offset,
+                       [](long long off, const FileSpan& span) { return off < span.offset + span.length; });
+}
+
+ssize_t layout_pread(const vector<FileSpan>& layout, char* buf, size_t len, long long offset) {
+    size_t done = 0;
+    for (auto it = span_at(layout, offset); it != layout.end() && done < len; ++it) {
+        if (it->length == 0) continue;
+        long long within = offset + done - it->offset;
+        size_t chunk = min((long long)(len - done), it->length - within);
+        int fd = open(it->path.c_str(), O_RDONLY);
+        if (fd < 0) return -1;
+        ssize_t n = pread(fd, buf + done, chunk, within);
+        close(fd);
+        if (n < 0) return -1;
+        done += n;
+        if ((size_t)n < chunk) break;
+    }
+    return done;
+}
+
+bool layout_pwrite(const vector<FileSpan>& layout, const char* buf, size_t len, long long offset) {
+    size_t done = 0;
+    for (auto it = span_at(layout, offset); it != layout.end() && done < len; ++it) {
+        if (it->length == 0) continue;
+        long long within = offset + done - it->offset;
+        size_t chunk = min((long long)(len - done), it->length - within);
+        int fd = open(it->path.c_str(), O_WRONLY);
+        if (fd < 0) return false;
+        ssize_t n = pwrite(fd, buf + done, chunk, within);
+        close(fd);
+        if (n != (ssize_t)chunk) return false;
+        done += n;
+    }
+    return done == len;
+}
+
+bool make_parent_dirs(const string& path) {
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1)) {
+        string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+string escape_manifest_path(const string& path) {
+    static const char* hex_digits = "0123456789ABCDEF";
+    string out;
+    for (unsigned char c : path) {
+        if (isalnum(c) || c == '.' || c == '_' || c == '-' || c == '/') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex_digits[c >> 4];
+            out += hex_digits[c & 0xf];
+        }
+    }
+    return out;
+}
+
+bool unescape_manifest_path(const string& escaped, string& path) {
+    path.clear();
+    for (size_t i = 0; i < escaped.size(); ++i) {
+        if (escaped[i] != '%') {
+            path += escaped[i];
+            continue;
+        }
+        if (i + 2 >= escaped.size() || !isxdigit(escaped[i + 1]) || !isxdigit(escaped[i + 2])) return false;
+        path += (char)stoi(escaped.substr(i + 1, 2), nullptr, 16);
+        i += 2;
+    }
+    if (path.empty() || path[0] == '/') return false;
+    for (const auto& component : parse(path, "/")) {
+        if (component == "..") return false;
+    }
+    return true;
+}
+
+string json_escape(const string& text) {
+    string out;
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+vector<string> load_tracker_addresses(const string& info_file) {
+    vector<string> addresses;
+    int fd = open(info_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return addresses;
+    }
+
+    string contents;
+    char buffer[4096];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, bytes_read);
+    }
+    close(fd);
+
+    stringstream ss(contents);
+    string line;
+    while (getline(ss, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) {
+            addresses.push_back(line);
+        }
+    }
+    return addresses;
+}
+
+HashRing::HashRing(const vector<string>& node_ids, int vnodes_per_node) : node_count(node_ids.size()) {
+    for (int node = 0; node < node_count; ++node) {
+        for (int v = 0; v < vnodes_per_node; ++v) {
+            ring[point(node_ids[node] + "#" + to_string(v))] = node;
+        }
+    }
+}
+
+uint64_t HashRing::point(const string& key) {
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(key.data()), key.size(), hash);
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value = (value << 8) | hash[i];
+    }
+    return value;
+}
+
+vector<int> HashRing::owners(const string& key, int replicas) const {
+    vector<int> result;
+    if (ring.empty()) return result;
+    if (replicas > node_count) replicas = node_count;
+
+    auto it = ring.lower_bound(point(key));
+    for (size_t steps = 0; steps < ring.size() && (int)result.size() < replicas; ++steps, ++it) {
+        if (it == ring.end()) it = ring.begin();
+        bool seen = false;
+        for (int node : result) {
+            if (node == it->second) seen = true;
+        }
+        if (!seen) result.push_back(it->second);
+    }
+    return result;
 }
@@ -3,6 +3,11 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <sys/types.h>
 #include <openssl/sha.h>
 
 using namespace std;
@@ -13,7 +18,204 @@ string sha(const char* data, size_t len);
 // Function to split a string by a delimiter
 vector<string> parse(const string& str, const string& delimiter);
 
-// Log message to console with a prefix
+// Log levels. Messages below LOG_MIN_LEVEL are compiled out together with the code
+// that builds them; pick the level at build time with make LOG_LEVEL=<n>.
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+// The log queue holds this many messages (a power of two) of up to LOG_LINE_MAX bytes;
+// longer ones are truncated. The writer thread polls it every LOG_FLUSH_INTERVAL_MS.
+const int LOG_QUEUE_SLOTS = 4096;
+const int LOG_LINE_MAX = 480;
+const int LOG_FLUSH_INTERVAL_MS = 10;
+
+// Queue a message for the background log writer. Never blocks on the console:
+// when the queue is full the message is dropped and counted instead.
+void log_at(int level, const string& msg);
+
+// Write out everything queued so far (also done at exit)
+void log_flush();
+
+// Log message to console with a prefix, at info level
 void log_msg(const string& msg);
 
+#define LOG_AT(level, msg) do { if ((level) >= LOG_MIN_LEVEL) log_at((level), (msg)); } while (0)
+#define LOG_DEBUG(msg) LOG_AT(LOG_LEVEL_DEBUG, msg)
+#define LOG_INFO(msg) LOG_AT(LOG_LEVEL_INFO, msg)
+#define LOG_WARN(msg) LOG_AT(LOG_LEVEL_WARN, msg)
+#define LOG_ERROR(msg) LOG_AT(LOG_LEVEL_ERROR, msg)
+
+// Lets one message through per interval and counts the rest
+class LogRateLimit {
+public:
+    explicit LogRateLimit(int interval_ms) : interval_ms(interval_ms), next_ms(0), suppressed(0) {}
+    // True if a message may be logged now; suppressed_since is how many were held back before it
+    bool allow(long long& suppressed_since);
+
+private:
+    int interval_ms;
+    atomic<long long> next_ms;
+    atomic<long long> suppressed;
+};
+
+// For per-piece messages: at most one per interval_ms from this call site, and the
+// next one that gets through says how many were suppressed in between
+#define LOG_EVERY_MS(level, interval_ms, msg) do { \
+        if ((level) >= LOG_MIN_LEVEL) { \
+            static LogRateLimit log_limit_(interval_ms); \
+            long long log_suppressed_; \
+            if (log_limit_.allow(log_suppressed_)) { \
+                log_at((level), log_suppressed_ > 0 ? string(msg) + " (" + to_string(log_suppressed_) + \
+                                                      " similar messages suppressed)" : string(msg)); \
+            } \
+        } \
+    } while (0)
+
+// Fixed-size, page-aligned I/O buffers carved from one slab and recycled, so busy
+// paths stop allocating and faulting in fresh pages. A thread keeps the buffer it
+// released last for its next acquire; other free buffers are shared. The slab holds
+// `capacity` buffers, which bounds the pool's memory: acquires beyond that get a
+// heap buffer that is freed again on release.
+class BufferPool {
+public:
+    BufferPool(size_t buffer_bytes, size_t capacity);
+    char* acquire();
+    void release(char* buffer);
+    size_t buffer_size() const { return buffer_bytes; }
+    size_t slab_buffers();         // slab buffers handed out so far, free or in use
+    long long overflows() const { return overflow_total.load(); } // heap buffers handed out
+
+private:
+    friend struct ThreadBufferCache;
+    bool in_slab(const char* buffer) const { return buffer >= slab && buffer < slab + buffer_bytes * capacity; }
+    void release_shared(char* buffer);
+
+    size_t buffer_bytes;
+    size_t capacity;
+    char* slab;                    // reserved up front, pages are faulted in on first use
+    mutex pool_mutex;
+    vector<char*> free_buffers;
+    size_t carved;                 // slab buffers handed out so far; guarded by pool_mutex
+    atomic<long long> overflow_total;
+};
+
+// A pool buffer for the current scope
+class PooledBuffer {
+public:
+    explicit PooledBuffer(BufferPool& pool) : pool(pool), data(pool.acquire()) {}
+    ~PooledBuffer() { pool.release(data); }
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    char* get() const { return data; }
+    // Hand the buffer to a new owner, who releases it to the pool, and carry on with a fresh one
+    char* take() {
+        char* taken = data;
+        data = pool.acquire();
+        return taken;
+    }
+
+private:
+    BufferPool& pool;
+    char* data;
+};
+
+// Connect a TCP socket to ip:port, giving up after timeout_ms.
+// Returns the connected (blocking) socket, or -1 on failure or timeout.
+int connect_with_timeout(const string& ip, int port, int timeout_ms);
+
+// Wait up to timeout_ms for sock to become readable; false on timeout or error
+bool wait_readable(int sock, int timeout_ms);
+
+// Start non-blocking connects to every "ip:port" in addrs at once and keep the first
+// that completes within timeout_ms; the others are abandoned. Returns the connected
+// socket and sets winner to its index in addrs, or returns -1.
+int race_connect(const vector<string>& addrs, int timeout_ms, int& winner);
+
+// Read exactly len bytes, allowing at most timeout_ms without progress between reads
+bool read_full(int sock, char* buf, size_t len, int timeout_ms);
+
+// Read one newline-terminated line (without the newline), byte by byte
+bool read_line(int sock, string& line, int timeout_ms, size_t max_len = 4096);
+
+// Send all of buf, retrying short writes
+bool send_all(int sock, const char* buf, size_t len);
+
+// Compress len bytes of data with zlib at its fastest level. Returns false (and leaves
+// out untouched) when the result would not be at least COMPRESSION_MIN_SAVING smaller.
+bool compress_piece(const char* data, size_t len, vector<char>& out);
+
+// Inflate a compress_piece() payload into exactly expected_len bytes at out
+bool decompress_piece(const char* data, size_t len, char* out, size_t expected_len);
+
+// Fraction of a piece that compression must save for the compressed form to be sent
+const double COMPRESSION_MIN_SAVING = 0.1;
+
+// rsync-style weak checksum over a fixed-size window that can be slid forward one
+// byte at a time in O(1), used to find pieces of a new file inside an older version
+class RollingChecksum {
+public:
+    RollingChecksum() : a(0), b(0), len(0) {}
+    void init(const unsigned char* data, size_t n);
+    // Slide the window one byte: drop `out` from the front, append `in` at the back
+    void roll(unsigned char out, unsigned char in);
+    uint32_t digest() const { return (b << 16) | (a & 0xffff); }
+private:
+    uint32_t a, b;
+    size_t len;
+};
+
+// One file of a multi-file piece space: its bytes occupy [offset, offset + length)
+struct FileSpan {
+    string path;
+    long long offset;
+    long long length;
+};
+
+// pread/pwrite across the files of a layout as if they were one file laid end to end
+ssize_t layout_pread(const vector<FileSpan>& layout, char* buf, size_t len, long long offset);
+bool layout_pwrite(const vector<FileSpan>& layout, const char* buf, size_t len, long long offset);
+
+// Create the missing directories leading up to path (like mkdir -p on its dirname)
+bool make_parent_dirs(const string& path);
+
+// Percent-escape a relative path for a bundle manifest entry, and back. unescape
+// rejects absolute paths and ".." components so a manifest cannot escape its root.
+string escape_manifest_path(const string& path);
+bool unescape_manifest_path(const string& escaped, string& path);
+
+// Escape a string for use inside a JSON string literal
+string json_escape(const string& text);
+
+// Read the "ip:port" lines of a tracker_info.txt file (blank lines skipped)
+vector<string> load_tracker_addresses(const string& info_file);
+
+// Number of trackers that hold a copy of every group shard
+const int TRACKER_REPLICATION_FACTOR = 2;
+// Trackers exchange sync messages on their client port plus this offset
+const int SYNC_PORT_OFFSET = 100;
+
+// Consistent-hash ring used to place group shards on trackers.
+// Each tracker is mapped to several virtual points so that adding or
+// removing a tracker only moves the groups adjacent to its points.
+class HashRing {
+public:
+    HashRing() {}
+    HashRing(const vector<string>& node_ids, int vnodes_per_node = 64);
+
+    // Up to `replicas` distinct node indices responsible for `key`, primary first
+    vector<int> owners(const string& key, int replicas = TRACKER_REPLICATION_FACTOR) const;
+    int size() const { return node_count; }
+
+private:
+    static uint64_t point(const string& key);
+
+    map<uint64_t, int> ring; // ring point -> node index
+    int node_count = 0;
+};
+
 #endif // UTILS_H
\ No newline at end of file
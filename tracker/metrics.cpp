@@ -0,0 +1,165 @@
+#include "metrics.h"
+#include <set>
+#include <chrono>
+#include <sstream>
+
+using namespace std;
+
+static const char* const COMMAND_NAMES[] = {
+    "ping", "create_user", "login", "create_group", "join_group", "leave_group", "list_requests",
+    "accept_request", "list_groups", "list_files", "upload_file", "download_file", "logout",
+    "stop_share", "i_am_seeder", "batch", "other"};
+static const int COMMAND_SLOTS = sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]);
+
+static const char* const LOCK_NAMES[LOCK_COUNT] = {
+    "users_mutex", "logged_in_users_mutex", "groups_mutex", "socket_to_user_mutex", "seeders_mutex",
+    "peer_sockets_mutex"};
+
+// Only the owning thread writes its cells, so a relaxed load and store is enough
+static void bump(atomic<uint64_t>& cell, uint64_t delta) {
+    cell.store(cell.load(memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+static int bucket_of(uint64_t ns) {
+    int bucket = 0;
+    while (bucket < METRIC_BUCKET_COUNT && ns > METRIC_BUCKETS_S[bucket] * 1e9) ++bucket;
+    return bucket;
+}
+
+struct HistogramCells {
+    atomic<uint64_t> buckets[METRIC_BUCKET_COUNT + 1];
+    atomic<uint64_t> sum_ns;
+
+    HistogramCells() : sum_ns(0) {
+        for (auto& bucket : buckets) bucket.store(0, memory_order_relaxed);
+    }
+    void record(uint64_t ns) {
+        bump(buckets[bucket_of(ns)], 1);
+        bump(sum_ns, ns);
+    }
+};
+
+struct ThreadCells {
+    HistogramCells commands[COMMAND_SLOTS];
+    HistogramCells locks[LOCK_COUNT];
+};
+
+// Plain sums of any number of ThreadCells
+struct HistogramTotals {
+    uint64_t buckets[METRIC_BUCKET_COUNT + 1] = {};
+    uint64_t sum_ns = 0;
+
+    void add(const HistogramCells& cells) {
+        for (int b = 0; b <= METRIC_BUCKET_COUNT; ++b) buckets[b] += cells.buckets[b].load(memory_order_relaxed);
+        sum_ns += cells.sum_ns.load(memory_order_relaxed);
+    }
+};
+
+struct CellTotals {
+    HistogramTotals commands[COMMAND_SLOTS];
+    HistogramTotals locks[LOCK_COUNT];
+
+    void add(const ThreadCells& cells) {
+        for (int c = 0; c < COMMAND_SLOTS; ++c) commands[c].add(cells.commands[c]);
+        for (int l = 0; l < LOCK_COUNT; ++l) locks[l].add(cells.locks[l]);
+    }
+};
+
+// Cells of live threads, and the totals of threads that have exited. The tracker
+// runs a thread per connection, so cells are folded in and freed when a thread ends.
+class CellRegistry {
+public:
+    ThreadCells* attach() {
+        lock_guard<mutex> lock(registry_mutex);
+        ThreadCells* cells = new ThreadCells();
+        live.insert(cells);
+        return cells;
+    }
+    void retire(ThreadCells* cells) {
+        lock_guard<mutex> lock(registry_mutex);
+        retired.add(*cells);
+        live.erase(cells);
+        delete cells;
+    }
+    CellTotals snapshot() {
+        lock_guard<mutex> lock(registry_mutex);
+        CellTotals totals = retired;
+        for (const auto* cells : live) totals.add(*cells);
+        return totals;
+    }
+
+private:
+    mutex registry_mutex;
+    set<ThreadCells*> live;
+    CellTotals retired;
+};
+
+// Never destroyed: detached threads may still retire their cells while the process exits
+static CellRegistry& registry() {
+    static CellRegistry* instance = new CellRegistry();
+    return *instance;
+}
+
+struct LocalCells {
+    ThreadCells* cells = nullptr;
+    ~LocalCells() {
+        if (cells) registry().retire(cells);
+    }
+    ThreadCells& get() {
+        if (!cells) cells = registry().attach();
+        return *cells;
+    }
+};
+static thread_local LocalCells local_cells;
+
+void record_command(const string& command, uint64_t elapsed_ns) {
+    int slot = 0;
+    while (slot < COMMAND_SLOTS - 1 && command != COMMAND_NAMES[slot]) ++slot;
+    local_cells.get().commands[slot].record(elapsed_ns);
+}
+
+void record_lock_wait(LockId id, uint64_t wait_ns) {
+    local_cells.get().locks[id].record(wait_ns);
+}
+
+void TimedMutex::lock() {
+    if (m.try_lock()) {
+        record_lock_wait(id, 0);
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+    m.lock();
+    record_lock_wait(id, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+static void render_histogram(ostringstream& out, const string& name, const string& label,
+                             const HistogramTotals& totals) {
+    uint64_t cumulative = 0;
+    for (int b = 0; b <= METRIC_BUCKET_COUNT; ++b) {
+        cumulative += totals.buckets[b];
+        out << name << "_bucket{" << label << ",le=\"";
+        if (b < METRIC_BUCKET_COUNT) out << METRIC_BUCKETS_S[b];
+        else out << "+Inf";
+        out << "\"} " << cumulative << "\n";
+    }
+    out << name << "_sum{" << label << "} " << totals.sum_ns / 1e9 << "\n";
+    out << name << "_count{" << label << "} " << cumulative << "\n";
+}
+
+void render_thread_metrics(string& out) {
+    CellTotals totals = registry().snapshot();
+    ostringstream text;
+    text << "# HELP p2p_tracker_command_duration_seconds Time to handle a client command, by command.\n"
+         << "# TYPE p2p_tracker_command_duration_seconds histogram\n";
+    for (int c = 0; c < COMMAND_SLOTS; ++c) {
+        render_histogram(text, "p2p_tracker_command_duration_seconds",
+                         string("command=\"") + COMMAND_NAMES[c] + "\"", totals.commands[c]);
+    }
+    text << "# HELP p2p_tracker_lock_wait_seconds Time spent waiting to acquire a tracker mutex.\n"
+         << "# TYPE p2p_tracker_lock_wait_seconds histogram\n";
+    for (int l = 0; l < LOCK_COUNT; ++l) {
+        render_histogram(text, "p2p_tracker_lock_wait_seconds", string("lock=\"") + LOCK_NAMES[l] + "\"",
+                         totals.locks[l]);
+    }
+    out += text.str();
+}
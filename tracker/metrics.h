@@ -0,0 +1,43 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+// Hot-path metrics of the tracker. Every thread records into its own cells with
+// relaxed atomic stores, so recording never contends; a scrape sums the cells of
+// the live threads and of the threads that have already exited.
+
+// The tracker's mutexes, as instrumented by TimedMutex
+enum LockId { LOCK_USERS, LOCK_SESSIONS, LOCK_GROUPS, LOCK_SOCKETS, LOCK_SEEDERS, LOCK_PEER_SOCKETS, LOCK_COUNT };
+
+// Upper bounds of the latency histogram buckets, in seconds (+Inf is implicit)
+const double METRIC_BUCKETS_S[] = {1e-6, 5e-6, 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3, 1e-2, 5e-2, 0.1, 0.5, 1, 5};
+const int METRIC_BUCKET_COUNT = sizeof(METRIC_BUCKETS_S) / sizeof(METRIC_BUCKETS_S[0]);
+
+// Client commands without a slot of their own are counted as "other"
+void record_command(const string& command, uint64_t elapsed_ns);
+void record_lock_wait(LockId id, uint64_t wait_ns);
+
+// Append the command and lock histograms in Prometheus text format
+void render_thread_metrics(string& out);
+
+// A mutex that records how long each lock() waited. Uncontended acquisitions take
+// the try_lock fast path and are recorded as zero waits without reading the clock.
+class TimedMutex {
+public:
+    explicit TimedMutex(LockId id) : id(id) {}
+    void lock();
+    bool try_lock() { return m.try_lock(); }
+    void unlock() { m.unlock(); }
+
+private:
+    mutex m;
+    LockId id;
+};
+
+#endif // METRICS_H
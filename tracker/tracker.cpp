@@ -9,50 +9,61 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <random>
+#include <iomanip>
+#include <cmath>
+#include <climits>
+#include <algorithm>
+#include <fstream>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 using namespace std;
 
-#define size_piece 512*1024
 
+// Every reply frame is one newline-terminated line
 void send_response(int sock, const string& msg) {
-    send(sock, msg.c_str(), msg.length(), 0);
+    string frame = msg + "\n";
+    send(sock, frame.c_str(), frame.length(), MSG_NOSIGNAL);
 }
 
-Tracker::Tracker(const string& info_file, int tracker_num) : tracker_id(tracker_num) {
-    int fd = open(info_file.c_str(), O_RDONLY);
-    if (fd < 0) {
-        perror("Failed to open tracker_info.txt");
+// Unguessable session token handed out at login
+static string new_session_token() {
+    static mutex rng_mutex;
+    static random_device rd;
+    lock_guard<mutex> lock(rng_mutex);
+    stringstream ss;
+    ss << hex << setfill('0');
+    for (int i = 0; i < 4; ++i) {
+        ss << setw(8) << rd();
+    }
+    return ss.str();
+}
+
+Tracker::Tracker(const string& info_file, int tracker_num) : tracker_id(tracker_num), tracker_index(tracker_num - 1) {
+    tracker_addresses = load_tracker_addresses(info_file);
+    if (tracker_addresses.empty()) {
+        LOG_ERROR("Failed to read from tracker_info.txt or file is empty.");
         exit(EXIT_FAILURE);
     }
-
-    char buffer[256];
-    ssize_t bytes_read = read(fd, buffer, sizeof(buffer) - 1);
-    close(fd);
-
-    if (bytes_read <= 0) {
-        log_msg("Failed to read from tracker_info.txt or file is empty.");
+    if (tracker_index < 0 || tracker_index >= (int)tracker_addresses.size()) {
+        LOG_ERROR("Tracker number " + to_string(tracker_id) + " is not listed in " + info_file);
         exit(EXIT_FAILURE);
     }
-    buffer[bytes_read] = '\0'; // Null-terminate the buffer to treat it as a string
-
-    stringstream ss(buffer);
-    string line1, line2;
-    getline(ss, line1);
-    getline(ss, line2);
 
-    string my_line = (tracker_id == 1) ? line1 : line2;
-    string other_line = (tracker_id == 1) ? line2 : line1;
-    
+    const string& my_line = tracker_addresses[tracker_index];
     size_t delim_pos = my_line.find(':');
     ip_addr = my_line.substr(0, delim_pos);
     port = stoi(my_line.substr(delim_pos + 1));
-    
-    delim_pos = other_line.find(':');
-    other_tracker_addr = other_line.substr(0, delim_pos);
-    other_tracker_port = stoi(other_line.substr(delim_pos + 1));
+
+    ring = HashRing(tracker_addresses);
+    expiry_wheel.resize(EXPIRY_WHEEL_SLOTS);
+    started_at = chrono::steady_clock::now();
+    sync_stats.reset(new SyncPeerStats[tracker_addresses.size()]);
 
     log_msg("Tracker " + to_string(tracker_id) + " starting at " + ip_addr + ":" + to_string(port));
-    log_msg("Other tracker at " + other_tracker_addr + ":" + to_string(other_tracker_port));
+    log_msg("Cluster has " + to_string(tracker_addresses.size()) + " trackers, replication factor "
+            + to_string(min(TRACKER_REPLICATION_FACTOR, (int)tracker_addresses.size())));
 }
 
 void Tracker::start() {
@@ -82,13 +93,13 @@ void Tracker::start() {
     log_msg("Tracker listening for clients on port " + to_string(port));
 
     thread client_thread(&Tracker::listen_for_clients, this);
-    thread tracker_thread(&Tracker::listen_for_tracker, this);
-    
-    if (tracker_id == 1) {
-        this_thread::sleep_for(chrono::seconds(2));
-        thread connect_thread(&Tracker::connect_to_other_tracker, this);
-        connect_thread.detach();
-    }
+    thread tracker_thread(&Tracker::listen_for_trackers, this);
+    thread connect_thread(&Tracker::connect_to_peer_trackers, this);
+    connect_thread.detach();
+    thread expiry_thread(&Tracker::run_expiry_wheel, this);
+    expiry_thread.detach();
+    thread admin_thread(&Tracker::listen_for_admin, this);
+    admin_thread.detach();
     
     string command;
     cout << "Tracker console running. Type 'quit' to shut down." << endl;
@@ -112,59 +123,106 @@ void Tracker::listen_for_clients() {
         socklen_t client_len = sizeof(client_address);
         int client_socket = accept(server_socket, (struct sockaddr*)&client_address, &client_len);
         if (client_socket < 0) {
-            log_msg("Accept failed or server shut down.");
+            LOG_WARN("Accept failed or server shut down.");
             break;
         }
         char client_ip[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &client_address.sin_addr, client_ip, INET_ADDRSTRLEN);
         
         string client_addr_str(client_ip);
-        log_msg("New client connection from " + client_addr_str);
+        LOG_DEBUG("New client connection from " + client_addr_str);
 
         thread t(&Tracker::handle_client, this, client_socket, client_addr_str);
         t.detach();
     }
 }
 
+// Leaked on purpose: exiting threads hand their cached buffer back after main returns
+static BufferPool& read_buffers() {
+    static BufferPool* pool = new BufferPool(READ_BUFFER_BYTES, READ_BUFFER_POOL_SIZE);
+    return *pool;
+}
+
 void Tracker::handle_client(int client_socket, const string& client_addr) {
-    char buffer[size_piece] = {0};
-    while (read(client_socket, buffer, size_piece) > 0) {
-        string command_str(buffer);
-        auto args = parse(command_str, " ");
-        if (!args.empty()) {
-            process_command(client_socket, client_addr, args);
+    // Commands are newline-terminated, so several may arrive in one read
+    active_clients++;
+    PooledBuffer buffer(read_buffers());
+    string pending;
+    ssize_t bytes_read;
+    while ((bytes_read = read(client_socket, buffer.get(), READ_BUFFER_BYTES)) > 0) {
+        pending.append(buffer.get(), bytes_read);
+        size_t newline;
+        while ((newline = pending.find('\n')) != string::npos) {
+            string command_str = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (!command_str.empty() && command_str.back() == '\r') command_str.pop_back();
+            auto args = parse(command_str, " ");
+            if (!args.empty() && !args[0].empty()) {
+                process_command(client_socket, client_addr, args);
+            }
+        }
+        if (pending.size() > MAX_COMMAND_BYTES) {
+            LOG_WARN("Client " + client_addr + " sent a command longer than " + to_string(MAX_COMMAND_BYTES) + " bytes; closing.");
+            break;
         }
-        memset(buffer, 0, size_piece);
     }
-
+    // Only the connection the user logged in on ends the session; connections that
+    // merely resumed it with a token are just unbound.
     string user_id = get_user_id_from_socket(client_socket);
-    if (!user_id.empty()) {
+    bool was_login_socket;
+    {
+        lock_guard<TimedMutex> lock(socket_to_user_mutex);
+        was_login_socket = login_sockets.erase(client_socket) > 0;
+        if (!was_login_socket) socket_to_user.erase(client_socket);
+    }
+    if (!user_id.empty() && was_login_socket) {
         vector<string> logout_args = {"logout", user_id};
         logout(client_socket, logout_args);
     }
-    log_msg("Client " + client_addr + " disconnected.");
+    LOG_DEBUG("Client " + client_addr + " disconnected.");
     close(client_socket);
+    active_clients--;
 }
 
 void Tracker::process_command(int sock, const string& client_addr, const vector<string>& args) {
     const string& command = args[0];
-    if (command == "create_user") create_user(sock, args);
+
+    // "@<token> <command ...>" binds this connection to an existing session first,
+    // letting a client move to another tracker without replaying its login.
+    if (command.size() > 1 && command[0] == '@') {
+        if (!resume_session(sock, command.substr(1))) {
+            send_response(sock, "error :  Invalid session token");
+            return;
+        }
+        if (args.size() == 1) {
+            send_response(sock, "success Session resumed");
+            return;
+        }
+        process_command(sock, client_addr, vector<string>(args.begin() + 1, args.end()));
+        return;
+    }
+
+    auto started = chrono::steady_clock::now();
+    if (command == "ping") ping(sock, args);
+    else if (command == "create_user") create_user(sock, args);
     else if (command == "login") login(sock, client_addr, args);
     else if (command == "create_group") create_group(sock, args);
     else if (command == "join_group") join_group(sock, args);
     else if (command == "leave_group") leave_group(sock, args);
     else if (command == "list_requests") list_requests(sock, args);
     else if (command == "accept_request") accept_request(sock, args);
-    else if (command == "list_groups") list_groups(sock);
+    else if (command == "list_groups") list_groups(sock, args);
     else if (command == "list_files") list_files(sock, args);
     else if (command == "upload_file") upload_file(sock, args);
     else if (command == "download_file") download_file(sock, args);
     else if (command == "logout") logout(sock, args);
     else if (command == "stop_share") stop_share(sock, args);
     else if (command == "i_am_seeder") i_am_seeder(sock, args);
+    else if (command == "batch") batch(sock, args);
     else {
         send_response(sock, "error : Invalid command");
     }
+    record_command(command, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
 }
 
 // --- Command Handler Implementations ---
@@ -177,7 +235,7 @@ void Tracker::create_user(int sock, const vector<string>& args) {
     const string& user_id = args[1];
     const string& password = args[2];
 
-    lock_guard<mutex> lock(users_mutex);
+    lock_guard<TimedMutex> lock(users_mutex);
     if (users.count(user_id)) {
         send_response(sock, "error : User already exists");
     } else {
@@ -197,9 +255,9 @@ void Tracker::login(int sock, const string& client_addr_str, const vector<string
     const string& password = args[2];
     const string& client_port = args[3];
 
-    lock_guard<mutex> user_lock(users_mutex);
-    lock_guard<mutex> session_lock(logged_in_users_mutex);
-    lock_guard<mutex> socket_lock(socket_to_user_mutex);
+    lock_guard<TimedMutex> user_lock(users_mutex);
+    lock_guard<TimedMutex> session_lock(logged_in_users_mutex);
+    lock_guard<TimedMutex> socket_lock(socket_to_user_mutex);
 
     if (users.find(user_id) == users.end() || users.at(user_id) != password) {
         send_response(sock, "error :  Invalid credentials");
@@ -217,15 +275,23 @@ void Tracker::login(int sock, const string& client_addr_str, const vector<string
         }
         if (old_sock != -1) {
             socket_to_user.erase(old_sock);
+            login_sockets.erase(old_sock);
         }
     }
 
     string client_full_addr = client_addr_str + ":" + client_port;
     logged_in_users[user_id] = client_full_addr;
     socket_to_user[sock] = user_id;
-    send_response(sock, "success Login successful");
+    login_sockets.insert(sock);
+
+    // One live token per user; replicated so that every tracker accepts it
+    drop_session_tokens(user_id);
+    string token = new_session_token();
+    session_tokens[token] = user_id;
+
+    send_response(sock, "success Login successful session=" + token);
     log_msg("User " + user_id + " logged in from " + client_full_addr);
-    send_sync_message("synced_LOGIN " + user_id + " " + client_full_addr);
+    send_sync_message("synced_LOGIN " + user_id + " " + client_full_addr + " " + token);
 }
 
 void Tracker::logout(int sock, const vector<string>& args) {
@@ -244,20 +310,23 @@ void Tracker::logout(int sock, const vector<string>& args) {
     string user_addr = get_address_from_user_id(user_id);
 
     {
-        lock_guard<mutex> session_lock(logged_in_users_mutex);
-        lock_guard<mutex> socket_lock(socket_to_user_mutex);
+        lock_guard<TimedMutex> session_lock(logged_in_users_mutex);
+        lock_guard<TimedMutex> socket_lock(socket_to_user_mutex);
         logged_in_users.erase(user_id);
         socket_to_user.erase(sock);
+        login_sockets.erase(sock);
+        drop_session_tokens(user_id);
     }
     
     {
-        lock_guard<mutex> group_lock(groups_mutex);
+        lock_guard<TimedMutex> group_lock(groups_mutex);
         for (auto& group_pair : groups) {
             for (auto& file_pair : group_pair.second.files) {
-                file_pair.second.seeders.erase(user_addr);
+                remove_seeder(file_pair.second, user_addr);
             }
         }
     }
+    forget_seeder(user_addr);
 
     send_response(sock, "success Logout successful");
     log_msg("User " + user_id + " logged out.");
@@ -275,8 +344,9 @@ void Tracker::create_group(int sock, const vector<string>& args) {
         return;
     }
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
     
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if(groups.count(group_id)) {
         send_response(sock, "error :  Group already exists.");
         return;
@@ -289,7 +359,7 @@ void Tracker::create_group(int sock, const vector<string>& args) {
     groups[group_id] = new_group;
 
     send_response(sock, "success Group created.");
-    send_sync_message("synced_CREATE_GROUP " + group_id + " " + user_id);
+    send_group_sync_message(group_id, "synced_CREATE_GROUP " + group_id + " " + user_id);
 }
 
 void Tracker::join_group(int sock, const vector<string>& args) {
@@ -303,8 +373,9 @@ void Tracker::join_group(int sock, const vector<string>& args) {
         return;
     }
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
 
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if(!groups.count(group_id)) {
         send_response(sock, "error :  Group does not exist.");
         return;
@@ -317,7 +388,7 @@ void Tracker::join_group(int sock, const vector<string>& args) {
 
     group.pending_requests.insert(user_id);
     send_response(sock, "success Join request sent.");
-    send_sync_message("synced_JOIN_GROUP " + group_id + " " + user_id);
+    send_group_sync_message(group_id, "synced_JOIN_GROUP " + group_id + " " + user_id);
 }
 
 void Tracker::leave_group(int sock, const vector<string>& args) {
@@ -331,8 +402,9 @@ void Tracker::leave_group(int sock, const vector<string>& args) {
         return;
     }
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
     
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if(!groups.count(group_id)) {
         send_response(sock, "error :  Group does not exist.");
         return;
@@ -345,7 +417,7 @@ void Tracker::leave_group(int sock, const vector<string>& args) {
     
     group.members.erase(user_id);
     send_response(sock, "success You have left the group.");
-    send_sync_message("synced_LEAVE_GROUP " + group_id + " " + user_id);
+    send_group_sync_message(group_id, "synced_LEAVE_GROUP " + group_id + " " + user_id);
 }
 
 
@@ -360,8 +432,9 @@ void Tracker::list_requests(int sock, const vector<string>& args) {
         return;
     }
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
 
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if(!groups.count(group_id)) {
         send_response(sock, "error :  Group does not exist.");
         return;
@@ -394,9 +467,10 @@ void Tracker::accept_request(int sock, const vector<string>& args) {
         return;
     }
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
     const string& user_to_accept = args[2];
 
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if (!groups.count(group_id)) {
         send_response(sock, "error :  Group does not exist.");
         return;
@@ -414,44 +488,189 @@ void Tracker::accept_request(int sock, const vector<string>& args) {
     group.pending_requests.erase(user_to_accept);
     group.members.insert(user_to_accept);
     send_response(sock, "success User added to group.");
-    send_sync_message("synced_ACCEPT_REQUEST " + group_id + " " + user_to_accept);
+    send_group_sync_message(group_id, "synced_ACCEPT_REQUEST " + group_id + " " + user_to_accept);
 }
 
-void Tracker::list_groups(int sock) {
-    lock_guard<mutex> lock(groups_mutex);
-    string response = "success ";
-    if (groups.empty()) {
-        response += "No groups available.";
-    } else {
-        for (const auto& pair : groups) {
-            response += pair.first + " ";
+// Parse "prefix=<p> contains=<s> after=<cursor> limit=<n>" options starting at args[first]
+static bool parse_list_query(const vector<string>& args, size_t first, ListQuery& query) {
+    for (size_t i = first; i < args.size(); ++i) {
+        const string& option = args[i];
+        if (option.compare(0, 7, "prefix=") == 0) query.prefix = option.substr(7);
+        else if (option.compare(0, 9, "contains=") == 0) query.contains = option.substr(9);
+        else if (option.compare(0, 6, "after=") == 0) query.after = option.substr(6);
+        else if (option.compare(0, 6, "limit=") == 0) {
+            const char* digits = option.c_str() + 6;
+            char* end;
+            query.limit = strtoul(digits, &end, 10);
+            if (*digits < '0' || *digits > '9' || *end != '\0') return false;
         }
+        else return false;
     }
-    send_response(sock, response);
+    return true;
+}
+
+// Collect the next names of an ordered catalog that match `query`, strictly after `cursor`.
+// The map itself is the index: a prefix query starts at lower_bound(prefix) and stops as
+// soon as names no longer share the prefix. At most LIST_SCAN_BUDGET entries are examined
+// so that substring searches over huge catalogs only hold the lock for a bounded time.
+template <typename Catalog>
+static void collect_page(const Catalog& catalog, const ListQuery& query, size_t max_names,
+                         string& cursor, vector<string>& page, bool& done) {
+    auto it = cursor.empty() ? catalog.begin() : catalog.upper_bound(cursor);
+    if (!query.prefix.empty() && (it == catalog.end() || it->first < query.prefix)) {
+        it = catalog.lower_bound(query.prefix);
+    }
+
+    done = false;
+    size_t added = 0;
+    for (size_t scanned = 0; scanned < LIST_SCAN_BUDGET && added < max_names; ++scanned, ++it) {
+        if (it == catalog.end() || it->first.compare(0, query.prefix.size(), query.prefix) != 0) {
+            done = true;
+            return;
+        }
+        cursor = it->first;
+        if (query.contains.empty() || it->first.find(query.contains) != string::npos) {
+            page.push_back(it->first);
+            ++added;
+        }
+    }
+    if (it == catalog.end()) done = true;
+}
+
+void Tracker::stream_listing(int sock, const ListQuery& query, const string& empty_message,
+                             const function<bool(size_t, string&, vector<string>&, bool&)>& next_page) {
+    // Replies are sent as "+ <names...>" frames followed by a final "success <names...>"
+    // line. groups_mutex is only held while one frame is collected, and if a limit stops
+    // the listing early, a "= next <cursor>" frame tells the client where to resume.
+    string cursor = query.after;
+    size_t sent = 0;
+    vector<string> page;
+    while (true) {
+        size_t max_names = LIST_FRAME_NAMES - page.size();
+        if (query.limit > 0) max_names = min(max_names, query.limit - sent - page.size());
+
+        bool done = false;
+        if (!next_page(max_names, cursor, page, done)) {
+            send_response(sock, "error :  Group does not exist.");
+            return;
+        }
+        bool limit_reached = query.limit > 0 && sent + page.size() >= query.limit;
+
+        if (done || limit_reached) {
+            if (limit_reached && !done) {
+                send_response(sock, "= next " + cursor);
+            }
+            string response = "success ";
+            if (sent == 0 && page.empty()) {
+                response += empty_message;
+            }
+            for (const auto& name : page) {
+                response += name + " ";
+            }
+            send_response(sock, response);
+            return;
+        }
+
+        if (page.size() >= LIST_FRAME_NAMES) {
+            string frame = "+";
+            for (const auto& name : page) {
+                frame += " " + name;
+            }
+            send_response(sock, frame);
+            sent += page.size();
+            page.clear();
+        }
+    }
+}
+
+void Tracker::list_groups(int sock, const vector<string>& args) {
+    ListQuery query;
+    if (!parse_list_query(args, 1, query)) {
+        send_response(sock, "error :  Usage: list_groups [prefix=<p>] [contains=<s>] [after=<group_id>] [limit=<n>]");
+        return;
+    }
+
+    stream_listing(sock, query, "No groups available.", [&](size_t max_names, string& cursor, vector<string>& page, bool& done) {
+        lock_guard<TimedMutex> lock(groups_mutex);
+        collect_page(groups, query, max_names, cursor, page, done);
+        return true;
+    });
 }
 
 void Tracker::list_files(int sock, const vector<string>& args) {
-    if (args.size() != 2) {
-        send_response(sock, "error :  Usage: list_files <group_id>");
+    ListQuery query;
+    if (args.size() < 2 || !parse_list_query(args, 2, query)) {
+        send_response(sock, "error :  Usage: list_files <group_id> [prefix=<p>] [contains=<s>] [after=<file_name>] [limit=<n>]");
         return;
     }
     const string& group_id = args[1];
-    
-    lock_guard<mutex> lock(groups_mutex);
-    if (!groups.count(group_id)) {
-        send_response(sock, "error :  Group does not exist.");
-        return;
+    if (!require_hosted_group(sock, group_id)) return;
+
+    stream_listing(sock, query, "No files in this group.", [&](size_t max_names, string& cursor, vector<string>& page, bool& done) {
+        lock_guard<TimedMutex> lock(groups_mutex);
+        auto it = groups.find(group_id);
+        if (it == groups.end()) return false;
+        collect_page(it->second.files, query, max_names, cursor, page, done);
+        return true;
+    });
+}
+
+// An uploaded "weak=" list must hold one hex rolling checksum per piece: clients
+// parse it on every download_file
+static bool valid_weak_checksums(const string& checksums, size_t pieces) {
+    if (checksums.empty()) return true;
+    vector<string> entries = parse(checksums, ",");
+    if (entries.size() != pieces) return false;
+    for (const auto& entry : entries) {
+        if (entry.empty() || entry.size() > 8) return false;
+        for (char c : entry) {
+            if (!isxdigit((unsigned char)c)) return false;
+        }
     }
-    const auto& files = groups.at(group_id).files;
-    string response = "success ";
-    if (files.empty()) {
-        response += "No files in this group.";
-    } else {
-        for (const auto& pair : files) {
-            response += pair.first + " ";
+    return true;
+}
+
+// "<escaped path>:<size>,..." with %XX escapes and sizes that add up to total_size
+static bool valid_bundle_manifest(const string& manifest, long long total_size) {
+    long long sum = 0;
+    for (const auto& entry : parse(manifest, ",")) {
+        size_t colon = entry.rfind(':');
+        if (colon == string::npos || colon == 0 || colon + 1 == entry.size()) return false;
+        for (size_t i = 0; i < colon; ++i) {
+            if (entry[i] == '%' && (i + 2 >= colon || !isxdigit((unsigned char)entry[i + 1]) ||
+                                    !isxdigit((unsigned char)entry[i + 2]))) {
+                return false;
+            }
         }
+        if (entry[colon + 1] < '0' || entry[colon + 1] > '9') return false;
+        char* size_end;
+        long long size = strtoll(entry.c_str() + colon + 1, &size_end, 10);
+        if (*size_end != '\0' || size > total_size - sum) return false;
+        sum += size;
     }
-    send_response(sock, response);
+    return sum == total_size;
+}
+
+// Consume the optional trailing "weak=<c0,c1,...>" (rolling checksums for delta
+// downloads) and "bundle=<manifest>" (files packed into the piece space) arguments
+// of an upload whose piece hashes start at first_hash and that end before `end`;
+// file.file_size must already be set. Moves `end` to where the piece hashes end.
+// False if the manifest is malformed.
+static bool take_file_options(const vector<string>& args, size_t first_hash, size_t& end, FileInfo& file) {
+    file.weak_checksums.clear();
+    file.bundle_manifest.clear();
+    while (end > first_hash) {
+        const string& arg = args[end - 1];
+        if (arg.compare(0, 5, "weak=") == 0) {
+            file.weak_checksums = arg.substr(5);
+        } else if (arg.compare(0, 7, "bundle=") == 0) {
+            file.bundle_manifest = arg.substr(7);
+        } else {
+            break;
+        }
+        --end;
+    }
+    return file.bundle_manifest.empty() || valid_bundle_manifest(file.bundle_manifest, file.file_size);
 }
 
 void Tracker::upload_file(int sock, const vector<string>& args) {
@@ -467,9 +686,10 @@ void Tracker::upload_file(int sock, const vector<string>& args) {
     }
 
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
     const string& filename = args[2];
     
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if (groups.find(group_id) == groups.end()) {
         send_response(sock, "error :  Group does not exist.");
         return;
@@ -486,9 +706,18 @@ void Tracker::upload_file(int sock, const vector<string>& args) {
     new_file.file_size = stoll(args[3]);
     new_file.file_hash = args[4];
     
-    for (size_t i = 5; i < args.size(); ++i) {
+    size_t hashes_end = args.size();
+    if (!take_file_options(args, 5, hashes_end, new_file)) {
+        send_response(sock, "error :  Invalid bundle manifest.");
+        return;
+    }
+    for (size_t i = 5; i < hashes_end; ++i) {
         new_file.piece_hashes[i-5] = args[i];
     }
+    if (!valid_weak_checksums(new_file.weak_checksums, new_file.piece_hashes.size())) {
+        send_response(sock, "error :  weak= must hold one hex checksum per piece.");
+        return;
+    }
 
     string client_addr = get_address_from_user_id(user_id);
     if(client_addr.empty()) {
@@ -496,8 +725,8 @@ void Tracker::upload_file(int sock, const vector<string>& args) {
         return;
     }
     new_file.seeders.insert(client_addr);
-
-    group.files[filename] = new_file;
+    touch_seeder(client_addr);
+    store_file(group_id, group, new_file);
     
     send_response(sock, "success File uploaded successfully.");
     log_msg("File " + filename + " uploaded to group " + group_id + " by " + user_id);
@@ -508,12 +737,14 @@ void Tracker::upload_file(int sock, const vector<string>& args) {
         sync_msg_stream << " " << args[i];
     }
     sync_msg_stream << " " << client_addr;
-    send_sync_message(sync_msg_stream.str());
+    send_group_sync_message(group_id, sync_msg_stream.str());
 }
 
 void Tracker::download_file(int sock, const vector<string>& args) {
-    if (args.size() != 3) {
-        send_response(sock, "error :  Usage: download_file <group_id> <file_name>");
+    // An optional known_file_hash lets a client with cached metadata revalidate it:
+    // if the file is unchanged only the current seeders are sent back.
+    if (args.size() != 3 && args.size() != 4) {
+        send_response(sock, "error :  Usage: download_file <group_id> <file_name> [known_file_hash]");
         return;
     }
     string user_id = get_user_id_from_socket(sock);
@@ -523,9 +754,10 @@ void Tracker::download_file(int sock, const vector<string>& args) {
     }
 
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
     const string& filename = args[2];
 
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if (!groups.count(group_id)) {
         send_response(sock, "error :  Group does not exist.");
         return;
@@ -541,28 +773,148 @@ void Tracker::download_file(int sock, const vector<string>& args) {
     }
 
     FileInfo& file = group.files.at(filename);
-    if (file.seeders.empty()) {
+    string alternates = partial_sources(group_id, file);
+    if (file.seeders.empty() && alternates.empty()) {
         send_response(sock, "error :  No seeders available for this file.");
         return;
     }
 
-    string hashes_log = "Sending piece hashes for " + filename + " to " + user_id + ":";
-    for (size_t i = 0; i < file.piece_hashes.size(); ++i) {
-        hashes_log += " " + file.piece_hashes.at(i);
+    if (args.size() == 4 && args[3] == file.file_hash) {
+        stringstream response;
+        response << "success unchanged";
+        for (const auto& seeder : select_seeders(file.seeders)) {
+            response << " " << seeder;
+        }
+        response << alternates;
+        send_response(sock, response.str());
+        return;
     }
-    log_msg(hashes_log);
+
+    LOG_DEBUG("Sending " + to_string(file.piece_hashes.size()) + " piece hashes for " + filename + " to " + user_id);
 
     stringstream response;
     response << "success " << file.file_size << " " << file.file_hash;
     for (size_t i = 0; i < file.piece_hashes.size(); ++i) {
         response << " " << file.piece_hashes.at(i);
     }
-    for (const auto& seeder : file.seeders) {
+    for (const auto& seeder : select_seeders(file.seeders)) {
         response << " " << seeder;
     }
+    response << alternates;
+    if (!file.weak_checksums.empty()) {
+        response << " weak " << file.weak_checksums;
+    }
+    if (!file.bundle_manifest.empty()) {
+        response << " bundle " << file.bundle_manifest;
+    }
     send_response(sock, response.str());
 }
 
+// file must be the copy stored in groups. A piece counts as shared once its hash has
+// a second holder, so only the 1 -> 2 and 2 -> 1 transitions touch another file.
+void Tracker::index_file_pieces(const string& group_id, FileInfo& file) {
+    file.shared_pieces = 0;
+    for (const auto& piece : file.piece_hashes) {
+        set<PieceRef>& refs = piece_index[piece.second];
+        if (refs.size() == 1) count_shared_piece(*refs.begin(), 1);
+        if (!refs.empty()) file.shared_pieces++;
+        refs.insert(PieceRef{group_id, file.filename, piece.first});
+    }
+}
+
+void Tracker::unindex_file_pieces(const string& group_id, FileInfo& file) {
+    for (const auto& piece : file.piece_hashes) {
+        auto it = piece_index.find(piece.second);
+        if (it == piece_index.end()) continue;
+        it->second.erase(PieceRef{group_id, file.filename, piece.first});
+        if (it->second.size() == 1) count_shared_piece(*it->second.begin(), -1);
+        if (it->second.empty()) piece_index.erase(it);
+    }
+    file.shared_pieces = 0;
+}
+
+void Tracker::count_shared_piece(const PieceRef& ref, int delta) {
+    auto group = groups.find(ref.group_id);
+    if (group == groups.end()) return;
+    auto file = group->second.files.find(ref.filename);
+    if (file != group->second.files.end()) file->second.shared_pieces += delta;
+}
+
+// Add or replace a file of group, keeping the piece index and catalog counts in step
+FileInfo& Tracker::store_file(const string& group_id, Group& group, const FileInfo& file) {
+    auto existing = group.files.find(file.filename);
+    if (existing != group.files.end()) {
+        unindex_file_pieces(group_id, existing->second);
+        seeder_entry_count -= existing->second.seeders.size();
+    } else {
+        file_count++;
+    }
+    FileInfo& stored = group.files[file.filename];
+    stored = file;
+    index_file_pieces(group_id, stored);
+    seeder_entry_count += stored.seeders.size();
+    return stored;
+}
+
+void Tracker::add_seeder(FileInfo& file, const string& seeder_addr) {
+    if (file.seeders.insert(seeder_addr).second) seeder_entry_count++;
+}
+
+void Tracker::remove_seeder(FileInfo& file, const string& seeder_addr) {
+    if (file.seeders.erase(seeder_addr)) seeder_entry_count--;
+}
+
+string Tracker::partial_sources(const string& group_id, const FileInfo& file) {
+    // Seeders of other hosted files - in any group - that hold pieces with the same
+    // content as this file, as " alt <addr> <ranges>" entries where ranges lists the
+    // indices of *this* file they can serve ("0-99,120"). Peers serve pieces by hash,
+    // so the leecher can fetch them without knowing the other file. Only addresses are
+    // revealed: the content is what the requester is already entitled to.
+    // Caller holds groups_mutex.
+    if (file.shared_pieces == 0) return "";
+    size_t total_pieces = file.piece_hashes.size();
+    map<string, vector<bool>> coverage;
+    for (const auto& piece : file.piece_hashes) {
+        auto it = piece_index.find(piece.second);
+        if (it == piece_index.end() || it->second.size() < 2) continue;
+        size_t refs_seen = 0;
+        for (const auto& ref : it->second) {
+            if (ref.group_id == group_id && ref.filename == file.filename) continue;
+            if (++refs_seen > ALT_REFS_PER_PIECE) break;
+            const FileInfo& other = groups.at(ref.group_id).files.at(ref.filename);
+            for (const auto& seeder : other.seeders) {
+                if (file.seeders.count(seeder)) continue;
+                if (!coverage.count(seeder) && coverage.size() >= ALT_CANDIDATE_LIMIT) continue;
+                vector<bool>& covered = coverage[seeder];
+                if (covered.empty()) covered.resize(total_pieces, false);
+                covered[piece.first] = true;
+            }
+        }
+    }
+    if (coverage.empty()) return "";
+
+    set<string> candidates;
+    for (const auto& entry : coverage) candidates.insert(entry.first);
+
+    stringstream out;
+    for (const auto& seeder : select_seeders(candidates)) {
+        const vector<bool>& covered = coverage.at(seeder);
+        out << " alt " << seeder << " ";
+        bool first = true;
+        for (size_t i = 0; i < total_pieces; ++i) {
+            if (!covered[i]) continue;
+            size_t end = i;
+            while (end + 1 < total_pieces && covered[end + 1]) ++end;
+            if (!first) out << ",";
+            out << i;
+            if (end > i) out << "-" << end;
+            first = false;
+            i = end;
+        }
+    }
+    return out.str();
+}
+
 void Tracker::stop_share(int sock, const vector<string>& args) {
     if (args.size() != 3) {
         send_response(sock, "error :  Usage: stop_share <group_id> <file_name>");
@@ -575,40 +927,304 @@ void Tracker::stop_share(int sock, const vector<string>& args) {
     }
     
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
     const string& filename = args[2];
     string user_addr = get_address_from_user_id(user_id);
     
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if (groups.count(group_id) && groups.at(group_id).files.count(filename)) {
-        groups.at(group_id).files.at(filename).seeders.erase(user_addr);
+        remove_seeder(groups.at(group_id).files.at(filename), user_addr);
         send_response(sock, "success No longer sharing file.");
-        send_sync_message("synced_STOP_SHARE " + group_id + " " + filename + " " + user_addr);
+        send_group_sync_message(group_id, "synced_STOP_SHARE " + group_id + " " + filename + " " + user_addr);
     } else {
         send_response(sock, "error File or group not found.");
     }
 }
 
 void Tracker::i_am_seeder(int sock, const vector<string>& args) {
-    if (args.size() != 3) return; // i_am_seeder <group_id> <filename>
+    // Always answer: the client waits for a reply to every command it sends
+    if (args.size() != 3) {
+        send_response(sock, "error :  Usage: i_am_seeder <group_id> <file_name>");
+        return;
+    }
     string user_id = get_user_id_from_socket(sock);
-    if (user_id.empty()) return;
+    if (user_id.empty()) {
+        send_response(sock, "error :  Not logged in.");
+        return;
+    }
 
     const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
     const string& filename = args[2];
     string seeder_addr = get_address_from_user_id(user_id);
-    if (seeder_addr.empty()) return;
+    if (seeder_addr.empty()) {
+        send_response(sock, "error :  Could not find your address info.");
+        return;
+    }
 
-    lock_guard<mutex> lock(groups_mutex);
+    lock_guard<TimedMutex> lock(groups_mutex);
     if(groups.count(group_id) && groups.at(group_id).files.count(filename)) {
-        groups.at(group_id).files.at(filename).seeders.insert(seeder_addr);
+        add_seeder(groups.at(group_id).files.at(filename), seeder_addr);
+        touch_seeder(seeder_addr);
+        send_response(sock, "success Registered as seeder.");
         log_msg("User " + user_id + " is now a seeder for " + filename);
-        send_sync_message("synced_ADD_SEEDER " + group_id + " " + filename + " " + seeder_addr);
+        send_group_sync_message(group_id, "synced_ADD_SEEDER " + group_id + " " + filename + " " + seeder_addr);
+    } else {
+        send_response(sock, "error File or group not found.");
+    }
+}
+
+// The items of a batch, separated by ";" arguments
+static vector<vector<string>> split_batch_items(const vector<string>& args, size_t first) {
+    vector<vector<string>> items(1);
+    for (size_t i = first; i < args.size(); ++i) {
+        if (args[i] == ";") items.emplace_back();
+        else items.back().push_back(args[i]);
+    }
+    return items;
+}
+
+void Tracker::batch(int sock, const vector<string>& args) {
+    // batch <group_id> <item> [; <item>]...: many upload_file, i_am_seeder and stop_share
+    // commands of one group in one round trip, e.g. a client announcing everything it
+    // seeds after a restart. Each item is the command without its group_id. The reply
+    // has one result per item: ok, missing (no such file), denied (not a member) or
+    // invalid. The applied items are replicated as one synced_BATCH message.
+    if (args.size() < 3) {
+        send_response(sock, "error :  Usage: batch <group_id> <command> <args...> [; <command> <args...>]...");
+        return;
+    }
+    string user_id = get_user_id_from_socket(sock);
+    if (user_id.empty()) {
+        send_response(sock, "error :  Not logged in.");
+        return;
+    }
+
+    const string& group_id = args[1];
+    if (!require_hosted_group(sock, group_id)) return;
+    auto items = split_batch_items(args, 2);
+    if (items.size() > BATCH_MAX_ITEMS) {
+        send_response(sock, "error :  A batch may carry at most " + to_string(BATCH_MAX_ITEMS) + " items.");
+        return;
+    }
+    string seeder_addr = get_address_from_user_id(user_id);
+    if (seeder_addr.empty()) {
+        send_response(sock, "error :  Could not find your address info.");
+        return;
+    }
+
+    lock_guard<TimedMutex> lock(groups_mutex);
+    auto it = groups.find(group_id);
+    if (it == groups.end()) {
+        send_response(sock, "error :  Group does not exist.");
+        return;
+    }
+    bool member = it->second.members.count(user_id) > 0;
+    string results;
+    int applied = 0;
+    stringstream sync_msg_stream;
+    sync_msg_stream << "synced_BATCH " << group_id << " " << seeder_addr;
+    for (const auto& item : items) {
+        string result = item.empty() ? "invalid" : apply_batch_item(group_id, it->second, item, seeder_addr, member);
+        results += " " + result;
+        if (result != "ok") continue;
+        if (applied++ > 0) sync_msg_stream << " ;";
+        for (const auto& arg : item) sync_msg_stream << " " << arg;
+    }
+    if (applied > 0) touch_seeder(seeder_addr);
+
+    send_response(sock, "success batch " + to_string(applied) + "/" + to_string(items.size()) + results);
+    if (applied > 0) {
+        log_msg("Applied " + to_string(applied) + " of " + to_string(items.size()) + " batched commands of " +
+                user_id + " in group " + group_id);
+        send_group_sync_message(group_id, sync_msg_stream.str());
+    }
+}
+
+// Apply one batch item for seeder_addr: "upload_file <file_name> <size> <file_hash>
+// <piece hashes...> [weak=...] [bundle=...]", "i_am_seeder <file_name>" or
+// "stop_share <file_name>". Called with groups_mutex held, by the tracker that got the
+// batch and by the replicas it syncs to.
+string Tracker::apply_batch_item(const string& group_id, Group& group, const vector<string>& item,
+                                 const string& seeder_addr, bool member) {
+    const string& op = item[0];
+    if (op == "upload_file" && item.size() >= 4) {
+        if (!member) return "denied";
+        char* size_end;
+        long long file_size = strtoll(item[2].c_str(), &size_end, 10);
+        if (item[2].empty() || *size_end != '\0' || file_size < 0) return "invalid";
+
+        FileInfo new_file;
+        new_file.filename = item[1];
+        new_file.file_size = file_size;
+        new_file.file_hash = item[3];
+        size_t hashes_end = item.size();
+        if (!take_file_options(item, 4, hashes_end, new_file)) return "invalid";
+        for (size_t i = 4; i < hashes_end; ++i) {
+            new_file.piece_hashes[i-4] = item[i];
+        }
+        if (!valid_weak_checksums(new_file.weak_checksums, new_file.piece_hashes.size())) return "invalid";
+        new_file.seeders.insert(seeder_addr);
+        store_file(group_id, group, new_file);
+        return "ok";
+    }
+    if ((op == "i_am_seeder" || op == "stop_share") && item.size() == 2) {
+        auto file = group.files.find(item[1]);
+        if (file == group.files.end()) return "missing";
+        if (op == "i_am_seeder") add_seeder(file->second, seeder_addr);
+        else remove_seeder(file->second, seeder_addr);
+        return "ok";
+    }
+    return "invalid";
+}
+
+void Tracker::ping(int sock, const vector<string>& args) {
+    // ping [<active_uploads> <spare_kbps>]: heartbeat, optionally carrying seeder load.
+    // A load that does not parse is ignored and answered like a plain ping.
+    bool has_load = false;
+    long active_uploads = 0;
+    long long spare_kbps = 0;
+    if (args.size() == 3 && !args[1].empty() && !args[2].empty()) {
+        char* uploads_end;
+        char* kbps_end;
+        active_uploads = strtol(args[1].c_str(), &uploads_end, 10);
+        spare_kbps = strtoll(args[2].c_str(), &kbps_end, 10);
+        has_load = *uploads_end == '\0' && *kbps_end == '\0' &&
+                   active_uploads >= 0 && active_uploads <= INT_MAX && spare_kbps >= 0;
+    }
+    if (has_load) {
+        string user_id = get_user_id_from_socket(sock);
+        string seeder_addr = user_id.empty() ? "" : get_address_from_user_id(user_id);
+        if (!seeder_addr.empty()) {
+            bool tracked;
+            {
+                lock_guard<TimedMutex> lock(seeders_mutex);
+                tracked = seeder_last_seen.count(seeder_addr) > 0;
+                SeederLoad& load = seeder_loads[seeder_addr];
+                load.active_uploads = active_uploads;
+                load.spare_kbps = spare_kbps;
+                load.reported_at = chrono::steady_clock::now();
+            }
+            touch_seeder(seeder_addr);
+            if (!tracked) {
+                // We may have evicted this seeder; ask it to announce its files again
+                send_response(sock, "success pong rejoin");
+                return;
+            }
+        }
+    }
+    send_response(sock, "success pong");
+}
+
+// --- Seeder Liveness ---
+void Tracker::touch_seeder(const string& seeder_addr) {
+    // Only reschedule when the expiry moves to a new slot; the old wheel entry is left
+    // in place and skipped when it fires because seeder_expiry no longer matches it.
+    lock_guard<TimedMutex> lock(seeders_mutex);
+    long long expiry = wheel_tick + SEEDER_TIMEOUT_S;
+    seeder_last_seen[seeder_addr] = wheel_tick;
+    auto it = seeder_expiry.find(seeder_addr);
+    if (it != seeder_expiry.end() && it->second == expiry) return;
+    seeder_expiry[seeder_addr] = expiry;
+    expiry_wheel[expiry % EXPIRY_WHEEL_SLOTS].push_back(seeder_addr);
+}
+
+// After a logout the address seeds nothing, so its next loaded ping must be told to
+// rejoin. The wheel entry is left in place and skipped when it fires.
+void Tracker::forget_seeder(const string& seeder_addr) {
+    lock_guard<TimedMutex> lock(seeders_mutex);
+    seeder_last_seen.erase(seeder_addr);
+    seeder_expiry.erase(seeder_addr);
+    seeder_loads.erase(seeder_addr);
+}
+
+void Tracker::run_expiry_wheel() {
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(1));
+
+        vector<string> expired;
+        {
+            lock_guard<TimedMutex> lock(seeders_mutex);
+            ++wheel_tick;
+            vector<string> due;
+            due.swap(expiry_wheel[wheel_tick % EXPIRY_WHEEL_SLOTS]);
+            for (const auto& seeder_addr : due) {
+                auto it = seeder_expiry.find(seeder_addr);
+                if (it == seeder_expiry.end() || it->second != wheel_tick) continue; // refreshed since
+                seeder_expiry.erase(it);
+                seeder_last_seen.erase(seeder_addr);
+                seeder_loads.erase(seeder_addr);
+                expired.push_back(seeder_addr);
+            }
+        }
+
+        for (const auto& seeder_addr : expired) {
+            log_msg("Seeder " + seeder_addr + " missed its heartbeats for " + to_string(SEEDER_TIMEOUT_S) + "s. Evicting.");
+            evict_seeder(seeder_addr);
+            send_sync_message("synced_EVICT_SEEDER " + seeder_addr);
+        }
+    }
+}
+
+void Tracker::evict_seeder(const string& seeder_addr) {
+    lock_guard<TimedMutex> lock(groups_mutex);
+    for (auto& group_pair : groups) {
+        for (auto& file_pair : group_pair.second.files) {
+            remove_seeder(file_pair.second, seeder_addr);
+        }
     }
 }
 
 // --- Helper Methods ---
+vector<string> Tracker::select_seeders(const set<string>& seeders) {
+    // Weighted sampling without replacement (Efraimidis-Spirakis): every seeder gets the
+    // key u^(1/w) and the SEEDER_REPLY_LIMIT largest keys win. The weight favours spare
+    // upload bandwidth and few active uploads; seeders without a recent report are
+    // weighted like an average reporting seeder. Randomising keeps new leechers from all
+    // starting on the same peer.
+    static thread_local mt19937 rng(random_device{}());
+    uniform_real_distribution<double> uniform(1e-12, 1.0);
+
+    auto now = chrono::steady_clock::now();
+    vector<double> weights;
+    double known_total = 0;
+    int known_count = 0;
+    {
+        lock_guard<TimedMutex> lock(seeders_mutex);
+        for (const auto& seeder : seeders) {
+            double weight = -1;
+            auto it = seeder_loads.find(seeder);
+            if (it != seeder_loads.end() && now - it->second.reported_at < chrono::milliseconds(SEEDER_LOAD_TTL_MS)) {
+                weight = (1.0 + it->second.spare_kbps) / (1.0 + it->second.active_uploads);
+                known_total += weight;
+                ++known_count;
+            }
+            weights.push_back(weight);
+        }
+    }
+    double default_weight = known_count > 0 ? known_total / known_count : 1.0;
+
+    // log(u)/w orders seeders exactly like u^(1/w) without losing precision for large w
+    vector<pair<double, string>> keyed;
+    size_t i = 0;
+    for (const auto& seeder : seeders) {
+        double weight = weights[i] > 0 ? weights[i] : default_weight;
+        keyed.push_back(make_pair(log(uniform(rng)) / weight, seeder));
+        ++i;
+    }
+    size_t count = min(SEEDER_REPLY_LIMIT, keyed.size());
+    partial_sort(keyed.begin(), keyed.begin() + count, keyed.end(), greater<pair<double, string>>());
+
+    vector<string> selected;
+    for (size_t k = 0; k < count; ++k) {
+        selected.push_back(keyed[k].second);
+    }
+    return selected;
+}
+
+
 string Tracker::get_user_id_from_socket(int sock) {
-    lock_guard<mutex> lock(socket_to_user_mutex);
+    lock_guard<TimedMutex> lock(socket_to_user_mutex);
     if (socket_to_user.count(sock)) {
         return socket_to_user.at(sock);
     }
@@ -616,16 +1232,48 @@ string Tracker::get_user_id_from_socket(int sock) {
 }
 
 string Tracker::get_address_from_user_id(const string& user_id) {
-    lock_guard<mutex> lock(logged_in_users_mutex);
+    lock_guard<TimedMutex> lock(logged_in_users_mutex);
     if(logged_in_users.count(user_id)) {
         return logged_in_users.at(user_id);
     }
     return "";
 }
 
+void Tracker::drop_session_tokens(const string& user_id) {
+    // Caller holds logged_in_users_mutex
+    for (auto it = session_tokens.begin(); it != session_tokens.end();) {
+        if (it->second == user_id) it = session_tokens.erase(it);
+        else ++it;
+    }
+}
+
+bool Tracker::resume_session(int sock, const string& token) {
+    lock_guard<TimedMutex> session_lock(logged_in_users_mutex);
+    lock_guard<TimedMutex> socket_lock(socket_to_user_mutex);
+    auto it = session_tokens.find(token);
+    if (it == session_tokens.end() || !logged_in_users.count(it->second)) {
+        return false;
+    }
+    socket_to_user[sock] = it->second;
+    return true;
+}
+
+bool Tracker::hosts_group(const string& group_id) const {
+    for (int owner : ring.owners(group_id)) {
+        if (owner == tracker_index) return true;
+    }
+    return false;
+}
+
+bool Tracker::require_hosted_group(int sock, const string& group_id) {
+    if (hosts_group(group_id)) return true;
+    send_response(sock, "error :  Group " + group_id + " is not hosted on this tracker.");
+    return false;
+}
+
 // --- Tracker Synchronization Logic ---
 
-void Tracker::listen_for_tracker() {
+void Tracker::listen_for_trackers() {
     int listener_socket = socket(AF_INET, SOCK_STREAM, 0);
     int opt = 1;
     setsockopt(listener_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
@@ -633,138 +1281,376 @@ void Tracker::listen_for_tracker() {
     sockaddr_in sync_addr;
     sync_addr.sin_family = AF_INET;
     sync_addr.sin_addr.s_addr = INADDR_ANY;
-    sync_addr.sin_port = htons(port + 100); 
+    sync_addr.sin_port = htons(port + SYNC_PORT_OFFSET);
 
     if (bind(listener_socket, (struct sockaddr*)&sync_addr, sizeof(sync_addr)) < 0) {
-        log_msg("sync bind failed on port " + to_string(port+100));
+        LOG_ERROR("sync bind failed on port " + to_string(port + SYNC_PORT_OFFSET));
         close(listener_socket);
         return;
     }
-    listen(listener_socket, 1);
+    listen(listener_socket, 16);
     
-    log_msg("Listening for other tracker on port " + to_string(port + 100));
-
-    int sync_sock = accept(listener_socket, nullptr, nullptr);
-    close(listener_socket);
+    log_msg("Listening for other trackers on port " + to_string(port + SYNC_PORT_OFFSET));
 
-    if (sync_sock > 0) {
-        log_msg("Other tracker connected for synchronization.");
-        {
-            lock_guard<mutex> lock(other_tracker_socket_mutex);
-            other_tracker_socket = sync_sock;
-        }
-        handle_sync_connection(sync_sock);
+    // Lower-numbered trackers dial us; the first line they send identifies them
+    while (true) {
+        int sync_sock = accept(listener_socket, nullptr, nullptr);
+        if (sync_sock < 0) continue;
+        thread t(&Tracker::handle_sync_connection, this, sync_sock, -1);
+        t.detach();
     }
 }
 
+void Tracker::connect_to_peer_trackers() {
+    // Every pair of trackers shares one sync connection, dialed by the lower-numbered
+    // tracker. Keep retrying so that trackers started later (or restarted) are picked up.
+    set<int> reported_down;
+    while (true) {
+        for (int peer = tracker_index + 1; peer < (int)tracker_addresses.size(); ++peer) {
+            {
+                lock_guard<TimedMutex> lock(peer_sockets_mutex);
+                if (peer_sync_sockets.count(peer)) continue;
+            }
 
-void Tracker::connect_to_other_tracker() {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(other_tracker_port + 100);
-    server_addr.sin_addr.s_addr = inet_addr(other_tracker_addr.c_str());
-
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        log_msg("Could not connect to other tracker. Will operate in standalone mode.");
-        close(sock);
-        return;
-    }
-    
-    log_msg("Connected to other tracker.");
-    {
-        lock_guard<mutex> lock(other_tracker_socket_mutex);
-        other_tracker_socket = sock;
+            const string& peer_line = tracker_addresses[peer];
+            size_t delim_pos = peer_line.find(':');
+            string peer_ip = peer_line.substr(0, delim_pos);
+            int peer_port = stoi(peer_line.substr(delim_pos + 1));
+
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in server_addr;
+            server_addr.sin_family = AF_INET;
+            server_addr.sin_port = htons(peer_port + SYNC_PORT_OFFSET);
+            server_addr.sin_addr.s_addr = inet_addr(peer_ip.c_str());
+
+            if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+                if (!reported_down.count(peer)) {
+                    log_msg("Could not connect to tracker " + to_string(peer + 1) + ". Will keep retrying.");
+                    reported_down.insert(peer);
+                }
+                close(sock);
+                continue;
+            }
+            reported_down.erase(peer);
+
+            string hello = "synced_HELLO " + to_string(tracker_index) + "\n";
+            send(sock, hello.c_str(), hello.length(), 0);
+            log_msg("Connected to tracker " + to_string(peer + 1) + ".");
+            {
+                lock_guard<TimedMutex> lock(peer_sockets_mutex);
+                peer_sync_sockets[peer] = sock;
+            }
+            thread t(&Tracker::handle_sync_connection, this, sock, peer);
+            t.detach();
+        }
+        this_thread::sleep_for(chrono::seconds(2));
     }
-    handle_sync_connection(sock);
 }
 
-void Tracker::handle_sync_connection(int sync_socket) {
-    char buffer[size_piece] = {0};
-    while (read(sync_socket, buffer, size_piece) > 0) {
-        string sync_command_str(buffer);
-        auto args = parse(sync_command_str, " ");
-        if (!args.empty()) {
+void Tracker::handle_sync_connection(int sync_socket, int peer_index) {
+    // Sync messages are newline-terminated so that messages coalesced by TCP
+    // are still applied one by one.
+    PooledBuffer buffer(read_buffers());
+    string pending;
+    ssize_t bytes_read;
+    while ((bytes_read = read(sync_socket, buffer.get(), READ_BUFFER_BYTES)) > 0) {
+        pending.append(buffer.get(), bytes_read);
+        size_t newline;
+        while ((newline = pending.find('\n')) != string::npos) {
+            string sync_command_str = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            auto args = parse(sync_command_str, " ");
+            if (args.empty() || args[0].empty()) continue;
+
+            if (args[0] == "synced_HELLO" && args.size() == 2) {
+                peer_index = stoi(args[1]);
+                log_msg("Tracker " + to_string(peer_index + 1) + " connected for synchronization.");
+                lock_guard<TimedMutex> lock(peer_sockets_mutex);
+                if (peer_sync_sockets.count(peer_index) && peer_sync_sockets[peer_index] != sync_socket) {
+                    shutdown(peer_sync_sockets[peer_index], SHUT_RDWR);
+                }
+                peer_sync_sockets[peer_index] = sync_socket;
+                continue;
+            }
+            if (peer_index >= 0 && peer_index < (int)tracker_addresses.size()) {
+                sync_stats[peer_index].received++;
+                sync_stats[peer_index].last_received_ms = chrono::duration_cast<chrono::milliseconds>(
+                    chrono::steady_clock::now().time_since_epoch()).count();
+            }
             process_sync_command(args);
         }
-        memset(buffer, 0, size_piece);
     }
-    log_msg("Connection with other tracker lost.");
+    log_msg("Connection with tracker " + to_string(peer_index + 1) + " lost.");
     {
-        lock_guard<mutex> lock(other_tracker_socket_mutex);
-        if (other_tracker_socket == sync_socket) {
-            close(other_tracker_socket);
-            other_tracker_socket = -1;
+        lock_guard<TimedMutex> lock(peer_sockets_mutex);
+        if (peer_sync_sockets.count(peer_index) && peer_sync_sockets[peer_index] == sync_socket) {
+            peer_sync_sockets.erase(peer_index);
         }
     }
+    close(sync_socket);
+}
+
+void Tracker::send_sync_to_peer(int peer_index, const string& message) {
+    lock_guard<TimedMutex> lock(peer_sockets_mutex);
+    auto it = peer_sync_sockets.find(peer_index);
+    if (it == peer_sync_sockets.end()) return;
+
+    string framed = message + "\n";
+    if (send(it->second, framed.c_str(), framed.length(), MSG_NOSIGNAL) < 0) {
+        LOG_WARN("Failed to send sync message. Tracker " + to_string(peer_index + 1) + " may be down.");
+        sync_stats[peer_index].failed++;
+        shutdown(it->second, SHUT_RDWR);
+        peer_sync_sockets.erase(it);
+    } else {
+        sync_stats[peer_index].sent++;
+        LOG_DEBUG("Sent sync message to tracker " + to_string(peer_index + 1) + ": " + message);
+    }
 }
 
 void Tracker::send_sync_message(const string& message) {
-    lock_guard<mutex> lock(other_tracker_socket_mutex);
-    if (other_tracker_socket != -1) {
-        if(send(other_tracker_socket, message.c_str(), message.length(), 0) < 0) {
-            log_msg("Failed to send sync message. Other tracker may be down.");
-            close(other_tracker_socket);
-            other_tracker_socket = -1;
-        } else {
-            log_msg("Sent sync message: " + message);
-        }
+    for (int peer = 0; peer < (int)tracker_addresses.size(); ++peer) {
+        if (peer != tracker_index) send_sync_to_peer(peer, message);
+    }
+}
+
+void Tracker::send_group_sync_message(const string& group_id, const string& message) {
+    for (int owner : ring.owners(group_id)) {
+        if (owner != tracker_index) send_sync_to_peer(owner, message);
     }
 }
 
 void Tracker::process_sync_command(const vector<string>& args) {
     const string& command = args[0];
-    log_msg("Received sync command: " + args[0]);
+    LOG_DEBUG("Received sync command: " + args[0]);
 
     if (command == "synced_CREATE_USER") {
-        lock_guard<mutex> lock(users_mutex);
+        lock_guard<TimedMutex> lock(users_mutex);
         users[args[1]] = args[2];
     } else if (command == "synced_LOGIN") {
-        lock_guard<mutex> lock(logged_in_users_mutex);
+        lock_guard<TimedMutex> lock(logged_in_users_mutex);
         logged_in_users[args[1]] = args[2];
+        if (args.size() > 3) {
+            drop_session_tokens(args[1]);
+            session_tokens[args[3]] = args[1];
+        }
     } else if (command == "synced_LOGOUT") {
-        lock_guard<mutex> lock(logged_in_users_mutex);
-        logged_in_users.erase(args[1]);
-        lock_guard<mutex> g_lock(groups_mutex);
-        for(auto& g_pair : groups) for(auto& f_pair : g_pair.second.files) f_pair.second.seeders.erase(args[2]);
+        {
+            lock_guard<TimedMutex> lock(logged_in_users_mutex);
+            logged_in_users.erase(args[1]);
+            drop_session_tokens(args[1]);
+        }
+        {
+            // The client may also hold a session on this tracker
+            lock_guard<TimedMutex> lock(socket_to_user_mutex);
+            for (auto it = socket_to_user.begin(); it != socket_to_user.end();) {
+                if (it->second == args[1]) it = socket_to_user.erase(it);
+                else ++it;
+            }
+        }
+        lock_guard<TimedMutex> g_lock(groups_mutex);
+        for(auto& g_pair : groups) for(auto& f_pair : g_pair.second.files) remove_seeder(f_pair.second, args[2]);
+        forget_seeder(args[2]);
     } else if (command == "synced_CREATE_GROUP") {
-        lock_guard<mutex> lock(groups_mutex);
-        Group g; g.group_id = args[1]; g.owner_id = args[2]; g.members.insert(args[2]); groups[args[1]] = g;
+        lock_guard<TimedMutex> lock(groups_mutex);
+        // Filled in place: files synced ahead of the group must not be dropped uncounted
+        Group& g = groups[args[1]]; g.group_id = args[1]; g.owner_id = args[2]; g.members.insert(args[2]);
     } else if (command == "synced_JOIN_GROUP") {
-        lock_guard<mutex> lock(groups_mutex);
+        lock_guard<TimedMutex> lock(groups_mutex);
         if(groups.count(args[1])) groups.at(args[1]).pending_requests.insert(args[2]);
     } else if (command == "synced_LEAVE_GROUP") {
-        lock_guard<mutex> lock(groups_mutex);
+        lock_guard<TimedMutex> lock(groups_mutex);
         if(groups.count(args[1])) groups.at(args[1]).members.erase(args[2]);
     } else if (command == "synced_ACCEPT_REQUEST") {
-        lock_guard<mutex> lock(groups_mutex);
+        lock_guard<TimedMutex> lock(groups_mutex);
         if(groups.count(args[1])) {
             groups.at(args[1]).pending_requests.erase(args[2]);
             groups.at(args[1]).members.insert(args[2]);
         }
     } else if (command == "synced_UPLOAD") {
-        lock_guard<mutex> lock(groups_mutex);
+        lock_guard<TimedMutex> lock(groups_mutex);
         const string& group_id = args[1];
         const string& filename = args[2];
-        FileInfo& file = groups[group_id].files[filename];
+        Group& group = groups[group_id];
+        if (!group.files.count(filename)) file_count++;
+        FileInfo& file = group.files[filename];
+        unindex_file_pieces(group_id, file);
         file.filename = filename;
         file.file_size = stoll(args[3]);
         file.file_hash = args[4];
-        for(size_t i = 5; i < args.size() - 1; ++i) file.piece_hashes[i-5] = args[i];
-        file.seeders.insert(args.back());
+        size_t hashes_end = args.size() - 1;
+        if (!take_file_options(args, 5, hashes_end, file)) file.bundle_manifest.clear();
+        for(size_t i = 5; i < hashes_end; ++i) file.piece_hashes[i-5] = args[i];
+        if (!valid_weak_checksums(file.weak_checksums, file.piece_hashes.size())) file.weak_checksums.clear();
+        add_seeder(file, args.back());
+        index_file_pieces(group_id, file);
     } else if (command == "synced_STOP_SHARE") {
-        lock_guard<mutex> lock(groups_mutex);
+        lock_guard<TimedMutex> lock(groups_mutex);
         if(groups.count(args[1]) && groups.at(args[1]).files.count(args[2])) {
-            groups.at(args[1]).files.at(args[2]).seeders.erase(args[3]);
+            remove_seeder(groups.at(args[1]).files.at(args[2]), args[3]);
+        }
+    } else if (command == "synced_EVICT_SEEDER") {
+        // Another tracker stopped hearing from this seeder. If it still heartbeats to us
+        // it is only partitioned from that tracker, so keep it.
+        {
+            lock_guard<TimedMutex> lock(seeders_mutex);
+            auto it = seeder_last_seen.find(args[1]);
+            if (it != seeder_last_seen.end() && wheel_tick - it->second < SEEDER_TIMEOUT_S) return;
+        }
+        evict_seeder(args[1]);
+    } else if (command == "synced_BATCH" && args.size() > 3) {
+        lock_guard<TimedMutex> lock(groups_mutex);
+        Group& group = groups[args[1]];
+        for (const auto& item : split_batch_items(args, 3)) {
+            if (!item.empty()) apply_batch_item(args[1], group, item, args[2], true);
         }
     } else if (command == "synced_ADD_SEEDER") {
-        lock_guard<mutex> lock(groups_mutex);
+        lock_guard<TimedMutex> lock(groups_mutex);
         if(groups.count(args[1]) && groups.at(args[1]).files.count(args[2])) {
-            groups.at(args[1]).files.at(args[2]).seeders.insert(args[3]);
+            add_seeder(groups.at(args[1]).files.at(args[2]), args[3]);
         }
     }
 }
 
+// --- Metrics ---
+
+void Tracker::listen_for_admin() {
+    // A local admin socket that answers any HTTP GET with the metrics, so that both
+    // Prometheus and curl can read it. Only 127.0.0.1 can connect.
+    int listener_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(listener_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in admin_addr;
+    admin_addr.sin_family = AF_INET;
+    admin_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    admin_addr.sin_port = htons(port + ADMIN_PORT_OFFSET);
+    if (bind(listener_socket, (struct sockaddr*)&admin_addr, sizeof(admin_addr)) < 0) {
+        LOG_WARN("Admin bind failed on port " + to_string(port + ADMIN_PORT_OFFSET) + "; metrics are disabled.");
+        close(listener_socket);
+        return;
+    }
+    listen(listener_socket, 16);
+    log_msg("Serving metrics on http://127.0.0.1:" + to_string(port + ADMIN_PORT_OFFSET) + "/metrics");
+
+    while (true) {
+        int sock = accept(listener_socket, nullptr, nullptr);
+        if (sock < 0) continue;
+        // Scrapes are served one at a time; a client that never sends its request
+        // only holds the loop for a second
+        timeval timeout = {1, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        string request;
+        char buffer[4096];
+        ssize_t n;
+        while (request.find("\r\n\r\n") == string::npos && request.size() < 65536
+               && (n = read(sock, buffer, sizeof(buffer))) > 0) {
+            request.append(buffer, n);
+        }
+        string body = render_metrics();
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                          + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        send(sock, response.c_str(), response.size(), MSG_NOSIGNAL);
+        close(sock);
+    }
+}
+
+// Thread count of this process, from /proc
+static int process_threads() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 8, "Threads:") == 0) return stoi(line.substr(8));
+    }
+    return 0;
+}
+
+string Tracker::render_metrics() {
+    stringstream out;
+    auto now = chrono::steady_clock::now();
+    auto gauge = [&](const string& name, const string& help, double value) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n" << name << " " << value << "\n";
+    };
+    gauge("p2p_tracker_uptime_seconds", "Time since the tracker started.",
+          chrono::duration<double>(now - started_at).count());
+    gauge("p2p_tracker_active_connections", "Client connections currently open.", active_clients.load());
+    gauge("p2p_tracker_threads", "Threads in the tracker process.", process_threads());
+    gauge("p2p_tracker_read_buffers", "Pooled connection read buffers in use or free.", read_buffers().slab_buffers());
+    out << "# HELP p2p_tracker_read_buffer_overflows_total Read buffers allocated because the pool was exhausted.\n"
+        << "# TYPE p2p_tracker_read_buffer_overflows_total counter\n"
+        << "p2p_tracker_read_buffer_overflows_total " << read_buffers().overflows() << "\n";
+
+    // Catalog sizes, each read under its own lock
+    size_t user_count, online_count, token_count, group_count, hash_count;
+    size_t heartbeat_count;
+    {
+        lock_guard<TimedMutex> lock(users_mutex);
+        user_count = users.size();
+    }
+    {
+        lock_guard<TimedMutex> lock(logged_in_users_mutex);
+        online_count = logged_in_users.size();
+        token_count = session_tokens.size();
+    }
+    {
+        lock_guard<TimedMutex> lock(groups_mutex);
+        group_count = groups.size();
+        hash_count = piece_index.size();
+    }
+    {
+        lock_guard<TimedMutex> lock(seeders_mutex);
+        heartbeat_count = seeder_last_seen.size();
+    }
+    gauge("p2p_tracker_users", "Registered users.", user_count);
+    gauge("p2p_tracker_logged_in_users", "Users with a live session.", online_count);
+    gauge("p2p_tracker_session_tokens", "Session tokens that can be resumed.", token_count);
+    gauge("p2p_tracker_groups", "Groups known to this tracker.", group_count);
+    gauge("p2p_tracker_files", "Files shared across all groups.", file_count.load());
+    gauge("p2p_tracker_file_seeders", "Seeder entries summed over all files.", seeder_entry_count.load());
+    gauge("p2p_tracker_indexed_piece_hashes", "Distinct piece hashes in the deduplication index.", hash_count);
+    gauge("p2p_tracker_heartbeating_seeders", "Seeders tracked by the expiry wheel.", heartbeat_count);
+
+    // Replication: sync messages are sent synchronously, so the backlog towards a peer
+    // is what its socket has not had acknowledged yet
+    map<int, int> unacked; // connected peer -> bytes
+    {
+        lock_guard<TimedMutex> lock(peer_sockets_mutex);
+        for (const auto& peer : peer_sync_sockets) {
+            int bytes = 0;
+            ioctl(peer.second, SIOCOUTQ, &bytes);
+            unacked[peer.first] = bytes;
+        }
+    }
+    long long now_ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count();
+    auto per_peer = [&](const string& name, const string& type, const string& help,
+                        const function<double(int peer)>& value) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+        for (int peer = 0; peer < (int)tracker_addresses.size(); ++peer) {
+            if (peer == tracker_index) continue;
+            out << name << "{peer=\"" << peer + 1 << "\"} " << value(peer) << "\n";
+        }
+    };
+    per_peer("p2p_tracker_sync_peer_up", "gauge", "Whether the sync connection to a peer tracker is open.",
+             [&](int peer) { return (double)unacked.count(peer); });
+    per_peer("p2p_tracker_sync_unacked_bytes", "gauge", "Sync bytes sent to a peer tracker and not yet acknowledged.",
+             [&](int peer) { return unacked.count(peer) ? (double)unacked.at(peer) : 0.0; });
+    per_peer("p2p_tracker_sync_sent_total", "counter", "Sync messages sent to a peer tracker.",
+             [&](int peer) { return (double)sync_stats[peer].sent.load(); });
+    per_peer("p2p_tracker_sync_send_failures_total", "counter", "Sync messages that could not be sent to a peer tracker.",
+             [&](int peer) { return (double)sync_stats[peer].failed.load(); });
+    per_peer("p2p_tracker_sync_received_total", "counter", "Sync messages applied from a peer tracker.",
+             [&](int peer) { return (double)sync_stats[peer].received.load(); });
+    per_peer("p2p_tracker_sync_last_received_age_seconds", "gauge",
+             "Time since the last sync message from a peer tracker (-1 if none yet).",
+             [&](int peer) {
+                 long long last = sync_stats[peer].last_received_ms.load();
+                 return last == 0 ? -1.0 : (now_ms - last) / 1000.0;
+             });
+
+    string text = out.str();
+    render_thread_metrics(text);
+    return text;
+}
+
 // --- Main Function ---
 int main(int argc, char* argv[]) {
     if (argc != 3) {
@@ -7,6 +7,12 @@
 #include <set>
 #include <mutex>
 #include <thread>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include "utils.h"
+#include "metrics.h"
 
 using namespace std;
 
@@ -16,6 +22,78 @@ struct FileInfo {
     string file_hash;
     map<int, string> piece_hashes;
     set<string> seeders; // client_ip:port
+    string weak_checksums; // comma-separated hex rolling checksum per piece, empty if not sent
+    string bundle_manifest; // "<path>:<size>,..." (percent-escaped) for a directory bundle, empty for a single file
+    int shared_pieces = 0; // pieces whose content is indexed more than once, kept by index_file_pieces
+};
+
+// Listing replies are streamed in frames of at most this many names, and at most
+// LIST_SCAN_BUDGET catalog entries are examined per groups_mutex hold.
+const size_t LIST_FRAME_NAMES = 1000;
+const size_t LIST_SCAN_BUDGET = 4096;
+
+// Options of list_files / list_groups: prefix=<p> contains=<s> after=<cursor> limit=<n>
+struct ListQuery {
+    string prefix;
+    string contains;
+    string after; // resume strictly after this name
+    size_t limit = 0; // 0 = no limit
+};
+
+// "batch" carries at most this many items, all applied under one groups_mutex hold
+const size_t BATCH_MAX_ITEMS = 10000;
+
+// download_file returns at most this many seeders, sampled by load
+const size_t SEEDER_REPLY_LIMIT = 8;
+// Bounds on the alternate-source scan of download_file: other hosted pieces looked at
+// per piece, and distinct alternate seeders considered per reply
+const size_t ALT_REFS_PER_PIECE = 16;
+const size_t ALT_CANDIDATE_LIMIT = 64;
+// Load reports older than this are ignored
+const int SEEDER_LOAD_TTL_MS = 10000;
+
+// Seeders that send no heartbeat for this long are evicted from every file.
+// Expiry is tracked on a timing wheel of one-second slots that must span the timeout.
+const int SEEDER_TIMEOUT_S = 30;
+const int EXPIRY_WHEEL_SLOTS = 64;
+
+// Connections read into pooled buffers of READ_BUFFER_BYTES; the pool keeps at most
+// READ_BUFFER_POOL_SIZE of them
+const size_t READ_BUFFER_BYTES = 64 * 1024;
+const size_t READ_BUFFER_POOL_SIZE = 1024;
+// Longest command line accepted. A full batch of BATCH_MAX_ITEMS items fits, and so do
+// the piece hashes of a file of several hundred GB; a connection that sends more
+// without a newline is closed.
+const size_t MAX_COMMAND_BYTES = 64 * 1024 * 1024;
+
+// Prometheus metrics are served over HTTP on 127.0.0.1, on the client port plus this offset
+const int ADMIN_PORT_OFFSET = 200;
+
+// Traffic on the sync connection to one peer tracker
+struct SyncPeerStats {
+    atomic<uint64_t> sent{0};
+    atomic<uint64_t> failed{0};
+    atomic<uint64_t> received{0};
+    atomic<long long> last_received_ms{0}; // steady clock, 0 until a message arrives
+};
+
+// Load a seeder reported with its last heartbeat
+struct SeederLoad {
+    int active_uploads = 0;
+    long long spare_kbps = 0;
+    chrono::steady_clock::time_point reported_at;
+};
+
+// One piece of a hosted file, as stored in the piece-hash index
+struct PieceRef {
+    string group_id;
+    string filename;
+    int index;
+    bool operator<(const PieceRef& other) const {
+        if (group_id != other.group_id) return group_id < other.group_id;
+        if (filename != other.filename) return filename < other.filename;
+        return index < other.index;
+    }
 };
 
 struct Group {
@@ -34,12 +112,16 @@ public:
 private:
     void listen_for_clients();
     void handle_client(int client_socket, const string& client_addr);
-    void listen_for_tracker();
-    void handle_sync_connection(int sync_socket);
-    void connect_to_other_tracker();
+    void listen_for_trackers();
+    void handle_sync_connection(int sync_socket, int peer_index);
+    void connect_to_peer_trackers();
     void process_command(int client_socket, const string& client_addr, const vector<string>& args);
     void process_sync_command(const vector<string>& args);
-    void send_sync_message(const string& message);
+    void send_sync_message(const string& message); // to every peer tracker
+    void send_group_sync_message(const string& group_id, const string& message); // to the group's replicas
+    void send_sync_to_peer(int peer_index, const string& message);
+    void listen_for_admin();
+    string render_metrics();
 
     // Command handlers
     void create_user(int sock, const vector<string>& args);
@@ -50,38 +132,82 @@ private:
     void leave_group(int sock, const vector<string>& args);
     void list_requests(int sock, const vector<string>& args);
     void accept_request(int sock, const vector<string>& args);
-    void list_groups(int sock);
+    void list_groups(int sock, const vector<string>& args);
     void list_files(int sock, const vector<string>& args);
+    void stream_listing(int sock, const ListQuery& query, const string& empty_message,
+                        const function<bool(size_t max_names, string& cursor, vector<string>& page, bool& done)>& next_page);
     void upload_file(int sock, const vector<string>& args);
     void download_file(int sock, const vector<string>& args);
     void stop_share(int sock, const vector<string>& args);
     void i_am_seeder(int sock, const vector<string>& args); // New command for completed downloads
+    void batch(int sock, const vector<string>& args);
+    string apply_batch_item(const string& group_id, Group& group, const vector<string>& item,
+                            const string& seeder_addr, bool member);
+    void ping(int sock, const vector<string>& args);
 
     // Helper methods
     string get_user_id_from_socket(int sock);
     string get_address_from_user_id(const string& user_id);
+    bool resume_session(int sock, const string& token);
+    void drop_session_tokens(const string& user_id);
+    vector<string> select_seeders(const set<string>& seeders);
+    void index_file_pieces(const string& group_id, FileInfo& file);
+    void unindex_file_pieces(const string& group_id, FileInfo& file);
+    void count_shared_piece(const PieceRef& ref, int delta);
+    FileInfo& store_file(const string& group_id, Group& group, const FileInfo& file);
+    void add_seeder(FileInfo& file, const string& seeder_addr);
+    void remove_seeder(FileInfo& file, const string& seeder_addr);
+    string partial_sources(const string& group_id, const FileInfo& file);
+    void touch_seeder(const string& seeder_addr);
+    void forget_seeder(const string& seeder_addr);
+    void run_expiry_wheel();
+    void evict_seeder(const string& seeder_addr);
+    bool hosts_group(const string& group_id) const;
+    bool require_hosted_group(int sock, const string& group_id);
     
     // Server state
     string ip_addr;
     int port;
-    string other_tracker_addr;
-    int other_tracker_port;
     int tracker_id;
+    int tracker_index; // tracker_id - 1, position in tracker_info.txt
     int server_socket;
 
+    // Cluster layout
+    vector<string> tracker_addresses; // ip:port of every tracker
+    HashRing ring; // group_id -> replica trackers
+
     // Synchronized data
     map<string, string> users; // user_id -> password
     map<string, string> logged_in_users; // user_id -> client_ip:port
     map<int, string> socket_to_user; // client_socket -> user_id
+    set<int> login_sockets; // sockets that carried an actual login, guarded by socket_to_user_mutex
+    map<string, string> session_tokens; // session token -> user_id, guarded by logged_in_users_mutex
     map<string, Group> groups;
+    map<string, set<PieceRef>> piece_index; // piece hash -> hosted pieces with that content, guarded by groups_mutex
+
+    map<string, SeederLoad> seeder_loads; // client_ip:port -> last reported load
+    map<string, long long> seeder_last_seen; // client_ip:port -> wheel tick of last heartbeat
+    map<string, long long> seeder_expiry; // client_ip:port -> tick its wheel entry fires at
+    vector<vector<string>> expiry_wheel; // slot -> seeders due at that tick
+    long long wheel_tick = 0;
+
+    // Mutexes, instrumented for lock wait metrics
+    TimedMutex users_mutex{LOCK_USERS};
+    TimedMutex logged_in_users_mutex{LOCK_SESSIONS};
+    TimedMutex groups_mutex{LOCK_GROUPS};
+    TimedMutex socket_to_user_mutex{LOCK_SOCKETS};
+    TimedMutex seeders_mutex{LOCK_SEEDERS}; // guards seeder_loads, seeder_last_seen, seeder_expiry and the wheel
+    TimedMutex peer_sockets_mutex{LOCK_PEER_SOCKETS};
+    map<int, int> peer_sync_sockets; // peer tracker index -> sync socket
 
-    // Mutexes
-    mutex users_mutex;
-    mutex logged_in_users_mutex;
-    mutex groups_mutex;
-    mutex socket_to_user_mutex;
-    mutex other_tracker_socket_mutex;
-    int other_tracker_socket = -1;
+    // Metrics that are not per-thread
+    chrono::steady_clock::time_point started_at;
+    atomic<int> active_clients{0};
+    // Catalog sizes, kept in step by store_file and the seeder helpers so a scrape
+    // does not walk every file under groups_mutex
+    atomic<long long> file_count{0};
+    atomic<long long> seeder_entry_count{0};
+    unique_ptr<SyncPeerStats[]> sync_stats; // by peer tracker index
 };
 
 #endif // TRACKER_H
\ No newline at end of file
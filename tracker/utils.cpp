@@ -2,6 +2,17 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
 #include <openssl/sha.h>
 
 using namespace std;
@@ -29,6 +40,244 @@ vector<string> parse(const string& str, const string& delimiter) {
     return tokens;
 }
 
+// Bounded multi-producer queue of log lines (after Vyukov). A slot whose sequence
+// equals a producer's ticket is free for it; once written, its sequence moves one
+// ahead and the writer thread may take it. Producers never wait on each other or
+// on the console.
+class AsyncLog {
+public:
+    AsyncLog() : slots(new Slot[LOG_QUEUE_SLOTS]), tail(0), head(0), dropped(0) {
+        for (int i = 0; i < LOG_QUEUE_SLOTS; ++i) slots[i].sequence.store(i, memory_order_relaxed);
+        thread(&AsyncLog::run, this).detach();
+        atexit(log_flush);
+    }
+
+    void push(int level, const string& msg) {
+        uint64_t pos = tail.load(memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots[pos & (LOG_QUEUE_SLOTS - 1)];
+            int64_t diff = (int64_t)slot->sequence.load(memory_order_acquire) - (int64_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+        slot->level = level;
+        slot->length = min(msg.size(), (size_t)LOG_LINE_MAX);
+        memcpy(slot->text, msg.data(), slot->length);
+        slot->sequence.store(pos + 1, memory_order_release);
+    }
+
+    // Write out every message queued so far in one go; returns how many there were
+    size_t drain() {
+        lock_guard<mutex> lock(writer_mutex);
+        batch.clear();
+        size_t count = 0;
+        while (true) {
+            Slot& slot = slots[head & (LOG_QUEUE_SLOTS - 1)];
+            if (slot.sequence.load(memory_order_acquire) != head + 1) break;
+            batch += "[log] ";
+            if (slot.level == LOG_LEVEL_DEBUG) batch += "debug: ";
+            else if (slot.level == LOG_LEVEL_WARN) batch += "warning: ";
+            else if (slot.level >= LOG_LEVEL_ERROR) batch += "error: ";
+            batch.append(slot.text, slot.length);
+            batch += '\n';
+            slot.sequence.store(head + LOG_QUEUE_SLOTS, memory_order_release);
+            ++head;
+            ++count;
+        }
+        long long lost = dropped.exchange(0, memory_order_relaxed);
+        if (lost > 0) batch += "[log] " + to_string(lost) + " messages dropped: log queue full\n";
+        if (!batch.empty()) {
+            fwrite(batch.data(), 1, batch.size(), stdout);
+            fflush(stdout);
+        }
+        return count;
+    }
+
+private:
+    struct Slot {
+        atomic<uint64_t> sequence;
+        int level;
+        size_t length;
+        char text[LOG_LINE_MAX];
+    };
+
+    void run() {
+        while (true) {
+            if (drain() == 0) this_thread::sleep_for(chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        }
+    }
+
+    Slot* slots;
+    atomic<uint64_t> tail;
+    uint64_t head; // only touched under writer_mutex
+    atomic<long long> dropped;
+    mutex writer_mutex;
+    string batch;
+};
+
+// Leaked on purpose: threads may still log while static destructors run at exit
+static AsyncLog& async_log() {
+    static AsyncLog* log = new AsyncLog();
+    return *log;
+}
+
+void log_at(int level, const string& msg) {
+    async_log().push(level, msg);
+}
+
+void log_flush() {
+    async_log().drain();
+}
+
 void log_msg(const string& msg) {
-    cout << "[log] " << msg << endl;
-}
\ No newline at end of file
+    LOG_INFO(msg);
+}
+
+bool LogRateLimit::allow(long long& suppressed_since) {
+    long long now = chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+    long long next = next_ms.load(memory_order_relaxed);
+    if (now < next || !next_ms.compare_exchange_strong(next, now + interval_ms, memory_order_relaxed)) {
+        suppressed.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    suppressed_since = suppressed.exchange(0, memory_order_relaxed);
+    return true;
+}
+
+// The buffer a thread released last, kept for its next acquire and handed back to
+// its pool when the thread exits
+struct ThreadBufferCache {
+    BufferPool* pool = nullptr;
+    char* buffer = nullptr;
+    ~ThreadBufferCache() {
+        if (buffer) pool->release_shared(buffer);
+    }
+};
+static thread_local ThreadBufferCache thread_buffer;
+
+BufferPool::BufferPool(size_t buffer_bytes, size_t capacity)
+    : buffer_bytes(buffer_bytes), capacity(capacity), carved(0), overflow_total(0) {
+    void* region = mmap(nullptr, buffer_bytes * capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        // Without a slab every buffer is an overflow buffer
+        slab = nullptr;
+        this->capacity = 0;
+    } else {
+        slab = static_cast<char*>(region);
+    }
+    free_buffers.reserve(this->capacity);
+}
+
+char* BufferPool::acquire() {
+    if (thread_buffer.pool == this && thread_buffer.buffer) {
+        char* buffer = thread_buffer.buffer;
+        thread_buffer.buffer = nullptr;
+        return buffer;
+    }
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        if (!free_buffers.empty()) {
+            char* buffer = free_buffers.back();
+            free_buffers.pop_back();
+            return buffer;
+        }
+        if (carved < capacity) return slab + buffer_bytes * carved++;
+    }
+    overflow_total++;
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), buffer_bytes) != 0) throw bad_alloc();
+    return static_cast<char*>(buffer);
+}
+
+void BufferPool::release(char* buffer) {
+    if (!in_slab(buffer)) {
+        free(buffer);
+        return;
+    }
+    if (thread_buffer.buffer) {
+        release_shared(buffer);
+        return;
+    }
+    thread_buffer.pool = this;
+    thread_buffer.buffer = buffer;
+}
+
+void BufferPool::release_shared(char* buffer) {
+    lock_guard<mutex> lock(pool_mutex);
+    free_buffers.push_back(buffer);
+}
+
+size_t BufferPool::slab_buffers() {
+    lock_guard<mutex> lock(pool_mutex);
+    return carved;
+}
+
+vector<string> load_tracker_addresses(const string& info_file) {
+    vector<string> addresses;
+    int fd = open(info_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return addresses;
+    }
+
+    string contents;
+    char buffer[4096];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, bytes_read);
+    }
+    close(fd);
+
+    stringstream ss(contents);
+    string line;
+    while (getline(ss, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) {
+            addresses.push_back(line);
+        }
+    }
+    return addresses;
+}
+
+HashRing::HashRing(const vector<string>& node_ids, int vnodes_per_node) : node_count(node_ids.size()) {
+    for (int node = 0; node < node_count; ++node) {
+        for (int v = 0; v < vnodes_per_node; ++v) {
+            ring[point(node_ids[node] + "#" + to_string(v))] = node;
+        }
+    }
+}
+
+uint64_t HashRing::point(const string& key) {
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(key.data()), key.size(), hash);
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value = (value << 8) | hash[i];
+    }
+    return value;
+}
+
+vector<int> HashRing::owners(const string& key, int replicas) const {
+    vector<int> result;
+    if (ring.empty()) return result;
+    if (replicas > node_count) replicas = node_count;
+
+    auto it = ring.lower_bound(point(key));
+    for (size_t steps = 0; steps < ring.size() && (int)result.size() < replicas; ++steps, ++it) {
+        if (it == ring.end()) it = ring.begin();
+        bool seen = false;
+        for (int node : result) {
+            if (node == it->second) seen = true;
+        }
+        if (!seen) result.push_back(it->second);
+    }
+    return result;
+}
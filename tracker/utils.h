@@ -3,6 +3,10 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
 #include <openssl/sha.h>
 
 using namespace std;
@@ -13,7 +17,137 @@ string sha(const char* data, size_t len);
 // Function to split a string by a delimiter
 vector<string> parse(const string& str, const string& delimiter);
 
-// Log message to console with a prefix
+// Log levels. Messages below LOG_MIN_LEVEL are compiled out together with the code
+// that builds them; pick the level at build time with make LOG_LEVEL=<n>.
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+// The log queue holds this many messages (a power of two) of up to LOG_LINE_MAX bytes;
+// longer ones are truncated. The writer thread polls it every LOG_FLUSH_INTERVAL_MS.
+const int LOG_QUEUE_SLOTS = 4096;
+const int LOG_LINE_MAX = 480;
+const int LOG_FLUSH_INTERVAL_MS = 10;
+
+// Queue a message for the background log writer. Never blocks on the console:
+// when the queue is full the message is dropped and counted instead.
+void log_at(int level, const string& msg);
+
+// Write out everything queued so far (also done at exit)
+void log_flush();
+
+// Log message to console with a prefix, at info level
 void log_msg(const string& msg);
 
+#define LOG_AT(level, msg) do { if ((level) >= LOG_MIN_LEVEL) log_at((level), (msg)); } while (0)
+#define LOG_DEBUG(msg) LOG_AT(LOG_LEVEL_DEBUG, msg)
+#define LOG_INFO(msg) LOG_AT(LOG_LEVEL_INFO, msg)
+#define LOG_WARN(msg) LOG_AT(LOG_LEVEL_WARN, msg)
+#define LOG_ERROR(msg) LOG_AT(LOG_LEVEL_ERROR, msg)
+
+// Lets one message through per interval and counts the rest
+class LogRateLimit {
+public:
+    explicit LogRateLimit(int interval_ms) : interval_ms(interval_ms), next_ms(0), suppressed(0) {}
+    // True if a message may be logged now; suppressed_since is how many were held back before it
+    bool allow(long long& suppressed_since);
+
+private:
+    int interval_ms;
+    atomic<long long> next_ms;
+    atomic<long long> suppressed;
+};
+
+// For per-piece messages: at most one per interval_ms from this call site, and the
+// next one that gets through says how many were suppressed in between
+#define LOG_EVERY_MS(level, interval_ms, msg) do { \
+        if ((level) >= LOG_MIN_LEVEL) { \
+            static LogRateLimit log_limit_(interval_ms); \
+            long long log_suppressed_; \
+            if (log_limit_.allow(log_suppressed_)) { \
+                log_at((level), log_suppressed_ > 0 ? string(msg) + " (" + to_string(log_suppressed_) + \
+                                                      " similar messages suppressed)" : string(msg)); \
+            } \
+        } \
+    } while (0)
+
+// Fixed-size, page-aligned I/O buffers carved from one slab and recycled, so busy
+// paths stop allocating and faulting in fresh pages. A thread keeps the buffer it
+// released last for its next acquire; other free buffers are shared. The slab holds
+// `capacity` buffers, which bounds the pool's memory: acquires beyond that get a
+// heap buffer that is freed again on release.
+class BufferPool {
+public:
+    BufferPool(size_t buffer_bytes, size_t capacity);
+    char* acquire();
+    void release(char* buffer);
+    size_t buffer_size() const { return buffer_bytes; }
+    size_t slab_buffers();         // slab buffers handed out so far, free or in use
+    long long overflows() const { return overflow_total.load(); } // heap buffers handed out
+
+private:
+    friend struct ThreadBufferCache;
+    bool in_slab(const char* buffer) const { return buffer >= slab && buffer < slab + buffer_bytes * capacity; }
+    void release_shared(char* buffer);
+
+    size_t buffer_bytes;
+    size_t capacity;
+    char* slab;                    // reserved up front, pages are faulted in on first use
+    mutex pool_mutex;
+    vector<char*> free_buffers;
+    size_t carved;                 // slab buffers handed out so far; guarded by pool_mutex
+    atomic<long long> overflow_total;
+};
+
+// A pool buffer for the current scope
+class PooledBuffer {
+public:
+    explicit PooledBuffer(BufferPool& pool) : pool(pool), data(pool.acquire()) {}
+    ~PooledBuffer() { pool.release(data); }
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    char* get() const { return data; }
+    // Hand the buffer to a new owner, who releases it to the pool, and carry on with a fresh one
+    char* take() {
+        char* taken = data;
+        data = pool.acquire();
+        return taken;
+    }
+
+private:
+    BufferPool& pool;
+    char* data;
+};
+
+// Read the "ip:port" lines of a tracker_info.txt file (blank lines skipped)
+vector<string> load_tracker_addresses(const string& info_file);
+
+// Number of trackers that hold a copy of every group shard
+const int TRACKER_REPLICATION_FACTOR = 2;
+// Trackers exchange sync messages on their client port plus this offset
+const int SYNC_PORT_OFFSET = 100;
+
+// Consistent-hash ring used to place group shards on trackers.
+// Each tracker is mapped to several virtual points so that adding or
+// removing a tracker only moves the groups adjacent to its points.
+class HashRing {
+public:
+    HashRing() {}
+    HashRing(const vector<string>& node_ids, int vnodes_per_node = 64);
+
+    // Up to `replicas` distinct node indices responsible for `key`, primary first
+    vector<int> owners(const string& key, int replicas = TRACKER_REPLICATION_FACTOR) const;
+    int size() const { return node_count; }
+
+private:
+    static uint64_t point(const string& key);
+
+    map<uint64_t, int> ring; // ring point -> node index
+    int node_count = 0;
+};
+
 #endif // UTILS_H
\ No newline at end of file